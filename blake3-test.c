@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "blake3.h"
+
+/*
+ * From the BLAKE3 test vectors; input byte i is i % 251.
+ */
+static const struct {
+	size_t len;
+	const char *hash;
+} vectors[] = {
+	{ 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+	{ 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+	{ 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+	{ 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+	{ 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+	{ 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+	{ 65536, "68d647e619a930e7b1082f74f334b0c65a315725569bdc123f0ee11881717bfe" },
+};
+
+#define NR_VECTORS	(sizeof(vectors) / sizeof(vectors[0]))
+
+static const char hex_digits[] = "0123456789abcdef";
+
+int main(int argc, char **argv)
+{
+	static unsigned char input[65536];
+	unsigned char hash[BLAKE3_OUT_LEN];
+	char string[BLAKE3_OUT_LEN * 2 + 1];
+	struct timeval start, end;
+	int i, j, failed = 0;
+
+	for (i = 0; i < sizeof(input); i ++)
+		input[i] = i % 251;
+
+	printf("implementation: %s\n", blake3_impl());
+
+	for (i = 0; i < NR_VECTORS; i ++) {
+		assert(vectors[i].len <= sizeof(input));
+
+		blake3(input, vectors[i].len, hash, BLAKE3_OUT_LEN);
+		for (j = 0; j < BLAKE3_OUT_LEN; j ++) {
+			string[j * 2] = hex_digits[hash[j] >> 4];
+			string[j * 2 + 1] = hex_digits[hash[j] & 0xf];
+		}
+		string[j * 2] = 0;
+
+		printf("%6zu %s %s\n", vectors[i].len, string,
+				strcmp(string, vectors[i].hash) ? "FAILED" : "ok");
+		if (strcmp(string, vectors[i].hash))
+			failed = 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; i ++)
+		blake3(input, sizeof(input), hash, 20);
+	gettimeofday(&end, NULL);
+
+	printf("1000 x %zu bytes in %ldus\n", sizeof(input),
+			(end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec);
+
+	return failed ? -1 : 0;
+}
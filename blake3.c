@@ -0,0 +1,357 @@
+
+/*
+ * BLAKE3, unkeyed hashing only. Inputs are split into 1KB chunks,
+ * whose chaining values are combined up a binary tree. The chunks
+ * are independent, so on CPUs with AVX2 eight of them are hashed
+ * at once, one per 32bit lane.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "blake3.h"
+
+#define BLOCK_LEN	64
+#define CHUNK_LEN	1024
+#define MAX_DEPTH	54	/* 2^54 chunks == 2^64 bytes */
+
+#define CHUNK_START	(1 << 0)
+#define CHUNK_END	(1 << 1)
+#define PARENT		(1 << 2)
+#define ROOT		(1 << 3)
+
+static const uint32_t iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*
+ * Message word order for each of the 7 rounds.
+ */
+static const uint8_t sched[7][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+	{  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+	{ 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+	{ 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+	{  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+	{ 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+static inline uint32_t rotr32(uint32_t w, unsigned c)
+{
+	return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define G(v, a, b, c, d, x, y) do { \
+	v[a] = v[a] + v[b] + (x); \
+	v[d] = rotr32(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d]; \
+	v[b] = rotr32(v[b] ^ v[c], 12); \
+	v[a] = v[a] + v[b] + (y); \
+	v[d] = rotr32(v[d] ^ v[a], 8); \
+	v[c] = v[c] + v[d]; \
+	v[b] = rotr32(v[b] ^ v[c], 7); \
+} while(0)
+
+/*
+ * Updates 'cv' in place.
+ */
+static void compress(uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+		uint32_t block_len, uint32_t flags)
+{
+	uint32_t v[16];
+	int i, r;
+
+	for (i = 0; i < 8; i ++)
+		v[i] = cv[i];
+	for (i = 0; i < 4; i ++)
+		v[i + 8] = iv[i];
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	for (r = 0; r < 7; r ++) {
+		const uint8_t *s = sched[r];
+
+		G(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+		G(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+		G(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+		G(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+		G(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+		G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+		G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i ++)
+		cv[i] = v[i] ^ v[i + 8];
+}
+
+static void load_block(uint32_t m[16], const unsigned char *data,
+		unsigned len)
+{
+	unsigned char block[BLOCK_LEN];
+	int i;
+
+	if (len < BLOCK_LEN) {
+		memset(block, 0, BLOCK_LEN);
+		memcpy(block, data, len);
+		data = block;
+	}
+
+	for (i = 0; i < 16; i ++)
+		m[i] = load32(data + i * 4);
+}
+
+/*
+ * Chaining value of a single chunk, 'len' <= CHUNK_LEN.
+ */
+static void chunk_cv(const unsigned char *data, size_t len, uint64_t counter,
+		uint32_t root, uint32_t cv[8])
+{
+	uint32_t m[16], flags;
+	unsigned block_len;
+
+	memcpy(cv, iv, sizeof(iv));
+
+	flags = CHUNK_START;
+	for (;;) {
+		block_len = len < BLOCK_LEN ? len : BLOCK_LEN;
+		if (len <= BLOCK_LEN)
+			flags |= CHUNK_END | root;
+
+		load_block(m, data, block_len);
+		compress(cv, m, counter, block_len, flags);
+		if (len <= BLOCK_LEN)
+			break;
+
+		data += BLOCK_LEN;
+		len -= BLOCK_LEN;
+		flags = 0;
+	}
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8],
+		uint32_t root, uint32_t cv[8])
+{
+	uint32_t m[16];
+
+	memcpy(m, left, 8 * sizeof(uint32_t));
+	memcpy(m + 8, right, 8 * sizeof(uint32_t));
+	memcpy(cv, iv, sizeof(iv));
+	compress(cv, m, 0, BLOCK_LEN, PARENT | root);
+}
+
+/*
+ * Chaining values of 8 full chunks.
+ */
+static void hash8_portable(const unsigned char *data, uint64_t counter,
+		uint32_t cvs[8][8])
+{
+	int i;
+
+	for (i = 0; i < 8; i ++)
+		chunk_cv(data + i * CHUNK_LEN, CHUNK_LEN, counter + i, 0, cvs[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define HAVE_HASH8_AVX2
+
+#define VROTR(x, c) \
+	_mm256_or_si256(_mm256_srli_epi32(x, c), _mm256_slli_epi32(x, 32 - (c)))
+
+#define VG(v, a, b, c, d, x, y) do { \
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x); \
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot16); \
+	v[c] = _mm256_add_epi32(v[c], v[d]); \
+	v[b] = VROTR(_mm256_xor_si256(v[b], v[c]), 12); \
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y); \
+	v[d] = _mm256_shuffle_epi8(_mm256_xor_si256(v[d], v[a]), rot8); \
+	v[c] = _mm256_add_epi32(v[c], v[d]); \
+	v[b] = VROTR(_mm256_xor_si256(v[b], v[c]), 7); \
+} while(0)
+
+/*
+ * Loads words 0-7 of the same block of 8 chunks, and transposes them so
+ * m[i] holds word i of every chunk.
+ */
+static inline void __attribute__((target("avx2")))
+load_transposed(__m256i m[8], const unsigned char *data)
+{
+	__m256i r[8], t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i ++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(data + i * CHUNK_LEN));
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i ++) {
+		m[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		m[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+static void __attribute__((target("avx2")))
+hash8_avx2(const unsigned char *data, uint64_t counter, uint32_t cvs[8][8])
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+			2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+			2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i rot8 = _mm256_setr_epi8(
+			1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+			1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	uint32_t lo[8], hi[8], out[8][8];
+	__m256i h[8], v[16], m[16], ctr_lo, ctr_hi;
+	int i, b, r;
+
+	for (i = 0; i < 8; i ++) {
+		lo[i] = (uint32_t)(counter + i);
+		hi[i] = (uint32_t)((counter + i) >> 32);
+		h[i] = _mm256_set1_epi32(iv[i]);
+	}
+	ctr_lo = _mm256_loadu_si256((__m256i *)lo);
+	ctr_hi = _mm256_loadu_si256((__m256i *)hi);
+
+	for (b = 0; b < CHUNK_LEN / BLOCK_LEN; b ++) {
+		const unsigned char *block = data + b * BLOCK_LEN;
+		uint32_t flags = 0;
+
+		if (b == 0)
+			flags |= CHUNK_START;
+		if (b == CHUNK_LEN / BLOCK_LEN - 1)
+			flags |= CHUNK_END;
+
+		load_transposed(m, block);
+		load_transposed(m + 8, block + 32);
+
+		for (i = 0; i < 8; i ++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i ++)
+			v[i + 8] = _mm256_set1_epi32(iv[i]);
+		v[12] = ctr_lo;
+		v[13] = ctr_hi;
+		v[14] = _mm256_set1_epi32(BLOCK_LEN);
+		v[15] = _mm256_set1_epi32(flags);
+
+		/* unrolled, so the schedule folds into register picks */
+#pragma GCC unroll 7
+		for (r = 0; r < 7; r ++) {
+			const uint8_t *s = sched[r];
+
+			VG(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+			VG(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+			VG(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+			VG(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+			VG(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+			VG(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			VG(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+			VG(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (i = 0; i < 8; i ++)
+			h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+
+	for (i = 0; i < 8; i ++)
+		_mm256_storeu_si256((__m256i *)out[i], h[i]);
+	for (i = 0; i < 8; i ++) {
+		for (b = 0; b < 8; b ++)
+			cvs[i][b] = out[b][i];
+	}
+}
+#endif
+
+static void (*hash8)(const unsigned char *data, uint64_t counter,
+		uint32_t cvs[8][8]) = hash8_portable;
+
+static void __attribute__((constructor)) pick_blake3_impl(void)
+{
+#ifdef HAVE_HASH8_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		hash8 = hash8_avx2;
+#endif
+}
+
+const char *blake3_impl(void)
+{
+#ifdef HAVE_HASH8_AVX2
+	if (hash8 == hash8_avx2)
+		return "avx2";
+#endif
+	return "portable";
+}
+
+/*
+ * Chunks are pushed onto a stack of subtree chaining values. Every
+ * time the number of chunks pushed has a trailing zero bit, two
+ * subtrees of the same size are merged. The last chunk is held back,
+ * so that the final merge can be flagged as the root.
+ */
+static unsigned push_cv(uint32_t stack[][8], unsigned depth, uint32_t cv[8],
+		uint64_t total_chunks)
+{
+	while (!(total_chunks & 1)) {
+		parent_cv(stack[--depth], cv, 0, cv);
+		total_chunks >>= 1;
+	}
+	memcpy(stack[depth], cv, 8 * sizeof(uint32_t));
+	return depth + 1;
+}
+
+void blake3(const void *data, size_t len, unsigned char *out, size_t out_len)
+{
+	const unsigned char *ptr = data;
+	uint32_t stack[MAX_DEPTH][8], cvs[8][8], cv[8];
+	uint64_t counter = 0;
+	unsigned depth = 0;
+	int i;
+
+	if (len <= CHUNK_LEN) {
+		chunk_cv(ptr, len, 0, ROOT, cv);
+		goto out;
+	}
+
+	/* all full chunks but the last */
+	while (len > 8 * CHUNK_LEN) {
+		hash8(ptr, counter, cvs);
+		for (i = 0; i < 8; i ++)
+			depth = push_cv(stack, depth, cvs[i], ++ counter);
+		ptr += 8 * CHUNK_LEN;
+		len -= 8 * CHUNK_LEN;
+	}
+	while (len > CHUNK_LEN) {
+		chunk_cv(ptr, CHUNK_LEN, counter, 0, cv);
+		depth = push_cv(stack, depth, cv, ++ counter);
+		ptr += CHUNK_LEN;
+		len -= CHUNK_LEN;
+	}
+
+	chunk_cv(ptr, len, counter, 0, cv);
+	while (depth > 1)
+		parent_cv(stack[--depth], cv, 0, cv);
+	parent_cv(stack[0], cv, ROOT, cv);
+out:
+	for (i = 0; i < out_len; i ++)
+		out[i] = cv[i / 4] >> (8 * (i % 4));
+}
+
@@ -0,0 +1,21 @@
+#ifndef __ZUNKFS_BLAKE3_H__
+#define __ZUNKFS_BLAKE3_H__
+
+#include <stddef.h>
+
+#define BLAKE3_OUT_LEN		32
+
+/*
+ * BLAKE3 (unkeyed) of 'data'. 'out_len' may be anything up to
+ * BLAKE3_OUT_LEN, in which case the output is a prefix of the
+ * full 32 byte hash.
+ */
+void blake3(const void *data, size_t len, unsigned char *out, size_t out_len);
+
+/*
+ * Name of the implementation picked for this CPU.
+ */
+const char *blake3_impl(void);
+
+#endif
+
@@ -0,0 +1,74 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "bloom.h"
+#include "utils.h"
+
+#define BITS_PER_KEY	10
+#define NR_HASHES	7
+#define LONG_BITS	(sizeof(unsigned long) * CHAR_BIT)
+
+/*
+ * Sized for ~1% false positives at 'nr_keys'.
+ */
+struct bloom *new_bloom(unsigned long nr_keys)
+{
+	struct bloom *bloom;
+	unsigned long nr_bits = LONG_BITS;
+
+	while (nr_bits < nr_keys * BITS_PER_KEY)
+		nr_bits <<= 1;
+
+	bloom = calloc(1, sizeof(struct bloom) + nr_bits / CHAR_BIT);
+	if (!bloom)
+		return ERR_PTR(ENOMEM);
+
+	bloom->mask = nr_bits - 1;
+	bloom->nr_hashes = NR_HASHES;
+
+	return bloom;
+}
+
+/*
+ * Double hashing: bit i is h1 + i * h2.
+ */
+static inline uint32_t hash1(uint32_t key)
+{
+	return key * 0x9e3779b1;
+}
+
+static inline uint32_t hash2(uint32_t key)
+{
+	return ((key ^ (key >> 16)) * 0x85ebca6b) | 1;
+}
+
+void bloom_add(struct bloom *bloom, uint32_t key)
+{
+	unsigned long bit = hash1(key);
+	unsigned long step = hash2(key);
+	unsigned i;
+
+	for (i = 0; i < bloom->nr_hashes; i ++, bit += step) {
+		unsigned long b = bit & bloom->mask;
+		__sync_fetch_and_or(&bloom->bits[b / LONG_BITS],
+				1UL << (b % LONG_BITS));
+	}
+}
+
+bool bloom_test(const struct bloom *bloom, uint32_t key)
+{
+	unsigned long bit = hash1(key);
+	unsigned long step = hash2(key);
+	unsigned i;
+
+	for (i = 0; i < bloom->nr_hashes; i ++, bit += step) {
+		unsigned long b = bit & bloom->mask;
+		if (!(bloom->bits[b / LONG_BITS] & (1UL << (b % LONG_BITS))))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,22 @@
+#ifndef __ZUNKFS_BLOOM_H__
+#define __ZUNKFS_BLOOM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bloom filter over 32-bit keys. Keys are expected to be
+ * well distributed already (ie, taken from a digest.)
+ * Adding and testing keys can be done without locking.
+ */
+struct bloom {
+	unsigned long mask;
+	unsigned nr_hashes;
+	unsigned long bits[];
+};
+
+struct bloom *new_bloom(unsigned long nr_keys);
+void bloom_add(struct bloom *bloom, uint32_t key);
+bool bloom_test(const struct bloom *bloom, uint32_t key);
+
+#endif
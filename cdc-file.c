@@ -0,0 +1,620 @@
+/*
+ * Files with DDENT_CDC are cut into extents at content-defined
+ * boundaries (see cdc.c) instead of every CHUNK_SIZE bytes. Data moved
+ * by an insert still makes the same extents, which then dedup. Each
+ * extent is kept in a chunk of its own.
+ *
+ * The dentry's chunk tree holds an index of the extents: where each
+ * one starts, how long it is, and its digest. Index chunk j holds the
+ * records of the extents starting in [j * span, (j + 1) * span), in
+ * order, followed by zeros. Only a file's last extent can be shorter
+ * than the minimum of CHUNK_SIZE / 8, and a span is CHUNK_SIZE / 64 of
+ * those, so index chunks never fill up, and never have to hand records
+ * on to their neighbours.
+ *
+ * Writes go to a buffer that starts on an extent boundary, and takes in
+ * whole old extents as needed. Committing cuts it up again, taking in
+ * more old extents until a cut falls on an old boundary (the old cuts
+ * hold from there on), or the end of the file. Then the index records
+ * of the old extents in the buffer are replaced with the new ones.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zunkfs.h"
+#include "dir.h"
+#include "cdc.h"
+#include "cdc-file.h"
+
+struct cdc_record {
+	le64_t start;
+	le32_t len;                              /* 0 for unused records */
+	uint8_t digest[CHUNK_DIGEST_LEN];
+} __attribute__((packed));
+
+COMPILER_ASSERT(sizeof(struct cdc_record) == 32, sizeof_cdc_record_is_32);
+
+#define RECORDS_PER_CHUNK	(CHUNK_SIZE / sizeof(struct cdc_record))
+#define INDEX_SPAN_SHIFT	(2 * chunk_shift - 9)
+
+/* bigger buffers have what's been cut so far committed */
+#define BUFFER_MAX		(4 * CHUNK_SIZE)
+
+struct extent {
+	uint64_t start;
+	unsigned len;
+	unsigned char digest[CHUNK_DIGEST_LEN];
+};
+
+/*
+ * The buffer holds file data [start, start + len) if dirty. It
+ * supersedes the extents starting in [start, old_end). Past the buffer
+ * the file is as the index has it, so start + len is old_end, unless
+ * the buffer runs to the end of the file.
+ */
+struct cdc_file {
+	struct cdc_params params;
+	bool dirty;
+	uint64_t start;
+	uint64_t old_end;
+	unsigned len;
+	unsigned room;
+	unsigned char *buf;
+	struct extent cached;	/* extent in ->chunk, if ->cached.len */
+	unsigned char *chunk;
+	struct chunk_node *index; /* last index chunk used, pinned */
+	unsigned index_nr;
+};
+
+static inline uint64_t buf_end(const struct cdc_file *cf)
+{
+	return cf->start + cf->len;
+}
+
+unsigned cdc_index_chunks(uint64_t size)
+{
+	return (size + (1ULL << INDEX_SPAN_SHIFT) - 1) >> INDEX_SPAN_SHIFT;
+}
+
+static struct cdc_file *get_cdc_file(struct dentry *dentry)
+{
+	struct cdc_file *cf = dentry->cdc;
+
+	if (cf)
+		return cf;
+
+	cf = calloc(1, sizeof(struct cdc_file));
+	if (!cf)
+		return ERR_PTR(ENOMEM);
+
+	cf->chunk = malloc(CHUNK_SIZE);
+	if (!cf->chunk) {
+		free(cf);
+		return ERR_PTR(ENOMEM);
+	}
+
+	cdc_init(&cf->params, CHUNK_SIZE);
+	dentry->cdc = cf;
+	return cf;
+}
+
+void cdc_free(struct dentry *dentry)
+{
+	struct cdc_file *cf = dentry->cdc;
+
+	if (!cf)
+		return;
+
+	if (cf->dirty)
+		WARNING("%s: lost %u bytes at %"PRIu64"\n",
+				dentry->ddent->name, cf->len, cf->start);
+
+	if (cf->index)
+		put_chunk_node(cf->index);
+	free(cf->buf);
+	free(cf->chunk);
+	free(cf);
+	dentry->cdc = NULL;
+}
+
+static int reserve(struct cdc_file *cf, unsigned len)
+{
+	unsigned char *buf;
+	unsigned room;
+
+	if (len <= cf->room)
+		return 0;
+
+	for (room = cf->room ?: CHUNK_SIZE; room < len; room *= 2)
+		;
+
+	buf = realloc(cf->buf, room);
+	if (!buf)
+		return -ENOMEM;
+
+	cf->buf = buf;
+	cf->room = room;
+	return 0;
+}
+
+/*
+ * The last index chunk used is kept pinned, as reads tend to stay in
+ * one. The tree only grows one chunk at a time, and new chunks are
+ * zeroed.
+ */
+static struct chunk_node *get_index_chunk(struct dentry *dentry,
+		struct cdc_file *cf, unsigned nr)
+{
+	struct chunk_tree *ctree = &dentry->chunk_tree;
+	struct chunk_node *cnode;
+
+	while (ctree->nr_leafs < nr) {
+		cnode = get_nth_chunk(ctree, ctree->nr_leafs);
+		if (IS_ERR(cnode))
+			return cnode;
+		put_chunk_node(cnode);
+	}
+
+	if (!cf->index || cf->index_nr != nr) {
+		cnode = get_nth_chunk(ctree, nr);
+		if (IS_ERR(cnode))
+			return cnode;
+		if (cf->index)
+			put_chunk_node(cf->index);
+		cf->index = cnode;
+		cf->index_nr = nr;
+	}
+
+	get_chunk_node(cf->index);
+	return cf->index;
+}
+
+static inline uint64_t record_start(const struct cdc_record *rec)
+{
+	return le64toh(rec->start);
+}
+
+static inline unsigned record_len(const struct cdc_record *rec)
+{
+	return le32toh(rec->len);
+}
+
+/*
+ * Number of records starting at or before 'pos'.
+ */
+static unsigned records_upto(const struct cdc_record *recs, uint64_t pos)
+{
+	unsigned lo = 0, hi = RECORDS_PER_CHUNK, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (record_len(recs + mid) && record_start(recs + mid) <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int find_extent(struct dentry *dentry, struct cdc_file *cf,
+		uint64_t pos, struct extent *e)
+{
+	const struct cdc_record *recs;
+	struct chunk_node *cnode;
+	unsigned nr = pos >> INDEX_SPAN_SHIFT;
+	unsigned n;
+
+	if (nr >= dentry->chunk_tree.nr_leafs)
+		return -EIO;
+
+	/*
+	 * Extents are shorter than a span, so if none starts in pos's
+	 * span before it, the one it's in starts in the span before.
+	 */
+	for (;;) {
+		cnode = get_index_chunk(dentry, cf, nr);
+		if (IS_ERR(cnode))
+			return -PTR_ERR(cnode);
+
+		recs = (struct cdc_record *)cnode->chunk_data;
+		n = records_upto(recs, pos);
+		if (n) {
+			e->start = record_start(recs + n - 1);
+			e->len = record_len(recs + n - 1);
+			memcpy(e->digest, recs[n - 1].digest, CHUNK_DIGEST_LEN);
+		}
+		put_chunk_node(cnode);
+
+		if (n)
+			break;
+		if (!nr --)
+			return -EIO;
+	}
+
+	if (pos >= e->start + e->len || e->len > CHUNK_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+static int read_extent(struct dentry *dentry, struct cdc_file *cf,
+		const struct extent *e)
+{
+	int err;
+
+	if (cf->cached.len == e->len &&
+			!memcmp(cf->cached.digest, e->digest, CHUNK_DIGEST_LEN))
+		return 0;
+
+	cf->cached.len = 0;
+	err = read_dentry_extent(dentry, cf->chunk, e->len, e->digest);
+	if (err < 0)
+		return err;
+
+	cf->cached = *e;
+	return 0;
+}
+
+/*
+ * Takes old extents into the buffer until it gets to 'end', or to the
+ * end of the file. Extents within [skip_start, skip_end) are about to
+ * be overwritten, so aren't read.
+ */
+static int fill_buffer(struct dentry *dentry, struct cdc_file *cf,
+		uint64_t end, uint64_t skip_start, uint64_t skip_end)
+{
+	struct extent e;
+	int err;
+
+	while (buf_end(cf) < end && buf_end(cf) < dentry->size) {
+		err = find_extent(dentry, cf, buf_end(cf), &e);
+		if (err)
+			return err;
+		if (e.start != buf_end(cf))
+			return -EIO;
+
+		err = reserve(cf, cf->len + e.len);
+		if (err)
+			return err;
+
+		if (e.start < skip_start || e.start + e.len > skip_end) {
+			err = read_extent(dentry, cf, &e);
+			if (err)
+				return err;
+			memcpy(cf->buf + cf->len, cf->chunk, e.len);
+		}
+
+		cf->len += e.len;
+		cf->old_end = buf_end(cf);
+	}
+
+	return 0;
+}
+
+/*
+ * Replaces the records of extents starting in [from, to) with
+ * 'extents', which all start there too.
+ */
+static int update_index(struct dentry *dentry, struct cdc_file *cf,
+		uint64_t from, uint64_t to, const struct extent *extents,
+		unsigned count)
+{
+	struct cdc_record *recs, *out;
+	struct chunk_node *cnode;
+	uint64_t span_end;
+	unsigned nr, i, n, e = 0;
+
+	if (from == to)
+		return 0;
+
+	out = malloc(CHUNK_SIZE);
+	if (!out)
+		return -ENOMEM;
+
+	for (nr = from >> INDEX_SPAN_SHIFT;
+			nr <= (to - 1) >> INDEX_SPAN_SHIFT; nr ++) {
+		cnode = get_index_chunk(dentry, cf, nr);
+		if (IS_ERR(cnode)) {
+			free(out);
+			return -PTR_ERR(cnode);
+		}
+
+		recs = (struct cdc_record *)cnode->chunk_data;
+		span_end = (uint64_t)(nr + 1) << INDEX_SPAN_SHIFT;
+
+		for (i = n = 0; i < RECORDS_PER_CHUNK && record_len(recs + i) &&
+				record_start(recs + i) < from; i ++)
+			out[n ++] = recs[i];
+
+		for (; e < count && extents[e].start < span_end; e ++) {
+			assert(n < RECORDS_PER_CHUNK);
+			out[n].start = htole64(extents[e].start);
+			out[n].len = htole32(extents[e].len);
+			memcpy(out[n ++].digest, extents[e].digest,
+					CHUNK_DIGEST_LEN);
+		}
+
+		for (; i < RECORDS_PER_CHUNK && record_len(recs + i); i ++) {
+			if (record_start(recs + i) < to)
+				continue;
+			assert(n < RECORDS_PER_CHUNK);
+			out[n ++] = recs[i];
+		}
+
+		memset(out + n, 0, (RECORDS_PER_CHUNK - n) *
+				sizeof(struct cdc_record));
+		memcpy(recs, out, CHUNK_SIZE);
+		mark_cnode_dirty(cnode);
+		put_chunk_node(cnode);
+	}
+
+	assert(e == count);
+	free(out);
+	return 0;
+}
+
+static int write_extents(struct dentry *dentry, struct cdc_file *cf,
+		struct extent *extents, unsigned count)
+{
+	const unsigned char *data[CHUNK_BATCH_MAX];
+	unsigned char *digests[CHUNK_BATCH_MAX];
+	unsigned lens[CHUNK_BATCH_MAX];
+	unsigned i, n;
+	int err;
+
+	for (; count; count -= n, extents += n) {
+		n = count < CHUNK_BATCH_MAX ? count : CHUNK_BATCH_MAX;
+		for (i = 0; i < n; i ++) {
+			data[i] = cf->buf + (extents[i].start - cf->start);
+			lens[i] = extents[i].len;
+			digests[i] = extents[i].digest;
+		}
+
+		err = write_dentry_extents(dentry, data, lens, digests, n);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Cuts the buffer into extents, and writes them out. With 'all' set,
+ * the whole buffer goes, and old extents are taken in until the cuts
+ * line up with theirs. Otherwise, what can be cut without more data
+ * goes, and the rest stays buffered.
+ */
+static int commit(struct dentry *dentry, struct cdc_file *cf, bool all)
+{
+	struct extent *extents = NULL, *tmp;
+	unsigned count = 0, max = 0;
+	unsigned pos = 0, cut;
+	uint64_t old_len;
+	bool eof;
+	int err;
+
+	for (;;) {
+		eof = all && buf_end(cf) == dentry->size;
+		cut = 0;
+		if (pos < cf->len)
+			cut = cdc_cut(&cf->params, cf->buf + pos,
+					cf->len - pos, eof);
+		if (!cut) {
+			if (!all || pos == cf->len)
+				break;
+			old_len = cf->len;
+			err = fill_buffer(dentry, cf, buf_end(cf) + 1, 0, 0);
+			if (!err && cf->len == old_len)
+				err = -EIO;
+			if (err)
+				goto out;
+			continue;
+		}
+
+		if (count == max) {
+			max = max ? max * 2 : 16;
+			tmp = realloc(extents, max * sizeof(struct extent));
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out;
+			}
+			extents = tmp;
+		}
+
+		extents[count].start = cf->start + pos;
+		extents[count ++].len = cut;
+		pos += cut;
+
+		/* at the end of the file, or back in step with the old cuts */
+		if (all && pos == cf->len)
+			break;
+	}
+
+	err = write_extents(dentry, cf, extents, count);
+	if (err < 0)
+		goto out;
+
+	err = update_index(dentry, cf, cf->start, cf->start + pos, extents,
+			count);
+	if (err < 0)
+		goto out;
+
+	memmove(cf->buf, cf->buf + pos, cf->len - pos);
+	cf->start += pos;
+	cf->len -= pos;
+	if (cf->old_end < cf->start)
+		cf->old_end = cf->start;
+
+	if (all) {
+		free(cf->buf);
+		cf->buf = NULL;
+		cf->room = 0;
+		cf->dirty = false;
+
+		/* the index must have as many chunks as the size says */
+		while (dentry->chunk_tree.nr_leafs <
+				cdc_index_chunks(dentry->size)) {
+			struct chunk_node *cnode;
+
+			cnode = get_index_chunk(dentry, cf,
+					dentry->chunk_tree.nr_leafs);
+			if (IS_ERR(cnode)) {
+				err = -PTR_ERR(cnode);
+				goto out;
+			}
+			put_chunk_node(cnode);
+		}
+	}
+out:
+	free(extents);
+	return err;
+}
+
+int cdc_commit(struct dentry *dentry)
+{
+	struct cdc_file *cf = dentry->cdc;
+
+	if (!cf || !cf->dirty)
+		return 0;
+
+	return commit(dentry, cf, true);
+}
+
+static int cdc_write(struct dentry *dentry, struct cdc_file *cf,
+		const char *data, unsigned len, uint64_t offset)
+{
+	uint64_t end = offset + len;
+	struct extent e;
+	int err;
+
+	if (cf->dirty && (offset < cf->start || offset > buf_end(cf))) {
+		err = commit(dentry, cf, true);
+		if (err < 0)
+			return err;
+	}
+
+	/*
+	 * Start at the extent written to, or the last one, if appending,
+	 * as it may have been cut short by the end of the file.
+	 */
+	if (!cf->dirty) {
+		cf->start = 0;
+		if (dentry->size) {
+			err = find_extent(dentry, cf, offset < dentry->size ?
+					offset : dentry->size - 1, &e);
+			if (err < 0)
+				return err;
+			cf->start = e.start;
+		}
+		cf->len = 0;
+		cf->old_end = cf->start;
+		cf->dirty = true;
+	}
+
+	err = fill_buffer(dentry, cf, end, offset, end);
+	if (err < 0)
+		return err;
+
+	err = reserve(cf, end - cf->start);
+	if (err < 0)
+		return err;
+
+	memcpy(cf->buf + (offset - cf->start), data, len);
+	if (end > buf_end(cf))
+		cf->len = end - cf->start;
+
+	if (cf->len > BUFFER_MAX) {
+		err = commit(dentry, cf, false);
+		if (err < 0)
+			return err;
+	}
+
+	return len;
+}
+
+static int cdc_read(struct dentry *dentry, struct cdc_file *cf, char *data,
+		unsigned len, uint64_t offset)
+{
+	uint64_t pos, end = offset + len;
+	struct extent e;
+	unsigned n;
+	int err;
+
+	for (pos = offset; pos < end; pos += n) {
+		if (cf->dirty && pos >= cf->start && pos < buf_end(cf)) {
+			n = (end < buf_end(cf) ? end : buf_end(cf)) - pos;
+			memcpy(data + (pos - offset),
+					cf->buf + (pos - cf->start), n);
+			continue;
+		}
+
+		err = find_extent(dentry, cf, pos, &e);
+		if (err < 0)
+			return err;
+		err = read_extent(dentry, cf, &e);
+		if (err < 0)
+			return err;
+
+		n = (end < e.start + e.len ? end : e.start + e.len) - pos;
+		memcpy(data + (pos - offset), cf->chunk + (pos - e.start), n);
+	}
+
+	return len;
+}
+
+int cdc_rw(struct dentry *dentry, char *buf, unsigned len, uint64_t offset,
+		int read)
+{
+	struct cdc_file *cf;
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	/*
+	 * Before the size changes, as the index is sized by it.
+	 */
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+
+	cf = get_cdc_file(dentry);
+	if (IS_ERR(cf))
+		return -PTR_ERR(cf);
+
+	if (read)
+		return cdc_read(dentry, cf, buf, len, offset);
+
+	return cdc_write(dentry, cf, buf, len, offset);
+}
+
+int cdc_set_data(struct dentry *dentry, const unsigned char *data,
+		unsigned len)
+{
+	struct cdc_file *cf;
+	int err;
+
+	cf = get_cdc_file(dentry);
+	if (IS_ERR(cf))
+		return -PTR_ERR(cf);
+
+	assert(!cf->dirty);
+
+	err = reserve(cf, len);
+	if (err < 0)
+		return err;
+
+	if (len)
+		memcpy(cf->buf, data, len);
+	cf->start = 0;
+	cf->len = len;
+	cf->old_end = 0;
+	cf->dirty = true;
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __ZUNKFS_CDC_FILE_H__
+#define __ZUNKFS_CDC_FILE_H__
+
+#include <stdint.h>
+
+struct dentry;
+
+/*
+ * Reads or writes a DDENT_CDC file. Called with the dentry's mutex
+ * held, after the usual checks on offset and size. Writes are
+ * buffered until the next cdc_commit(), which flushing the dentry
+ * does. Returns 'len', or -errno.
+ */
+int cdc_rw(struct dentry *dentry, char *buf, unsigned len, uint64_t offset,
+		int read);
+int cdc_commit(struct dentry *dentry);
+
+/*
+ * Starts off an empty file with 'len' bytes of buffered data.
+ */
+int cdc_set_data(struct dentry *dentry, const unsigned char *data,
+		unsigned len);
+
+void cdc_free(struct dentry *dentry);
+
+/*
+ * Number of index chunks for a file of 'size' bytes.
+ */
+unsigned cdc_index_chunks(uint64_t size);
+
+#endif
@@ -0,0 +1,165 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cdc.h"
+
+#define DATA_SIZE	(8 << 20)
+#define MAX_CUTS	(DATA_SIZE / 512 + 2)
+
+static unsigned char data[DATA_SIZE + 1];
+static unsigned cuts[MAX_CUTS];
+
+/*
+ * The obvious way: hash from the start of the chunk, byte by byte.
+ */
+static unsigned ref_cut(const struct cdc_params *params,
+		const unsigned char *data, unsigned len)
+{
+	uint32_t h = 0;
+	unsigned i;
+
+	for (i = 0; i < len; i ++) {
+		h = (h << 1) + cdc_gear[data[i]];
+		if (i + 1 == params->max)
+			return params->max;
+		if (i < params->min)
+			continue;
+		if (!(h & (i < params->avg ? params->mask_s : params->mask_l)))
+			return i + 1;
+	}
+
+	return len;
+}
+
+/*
+ * Fills in the offsets of the chunk ends, and returns how many there are.
+ */
+static unsigned chunk(const struct cdc_params *params,
+		const unsigned char *data, unsigned len, unsigned *ends)
+{
+	unsigned pos, n;
+
+	for (pos = n = 0; pos < len; n ++) {
+		pos += cdc_cut(params, data + pos, len - pos, 1);
+		ends[n] = pos;
+	}
+
+	return n;
+}
+
+static int test_params(unsigned max)
+{
+	struct cdc_params params;
+	unsigned pos, len, n, i;
+
+	cdc_init(&params, max);
+
+	n = chunk(&params, data, DATA_SIZE, cuts);
+	for (i = pos = 0; i < n; i ++) {
+		len = cuts[i] - pos;
+		if (len != ref_cut(&params, data + pos, DATA_SIZE - pos)) {
+			printf("max=%u: chunk %u at %u is %u bytes, not %u\n",
+					max, i, pos, len, ref_cut(&params,
+						data + pos, DATA_SIZE - pos));
+			return -1;
+		}
+		if (len > max || (len <= params.min && i != n - 1)) {
+			printf("max=%u: chunk %u is %u bytes\n", max, i, len);
+			return -1;
+		}
+		pos = cuts[i];
+	}
+
+	/* without eof, the last chunk can't be cut */
+	len = DATA_SIZE - cuts[n - 2];
+	if (len < max && cdc_cut(&params, data + cuts[n - 2], len, 0) != 0 &&
+			cdc_cut(&params, data + cuts[n - 2], len, 0) != len) {
+		printf("max=%u: cut without enough data\n", max);
+		return -1;
+	}
+
+	printf("max=%7u: %5u chunks, %7u bytes on average ok\n", max, n,
+			DATA_SIZE / n);
+	return 0;
+}
+
+/*
+ * A byte inserted near the start should only change the chunks around it.
+ */
+static int test_shift(unsigned max)
+{
+	static unsigned shifted[MAX_CUTS];
+	struct cdc_params params;
+	unsigned n, m, i, j, same;
+
+	cdc_init(&params, max);
+
+	n = chunk(&params, data + 1, DATA_SIZE, cuts);
+	data[0] = data[1000];
+	m = chunk(&params, data, DATA_SIZE + 1, shifted);
+
+	for (i = j = same = 0; i < n && j < m; ) {
+		if (cuts[i] + 1 == shifted[j]) {
+			same ++;
+			i ++;
+			j ++;
+		} else if (cuts[i] + 1 < shifted[j])
+			i ++;
+		else
+			j ++;
+	}
+
+	printf("max=%7u: %u of %u chunk ends kept after an insert %s\n", max,
+			same, n, same + 3 >= n ? "ok" : "FAILED");
+
+	return same + 3 >= n ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct cdc_params params;
+	struct timeval start, end;
+	unsigned i, n;
+	int failed = 0;
+
+	for (i = 0; i <= DATA_SIZE; i ++)
+		data[i] = random();
+
+	printf("implementation: %s\n", cdc_impl());
+
+	failed |= test_params(4096);
+	failed |= test_params(65536);
+	failed |= test_params(1 << 20);
+
+	failed |= test_shift(4096);
+	failed |= test_shift(65536);
+
+	/* runs of one value cut the same way every time */
+	memset(data, 0, DATA_SIZE);
+	cdc_init(&params, 65536);
+	n = chunk(&params, data, DATA_SIZE, cuts);
+	for (i = 1; i < n - 1; i ++) {
+		if (cuts[i] - cuts[i - 1] != cuts[0])
+			break;
+	}
+	printf("zeros: %u chunks %s\n", n, i >= n - 1 ? "ok" : "FAILED");
+	if (i < n - 1)
+		failed = 1;
+
+	for (i = 0; i <= DATA_SIZE; i ++)
+		data[i] = random();
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 10; i ++)
+		chunk(&params, data, DATA_SIZE, cuts);
+	gettimeofday(&end, NULL);
+
+	printf("10 x %u bytes in %ldus\n", DATA_SIZE,
+			(end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec);
+
+	return failed ? -1 : 0;
+}
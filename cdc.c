@@ -0,0 +1,228 @@
+/*
+ * Gear-hash content-defined chunking, along the lines of FastCDC.
+ * The hash at byte i is the sum of gear[data[i - j]] << j, so only the
+ * last 32 bytes count, and it can be picked up anywhere with 32 bytes
+ * of warm-up. Cuts go after bytes whose hash has its top bits clear:
+ * more of them up to the average chunk size, fewer after it, which
+ * keeps chunk sizes close to the average. Hashing starts at the
+ * minimum chunk size.
+ *
+ * Being position-independent, the hash can be run over several
+ * stretches of a buffer at once. On CPUs with AVX2 eight are done
+ * at once, one per 32bit lane.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "cdc.h"
+
+#define WINDOW		32
+
+uint32_t cdc_gear[256];
+
+/*
+ * Fixed, so chunk boundaries don't change between runs.
+ */
+static void __attribute__((constructor)) init_gear(void)
+{
+	uint64_t x = 0x7a756e6b6673ULL; /* "zunkfs" */
+	uint64_t z;
+	int i;
+
+	for (i = 0; i < 256; i ++) {
+		/* splitmix64 */
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		cdc_gear[i] = (z ^ (z >> 31)) >> 32;
+	}
+}
+
+void cdc_init(struct cdc_params *params, unsigned max)
+{
+	unsigned bits;
+
+	assert(max >= 4096 && !(max & (max - 1)));
+
+	params->max = max;
+	params->avg = max / 2;
+	params->min = max / 8;
+
+	bits = __builtin_ctz(params->avg);
+	params->mask_s = ~0U << (32 - (bits + 2));
+	params->mask_l = ~0U << (32 - (bits - 2));
+}
+
+/*
+ * Returns the first i in [from, to) whose hash has no bits of 'mask'
+ * set, or 'to'. Needs WINDOW bytes before 'from'.
+ */
+static unsigned scan_portable(const unsigned char *data, unsigned from,
+		unsigned to, uint32_t mask)
+{
+	uint32_t h = 0;
+	unsigned i;
+
+	for (i = from - WINDOW; i < from; i ++)
+		h = (h << 1) + cdc_gear[data[i]];
+	for (; i < to; i ++) {
+		h = (h << 1) + cdc_gear[data[i]];
+		if (!(h & mask))
+			return i;
+	}
+
+	return to;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define HAVE_SCAN_AVX2
+
+/*
+ * Bytes per lane per round. Each lane warms up on the WINDOW bytes
+ * before its stripe, so rounds can't be much shorter.
+ */
+#define STRIPE		256
+#define ROUND		(8 * STRIPE)
+
+#define VHASH(h, w, shift) do { \
+	__m256i idx = _mm256_and_si256(_mm256_srli_epi32(w, shift), bytes); \
+	h = _mm256_add_epi32(_mm256_slli_epi32(h, 1), \
+			_mm256_i32gather_epi32((const int *)cdc_gear, idx, 4)); \
+} while(0)
+
+#define VCHECK(h, mask, hits) \
+	hits = _mm256_or_si256(hits, \
+			_mm256_cmpeq_epi32(_mm256_and_si256(h, mask), zero))
+
+/*
+ * Loads 32 bytes from each of 8 stripes, and transposes them so m[i]
+ * holds bytes 4i to 4i+3 of every stripe.
+ */
+static inline void __attribute__((target("avx2")))
+load_transposed(__m256i m[8], const unsigned char *data)
+{
+	__m256i r[8], t[8], u[8];
+	int i;
+
+	for (i = 0; i < 8; i ++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(data + i * STRIPE));
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i ++) {
+		m[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		m[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/*
+ * Lane k hashes [pos + k * STRIPE, pos + (k + 1) * STRIPE). Returns a
+ * bitmask of the lanes that found a cut.
+ */
+static unsigned __attribute__((target("avx2")))
+scan_round(const unsigned char *data, unsigned pos, __m256i vmask)
+{
+	const __m256i bytes = _mm256_set1_epi32(0xff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i h = zero, hits = zero, m[8];
+	int b, i, shift;
+
+	load_transposed(m, data + pos - WINDOW);
+	for (i = 0; i < 8; i ++) {
+		VHASH(h, m[i], 0);
+		VHASH(h, m[i], 8);
+		VHASH(h, m[i], 16);
+		VHASH(h, m[i], 24);
+	}
+
+	for (b = 0; b < STRIPE; b += 32) {
+		load_transposed(m, data + pos + b);
+		for (i = 0; i < 8; i ++) {
+#pragma GCC unroll 4
+			for (shift = 0; shift < 32; shift += 8) {
+				VHASH(h, m[i], shift);
+				VCHECK(h, vmask, hits);
+			}
+		}
+	}
+
+	return _mm256_movemask_ps(_mm256_castsi256_ps(hits));
+}
+
+static unsigned __attribute__((target("avx2")))
+scan_avx2(const unsigned char *data, unsigned from, unsigned to,
+		uint32_t mask)
+{
+	__m256i vmask = _mm256_set1_epi32(mask);
+	unsigned pos, lanes, start;
+
+	for (pos = from; to - pos >= ROUND; pos += ROUND) {
+		lanes = scan_round(data, pos, vmask);
+		if (lanes) {
+			start = pos + __builtin_ctz(lanes) * STRIPE;
+			return scan_portable(data, start, start + STRIPE, mask);
+		}
+	}
+
+	return scan_portable(data, pos, to, mask);
+}
+#endif
+
+static unsigned (*scan)(const unsigned char *data, unsigned from,
+		unsigned to, uint32_t mask) = scan_portable;
+
+static void __attribute__((constructor)) pick_cdc_impl(void)
+{
+#ifdef HAVE_SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+#endif
+}
+
+const char *cdc_impl(void)
+{
+#ifdef HAVE_SCAN_AVX2
+	if (scan == scan_avx2)
+		return "avx2";
+#endif
+	return "portable";
+}
+
+unsigned cdc_cut(const struct cdc_params *params, const unsigned char *data,
+		unsigned len, bool eof)
+{
+	unsigned end, mid, i;
+
+	if (len <= params->min)
+		return eof ? len : 0;
+
+	end = len < params->max ? len : params->max;
+	mid = end < params->avg ? end : params->avg;
+
+	i = scan(data, params->min, mid, params->mask_s);
+	if (i < mid)
+		return i + 1;
+
+	if (end > mid) {
+		i = scan(data, mid, end, params->mask_l);
+		if (i < end)
+			return i + 1;
+	}
+
+	if (len >= params->max)
+		return params->max;
+
+	return eof ? len : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef __ZUNKFS_CDC_H__
+#define __ZUNKFS_CDC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Content-defined chunking. Cut points depend only on the data around
+ * them, so inserting or deleting bytes only moves the cuts next to the
+ * change, and the chunks after it stay the same.
+ */
+struct cdc_params {
+	unsigned min;
+	unsigned avg;
+	unsigned max;
+	uint32_t mask_s;	/* used up to avg */
+	uint32_t mask_l;	/* used after avg */
+};
+
+/*
+ * 'max' must be a power of two, no smaller than 4K.
+ */
+void cdc_init(struct cdc_params *params, unsigned max);
+
+/*
+ * Length of the chunk at the start of 'data'. Returns 0 if more data
+ * is needed to tell, which can only happen if 'eof' isn't set.
+ */
+unsigned cdc_cut(const struct cdc_params *params, const unsigned char *data,
+		unsigned len, bool eof);
+
+/*
+ * Name of the boundary finder picked for this CPU.
+ */
+const char *cdc_impl(void);
+
+/*
+ * The Gear hash's per-byte values, for tests.
+ */
+extern uint32_t cdc_gear[256];
+
+#endif
@@ -0,0 +1,134 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "chunk-crypt.h"
+
+#define CHUNK		65536
+#define ROUNDS		256
+
+static unsigned char secret[CHUNK];
+static unsigned char plain[CHUNK];
+static unsigned char buf[CHUNK];
+static unsigned char ref[CHUNK];
+
+static long elapsed(const struct timeval *start)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) * 1000000 +
+		end.tv_usec - start->tv_usec;
+}
+
+/*
+ * What the chunk used to be encrypted with; cached keys
+ * must give the same bytes.
+ */
+static void ref_blowfish(unsigned char *dst, const unsigned char *src)
+{
+	BF_KEY bf_key;
+	int i;
+
+	BF_set_key(&bf_key, CHUNK, secret);
+	for (i = 0; i < CHUNK; i += 8)
+		BF_ecb_encrypt(src + i, dst + i, &bf_key, BF_ENCRYPT);
+}
+
+static int test_cipher(const char *name, int cipher)
+{
+	struct chunk_key key;
+	int failed = 0;
+
+	assert(!set_chunk_key(&key, cipher, secret, CHUNK));
+
+	assert(!crypt_chunk(&key, buf, plain, CHUNK, 1, BF_ENCRYPT));
+	if (!memcmp(buf, plain, CHUNK))
+		failed = 1;
+	if (cipher == CHUNK_CIPHER_BLOWFISH) {
+		ref_blowfish(ref, plain);
+		if (memcmp(buf, ref, CHUNK))
+			failed = 1;
+	}
+
+	/* only AES-XTS minds where a chunk is */
+	assert(!crypt_chunk(&key, ref, plain, CHUNK, 2, BF_ENCRYPT));
+	if (!memcmp(buf, ref, CHUNK) != (cipher != CHUNK_CIPHER_AES_XTS))
+		failed = 1;
+
+	assert(!crypt_chunk(&key, buf, buf, CHUNK, 1, BF_DECRYPT));
+	if (memcmp(buf, plain, CHUNK))
+		failed = 1;
+
+	/* short extents are padded to what the cipher can take */
+	memset(buf, 0, 16);
+	memcpy(buf, plain, 5);
+	assert(!crypt_chunk(&key, buf, buf, chunk_crypt_len(&key, 5), 0,
+				BF_ENCRYPT));
+	assert(!crypt_chunk(&key, buf, buf, chunk_crypt_len(&key, 5), 0,
+				BF_DECRYPT));
+	if (memcmp(buf, plain, 5))
+		failed = 1;
+
+	printf("%-8s %s\n", name, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/*
+ * Per-chunk cost of setting the key up for every chunk,
+ * as was done before keys were cached, and of not doing so.
+ */
+static void bench_cipher(const char *name, int cipher)
+{
+	struct chunk_key key;
+	struct timeval start;
+	long setup, cached;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < ROUNDS; i ++) {
+		set_chunk_key(&key, cipher, secret, CHUNK);
+		crypt_chunk(&key, buf, plain, CHUNK, i, BF_ENCRYPT);
+	}
+	setup = elapsed(&start);
+
+	gettimeofday(&start, NULL);
+	set_chunk_key(&key, cipher, secret, CHUNK);
+	for (i = 0; i < ROUNDS; i ++)
+		crypt_chunk(&key, buf, plain, CHUNK, i, BF_ENCRYPT);
+	cached = elapsed(&start);
+
+	printf("%-8s %6.1fus per chunk with key setup, %6.1fus cached, "
+			"%.0fMB/s\n", name, (double)setup / ROUNDS,
+			(double)cached / ROUNDS,
+			(double)CHUNK * ROUNDS / (cached ? cached : 1));
+}
+
+int main(int argc, char **argv)
+{
+	struct chunk_key key;
+	int i, failed = 0;
+
+	for (i = 0; i < CHUNK; i ++) {
+		secret[i] = random();
+		plain[i] = random();
+	}
+
+	failed |= test_cipher("xor", CHUNK_CIPHER_XOR);
+	failed |= test_cipher("blowfish", CHUNK_CIPHER_BLOWFISH);
+	failed |= test_cipher("aes", CHUNK_CIPHER_AES_XTS);
+
+	if (set_chunk_key(&key, 3, secret, CHUNK) != -ENOTSUP) {
+		printf("unknown cipher accepted\n");
+		failed = 1;
+	}
+
+	bench_cipher("xor", CHUNK_CIPHER_XOR);
+	bench_cipher("blowfish", CHUNK_CIPHER_BLOWFISH);
+	bench_cipher("aes", CHUNK_CIPHER_AES_XTS);
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Chunk ciphers. XOR and Blowfish (ECB) are what older filesystems
+ * use. AES-XTS is keyed by the SHA-512 of the secret, and tweaked by
+ * the chunk's place in its file, so the same data in two places
+ * encrypts differently. It is still deterministic, so rewriting a
+ * chunk with the data it had gives the chunk it was, and only shows
+ * which 16 byte blocks changed otherwise.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "chunk-crypt.h"
+
+static const char *cipher_names[] = {
+	[CHUNK_CIPHER_XOR]	= "xor",
+	[CHUNK_CIPHER_BLOWFISH]	= "blowfish",
+	[CHUNK_CIPHER_AES_XTS]	= "aes",
+};
+
+#define NR_CIPHERS	(sizeof(cipher_names) / sizeof(cipher_names[0]))
+
+static const EVP_CIPHER *aes_xts;
+
+static void __attribute__((constructor)) init_aes_xts(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/* rather than looking it up on every EVP_CipherInit_ex() */
+	aes_xts = EVP_CIPHER_fetch(NULL, "AES-256-XTS", NULL);
+#endif
+	if (!aes_xts)
+		aes_xts = EVP_aes_256_xts();
+}
+
+static void xor_chunk(unsigned char *dst, const unsigned char *src,
+		const unsigned char *secret, unsigned len)
+{
+	int i;
+	for (i = 0; i < len; i ++)
+		*dst++ = *src++ ^ *secret++;
+}
+
+static void bf_chunk(unsigned char *dst, const unsigned char *src,
+		const BF_KEY *bf_key, unsigned len, int enc)
+{
+	int i;
+
+	/* BF_ecb_encrypt works with 64bits at a time */
+	for (i = 0; i < len/8; i ++) {
+		BF_ecb_encrypt(src, dst, bf_key, enc);
+		src += 8;
+		dst += 8;
+	}
+}
+
+/*
+ * libcrypto picks AES-NI or VAES when the CPU has them. A context
+ * per call, as several threads can be using the key at once; with
+ * AES-NI, setting it up is nothing next to a chunk's worth of data.
+ */
+static int aes_chunk(unsigned char *dst, const unsigned char *src,
+		const unsigned char *aes_key, unsigned len, uint64_t pos,
+		int enc)
+{
+	unsigned char tweak[16] = { 0 };
+	EVP_CIPHER_CTX *ctx;
+	int i, out, err = -EIO;
+
+	for (i = 0; i < 8; i ++)
+		tweak[i] = pos >> (i * 8);
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (!ctx)
+		return -ENOMEM;
+
+	if (EVP_CipherInit_ex(ctx, aes_xts, NULL, aes_key, tweak,
+				enc == BF_ENCRYPT) &&
+			EVP_CipherUpdate(ctx, dst, &out, src, len) &&
+			out == len)
+		err = 0;
+
+	EVP_CIPHER_CTX_free(ctx);
+	return err;
+}
+
+int set_chunk_key(struct chunk_key *key, int cipher,
+		const unsigned char *secret, unsigned secret_len)
+{
+	key->cipher = cipher;
+	key->secret = secret;
+
+	switch(cipher) {
+	case CHUNK_CIPHER_XOR:
+		return 0;
+	case CHUNK_CIPHER_BLOWFISH:
+		/*
+		 * Far more work than encrypting a chunk. Blowfish only
+		 * looks at the first 72 bytes of the secret.
+		 */
+		BF_set_key(&key->bf_key, secret_len, secret);
+		return 0;
+	case CHUNK_CIPHER_AES_XTS:
+		SHA512(secret, secret_len, key->aes_key);
+		return 0;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+unsigned chunk_crypt_len(const struct chunk_key *key, unsigned len)
+{
+	len = (len + 7) & ~7;
+
+	/* XTS needs at least a block */
+	if (key->cipher == CHUNK_CIPHER_AES_XTS && len < 16)
+		len = 16;
+
+	return len;
+}
+
+int crypt_chunk(const struct chunk_key *key, unsigned char *dst,
+		const unsigned char *src, unsigned len, uint64_t pos, int enc)
+{
+	switch(key->cipher) {
+	case CHUNK_CIPHER_XOR:
+		xor_chunk(dst, src, key->secret, len);
+		return 0;
+	case CHUNK_CIPHER_BLOWFISH:
+		bf_chunk(dst, src, &key->bf_key, len, enc);
+		return 0;
+	case CHUNK_CIPHER_AES_XTS:
+		return aes_chunk(dst, src, key->aes_key, len, pos, enc);
+	default:
+		return -ENOTSUP;
+	}
+}
+
+const char *chunk_cipher_name(int cipher)
+{
+	return cipher >= 0 && cipher < NR_CIPHERS ?
+		cipher_names[cipher] : NULL;
+}
+
+int find_chunk_cipher(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_CIPHERS; i ++) {
+		if (!strcmp(name, cipher_names[i]))
+			return i;
+	}
+
+	return -ENOENT;
+}
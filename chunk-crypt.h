@@ -0,0 +1,50 @@
+#ifndef __ZUNKFS_CHUNK_CRYPT_H__
+#define __ZUNKFS_CHUNK_CRYPT_H__
+
+#include <stdint.h>
+#include <openssl/blowfish.h>
+
+/*
+ * Chunk ciphers, keyed by a file's secret chunk. The values are
+ * the ones stored in disk dentries (DDENT_USE_*.)
+ */
+#define CHUNK_CIPHER_XOR	0
+#define CHUNK_CIPHER_BLOWFISH	1
+#define CHUNK_CIPHER_AES_XTS	2
+
+/*
+ * Everything needed to encrypt a file's chunks, worked out once
+ * when its secret is read, rather than for every chunk.
+ */
+struct chunk_key {
+	int cipher;
+	const unsigned char *secret;
+	BF_KEY bf_key;
+	unsigned char aes_key[64];	/* two AES-256 keys, for XTS */
+};
+
+/*
+ * 'secret' must outlive the key. Returns -ENOTSUP for unknown ciphers.
+ */
+int set_chunk_key(struct chunk_key *key, int cipher,
+		const unsigned char *secret, unsigned secret_len);
+
+/*
+ * How many bytes to encrypt to cover 'len' bytes of data, which
+ * must be padded with zeros up to that.
+ */
+unsigned chunk_crypt_len(const struct chunk_key *key, unsigned len);
+
+/*
+ * 'len' must come from chunk_crypt_len(), and be no more than the
+ * secret's length. 'pos' tells a file's chunks apart, for ciphers
+ * that care (AES-XTS uses it as the tweak); decrypting needs the same
+ * one. 'enc' is BF_ENCRYPT or BF_DECRYPT. 'dst' may be 'src'.
+ */
+int crypt_chunk(const struct chunk_key *key, unsigned char *dst,
+		const unsigned char *src, unsigned len, uint64_t pos, int enc);
+
+const char *chunk_cipher_name(int cipher);
+int find_chunk_cipher(const char *name);
+
+#endif
@@ -80,7 +80,7 @@ static bool xfer_chunk(unsigned char *chunk, const unsigned char *digest,
 
 		TRACE("len=%d", len);
 
-		return true;
+		return len == CHUNK_SIZE;
 	}
 
 	close(fd[0]);
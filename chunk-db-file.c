@@ -18,6 +18,7 @@
 #include "zunkfs.h"
 #include "chunk-db.h"
 #include "byteorder.h"
+#include "mutex.h"
 
 #define MAX_INDEX		(CHUNK_SIZE / (sizeof(struct index)))
 #define SPLIT_AT		((MAX_INDEX + 1) / 2)
@@ -47,8 +48,25 @@ struct db {
 	int fd;
 	uint32_t next_nr;
 	unsigned ro:1;
+	struct mutex mutex;
 };
 
+/*
+ * flock() keeps other processes out, but all threads share the
+ * same open file, so they have to be kept apart with a mutex.
+ */
+static inline void lock_db(struct db *db, int how)
+{
+	lock(&db->mutex);
+	flock(db->fd, how);
+}
+
+static inline void unlock_db(struct db *db)
+{
+	flock(db->fd, LOCK_UN);
+	unlock(&db->mutex);
+}
+
 static inline unsigned char *__map_chunk(struct db *db, uint32_t nr,
 		int extra_flags)
 {
@@ -231,42 +249,58 @@ out:
 	return chunk;
 }
 
-static bool file_read_chunk(unsigned char *chunk, const unsigned char *digest,
-		void *db_info)
+static bool __file_read_chunk(unsigned char *chunk, const unsigned char *digest,
+		struct db *db)
 {
-	struct db *db = db_info;
 	unsigned char *db_chunk;
-	bool status = false;
-
-	flock(db->fd, LOCK_SH);
 
 	db_chunk = lookup_chunk(db, digest);
-	if (db_chunk) {
-		if (IS_ERR(db_chunk)) {
-			TRACE("digest=%s: %s\n",
-					digest_string(digest), 
-					strerror(PTR_ERR(db_chunk)));
-		} else {
-			status = true;
-			memcpy(chunk, db_chunk, CHUNK_SIZE);
-			unmap_chunk(db_chunk);
-		}
+	if (!db_chunk)
+		return false;
+
+	if (IS_ERR(db_chunk)) {
+		TRACE("digest=%s: %s\n", digest_string(digest),
+				strerror(PTR_ERR(db_chunk)));
+		return false;
 	}
-	flock(db->fd, LOCK_UN);
 
-	return status;
+	memcpy(chunk, db_chunk, CHUNK_SIZE);
+	unmap_chunk(db_chunk);
+	return true;
 }
 
-static bool file_write_chunk(const unsigned char *chunk,
-		const unsigned char *digest, void *db_info)
+static unsigned file_read_chunks(unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info)
 {
 	struct db *db = db_info;
+	unsigned i, n;
+
+	lock_db(db, LOCK_SH);
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = __file_read_chunk(chunks[i], digests[i], db);
+		n += ok[i];
+	}
+	unlock_db(db);
+
+	return n;
+}
+
+static bool file_read_chunk(unsigned char *chunk, const unsigned char *digest,
+		void *db_info)
+{
+	bool ok;
+
+	return file_read_chunks(&chunk, &digest, &ok, 1, db_info) == 1;
+}
+
+static bool __file_write_chunk(const unsigned char *chunk,
+		const unsigned char *digest, struct db *db)
+{
 	unsigned char *db_chunk;
 	bool status = false;
 	int error;
 
-	flock(db->fd, LOCK_EX);
-
 	db_chunk = lookup_chunk(db, digest);
 	if (db_chunk) {
 		if (IS_ERR(db_chunk)) {
@@ -309,10 +343,84 @@ static bool file_write_chunk(const unsigned char *chunk,
 	db->next_nr ++;
 out:
 	unmap_chunk(db_chunk);
-	flock(db->fd, LOCK_UN);
 	return status;
 }
 
+static unsigned file_write_chunks(const unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info)
+{
+	struct db *db = db_info;
+	unsigned i, n;
+
+	lock_db(db, LOCK_EX);
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = __file_write_chunk(chunks[i], digests[i], db);
+		n += ok[i];
+	}
+	unlock_db(db);
+
+	return n;
+}
+
+static bool file_write_chunk(const unsigned char *chunk,
+		const unsigned char *digest, void *db_info)
+{
+	bool ok;
+
+	return file_write_chunks(&chunk, &digest, &ok, 1, db_info) == 1;
+}
+
+static bool file_has_chunk(const unsigned char *digest, void *db_info)
+{
+	struct db *db = db_info;
+	unsigned char *db_chunk;
+
+	lock_db(db, LOCK_SH);
+	db_chunk = lookup_chunk(db, digest);
+	unlock_db(db);
+
+	if (!db_chunk || IS_ERR(db_chunk))
+		return false;
+
+	unmap_chunk(db_chunk);
+	return true;
+}
+
+/*
+ * The index only keeps the first 4 bytes of each digest,
+ * which is all scan_chunks needs to provide.
+ */
+static bool file_scan_chunks(void (*func)(const unsigned char *digest,
+			void *arg), void *arg, void *db_info)
+{
+	struct db *db = db_info;
+	unsigned char digest[CHUNK_DIGEST_LEN] = {0};
+	struct index *leaf;
+	uint32_t hash;
+	int i, leaf_nr;
+
+	lock_db(db, LOCK_SH);
+	for (leaf_nr = 0; leaf_nr < be32toh(db->root[0].hash); leaf_nr ++) {
+		leaf = map_chunk(db, be32toh(db->root[leaf_nr].chunk_nr));
+		if (IS_ERR(leaf)) {
+			unlock_db(db);
+			return false;
+		}
+		for (i = 0; i < MAX_INDEX; i ++) {
+			if (be32toh(leaf[i].chunk_nr) == INVALID_CHUNK_NR)
+				break;
+			hash = be32toh(leaf[i].hash);
+			memcpy(digest, &hash, sizeof(uint32_t));
+			func(digest, arg);
+		}
+		unmap_chunk(leaf);
+	}
+	unlock_db(db);
+
+	return true;
+}
+
 static char *file_chunkdb_ctor(const char *spec, struct chunk_db *chunk_db)
 {
 	const char *path = spec;
@@ -333,6 +441,8 @@ static char *file_chunkdb_ctor(const char *spec, struct chunk_db *chunk_db)
 	if (!S_ISREG(st.st_mode))
 		goto error;
 
+	init_mutex(&db->mutex);
+
 	db->next_nr = st.st_size / CHUNK_SIZE;
 
 	error = load_root(db);
@@ -353,12 +463,25 @@ error:
 			strerror(-error));
 }
 
+static void file_chunkdb_dtor(struct chunk_db *chunk_db)
+{
+	struct db *db = chunk_db->db_info;
+
+	unmap_chunk(db->root);
+	close(db->fd);
+}
+
 static struct chunk_db_type file_chunkdb_type = {
 	.spec_prefix = "file:",
 	.info_size = sizeof(struct db),
 	.ctor = file_chunkdb_ctor,
+	.dtor = file_chunkdb_dtor,
 	.read_chunk = file_read_chunk,
 	.write_chunk = file_write_chunk,
+	.read_chunks = file_read_chunks,
+	.write_chunks = file_write_chunks,
+	.has_chunk = file_has_chunk,
+	.scan_chunks = file_scan_chunks,
 	.help = 
 "   file:<path>             Use an (almost) flat file for storing chunks.\n"
 "                           The first 512MB of the file are reserved for\n"
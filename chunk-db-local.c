@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
 
 #include "zunkfs.h"
 #include "chunk-db.h"
@@ -43,14 +44,20 @@ static bool local_read_chunk(unsigned char *chunk, const unsigned char *digest,
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			WARNING("read %s: %s\n", path, strerror(errno));
+			WARNING("read %s: %s\n", digest_string(digest),
+					strerror(errno));
 			close(fd);
 			return false;
 		}
+		if (!n)
+			break;
 		len += n;
 	}
 	close(fd);
 
+	/* trailing zeros aren't stored */
+	memset(chunk + len, 0, CHUNK_SIZE - len);
+
 	return true;
 }
 
@@ -58,7 +65,7 @@ static bool local_write_chunk(const unsigned char *chunk,
 		const unsigned char *digest, void *db_info)
 {
 	char *chunk_dir = db_info;
-	int fd, len, n;
+	int fd, len, n, data_len;
 	char *path;
 	int err;
 
@@ -68,7 +75,7 @@ static bool local_write_chunk(const unsigned char *chunk,
 
 	TRACE("path=%s\n", path);
 
-	fd = open(path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
 	if (fd < 0) {
 		WARNING("%s: %s\n", path, strerror(errno));
 		free(path);
@@ -76,13 +83,16 @@ static bool local_write_chunk(const unsigned char *chunk,
 	}
 	free(path);
 
+	data_len = chunk_data_len(chunk);
+
 	len = 0;
-	while (len < CHUNK_SIZE) {
-		n = write(fd, chunk + len, CHUNK_SIZE - len);
+	while (len < data_len) {
+		n = write(fd, chunk + len, data_len - len);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
-			WARNING("%s: %s\n", path, strerror(errno));
+			WARNING("%s: %s\n", digest_string(digest),
+					strerror(errno));
 			close(fd);
 			return false;
 		}
@@ -95,6 +105,49 @@ static bool local_write_chunk(const unsigned char *chunk,
 	return true;
 }
 
+static bool local_has_chunk(const unsigned char *digest, void *db_info)
+{
+	char *chunk_dir = db_info;
+	struct stat stbuf;
+	char *path;
+	int err;
+
+	err = asprintf(&path, "%s/%s", chunk_dir, digest_string(digest));
+	if (err < 0)
+		return false;
+
+	err = stat(path, &stbuf);
+	free(path);
+
+	return !err && stbuf.st_size <= CHUNK_SIZE;
+}
+
+static bool local_scan_chunks(void (*func)(const unsigned char *digest,
+			void *arg), void *arg, void *db_info)
+{
+	char *chunk_dir = db_info;
+	unsigned char digest[CHUNK_DIGEST_LEN];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(chunk_dir);
+	if (!dir) {
+		WARNING("%s: %s\n", chunk_dir, strerror(errno));
+		return false;
+	}
+
+	while ((de = readdir(dir))) {
+		if (strlen(de->d_name) != CHUNK_DIGEST_STRLEN)
+			continue;
+		if (IS_ERR(__string_digest(de->d_name, digest)))
+			continue;
+		func(digest, arg);
+	}
+
+	closedir(dir);
+	return true;
+}
+
 static char *local_chunkdb_ctor(const char *spec, struct chunk_db *cdb)
 {
 	struct stat stbuf;
@@ -121,6 +174,8 @@ static struct chunk_db_type local_chunkdb_type = {
 	.ctor = local_chunkdb_ctor,
 	.read_chunk = local_read_chunk,
 	.write_chunk = local_write_chunk,
+	.has_chunk = local_has_chunk,
+	.scan_chunks = local_scan_chunks,
 	.help =
 "   dir:<path>              Chunks are stored in specified directory.\n"
 };
@@ -14,9 +14,9 @@
 
 struct chunk {
 	unsigned char digest[CHUNK_DIGEST_LEN];
-	unsigned char data[CHUNK_SIZE];
 	struct list_head lru_entry;
 	struct list_head hash_entry;
+	unsigned char data[];
 };
 
 struct cache {
@@ -35,15 +35,11 @@ static inline struct list_head *cache_bucket(struct cache *cache,
 		(*(unsigned long *)digest & cache->hash_mask);
 }
 
-static bool mem_read_chunk(unsigned char *chunk, const unsigned char *digest,
-		void *db_info)
+static bool __mem_read_chunk(unsigned char *chunk, const unsigned char *digest,
+		struct cache *cache)
 {
-	struct cache *cache = db_info;
 	struct chunk *cp;
 	struct list_head *bucket;
-	bool status = false;
-
-	lock(&cache->mutex);
 
 	bucket = cache_bucket(cache, digest);
 
@@ -51,25 +47,48 @@ static bool mem_read_chunk(unsigned char *chunk, const unsigned char *digest,
 		if (!memcmp(digest, cp->digest, CHUNK_DIGEST_LEN)) {
 			memcpy(chunk, cp->data, CHUNK_SIZE);
 			list_move(&cp->lru_entry, &cache->chunk_lru);
-			status = true;
-			break;
+			return true;
 		}
 	}
 
+	return false;
+}
+
+static bool mem_read_chunk(unsigned char *chunk, const unsigned char *digest,
+		void *db_info)
+{
+	struct cache *cache = db_info;
+	bool status;
+
+	lock(&cache->mutex);
+	status = __mem_read_chunk(chunk, digest, cache);
 	unlock(&cache->mutex);
 
 	return status;
 }
 
-static bool mem_write_chunk(const unsigned char *chunk,
-		const unsigned char *digest, void *db_info)
+static unsigned mem_read_chunks(unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info)
 {
 	struct cache *cache = db_info;
-	struct list_head *bucket;
-	struct chunk *cp;
-	bool status = false;
+	unsigned i, n;
 
 	lock(&cache->mutex);
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = __mem_read_chunk(chunks[i], digests[i], cache);
+		n += ok[i];
+	}
+	unlock(&cache->mutex);
+
+	return n;
+}
+
+static bool __mem_write_chunk(const unsigned char *chunk,
+		const unsigned char *digest, struct cache *cache)
+{
+	struct list_head *bucket;
+	struct chunk *cp;
 
 	bucket = cache_bucket(cache, digest);
 
@@ -80,9 +99,9 @@ static bool mem_write_chunk(const unsigned char *chunk,
 		}
 	}
 
-	cp = malloc(sizeof(struct chunk));
+	cp = malloc(sizeof(struct chunk) + CHUNK_SIZE);
 	if (!cp)
-		goto out;
+		return false;
 
 	memcpy(cp->digest, digest, CHUNK_DIGEST_LEN);
 	memcpy(cp->data, chunk, CHUNK_SIZE);
@@ -100,9 +119,60 @@ static bool mem_write_chunk(const unsigned char *chunk,
 	}
 
 found:
-	status = true;
-out:
+	return true;
+}
+
+static bool mem_write_chunk(const unsigned char *chunk,
+		const unsigned char *digest, void *db_info)
+{
+	struct cache *cache = db_info;
+	bool status;
+
+	lock(&cache->mutex);
+	status = __mem_write_chunk(chunk, digest, cache);
+	unlock(&cache->mutex);
+
+	return status;
+}
+
+static unsigned mem_write_chunks(const unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info)
+{
+	struct cache *cache = db_info;
+	unsigned i, n;
+
+	lock(&cache->mutex);
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = __mem_write_chunk(chunks[i], digests[i], cache);
+		n += ok[i];
+	}
+	unlock(&cache->mutex);
+
+	return n;
+}
+
+/*
+ * Stands in for a write, so a hit counts as a use.
+ */
+static bool mem_has_chunk(const unsigned char *digest, void *db_info)
+{
+	struct cache *cache = db_info;
+	struct list_head *bucket;
+	struct chunk *cp;
+	bool status = false;
+
+	lock(&cache->mutex);
+	bucket = cache_bucket(cache, digest);
+	list_for_each_entry(cp, bucket, hash_entry) {
+		if (!memcmp(digest, cp->digest, CHUNK_DIGEST_LEN)) {
+			list_move(&cp->lru_entry, &cache->chunk_lru);
+			status = true;
+			break;
+		}
+	}
 	unlock(&cache->mutex);
+
 	return status;
 }
 
@@ -152,6 +222,9 @@ static struct chunk_db_type mem_chunkdb_type = {
 	.ctor = mem_chunkdb_ctor,
 	.read_chunk = mem_read_chunk,
 	.write_chunk = mem_write_chunk,
+	.read_chunks = mem_read_chunks,
+	.write_chunks = mem_write_chunks,
+	.has_chunk = mem_has_chunk,
 	.help =
 "   mem:[max]               Dummy chunk database that stores all chunks in\n"
 "                           memory. To limit memory usage, set max to\n"
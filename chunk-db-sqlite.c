@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <sqlite3.h>
 
 #include "zunkfs.h"
@@ -26,81 +27,210 @@ struct db_info {
 #define lock_db(db) lock(&(db)->mutex)
 #define unlock_db(db) unlock(&(db)->mutex)
 
-static bool write_chunk_sqlite(const unsigned char *chunk,
-		const unsigned char *digest, void *db_info_ptr)
+static const char write_sql[] =
+	"INSERT OR IGNORE INTO chunk(hash, data) VALUES(?,?)";
+static const char read_sql[] = "SELECT data FROM chunk WHERE hash = ?";
+static const char scan_sql[] = "SELECT hash FROM chunk";
+static const char has_sql[] = "SELECT 1 FROM chunk WHERE hash = ?";
+
+static sqlite3_stmt *prepare_stmt(struct db_info *db_info, const char *sql)
 {
-	static const char sql[] =
-		"INSERT OR IGNORE INTO chunk(hash, data) VALUES(?,?)";
-	struct db_info *db_info = db_info_ptr;
 	sqlite3_stmt *stmt;
 	int err;
 
-	lock_db(db_info);
-
 	err = sqlite3_prepare(db_info->db, sql, -1, &stmt, 0);
 	if (err != SQLITE_OK) {
 		ERROR("sqlite3_prepare failed: %s\n",
 				sqlite3_errmsg(db_info->db));
-		unlock_db(db_info);
-		return false;
+		return NULL;
 	}
 
-	sqlite3_bind_text(stmt, 1, digest_string(digest), -1, SQLITE_STATIC);
-	sqlite3_bind_blob(stmt, 2, chunk, CHUNK_SIZE, SQLITE_STATIC);
+	return stmt;
+}
+
+static bool __write_chunk_sqlite(sqlite3_stmt *stmt,
+		const unsigned char *chunk, const unsigned char *digest)
+{
+	int err;
+
+	sqlite3_bind_text(stmt, 1, digest_string(digest), -1,
+			SQLITE_TRANSIENT);
+	sqlite3_bind_blob(stmt, 2, chunk, chunk_data_len(chunk), SQLITE_STATIC);
 
 	err = sqlite3_step(stmt);
 	assert(err != SQLITE_ROW);
 
+	return sqlite3_reset(stmt) == SQLITE_OK;
+}
+
+static bool __read_chunk_sqlite(struct db_info *db_info, sqlite3_stmt *stmt,
+		unsigned char *chunk, const unsigned char *digest)
+{
+	bool status = false;
+	int err, len;
+
+	TRACE("%s\n", digest_string(digest));
+
+	sqlite3_bind_text(stmt, 1, digest_string(digest), -1,
+			SQLITE_TRANSIENT);
+
+	err = sqlite3_step(stmt);
+	if (err != SQLITE_ROW) {
+		ERROR("sqlite3_step failed: %s\n",
+				sqlite3_errmsg(db_info->db));
+	} else if ((len = sqlite3_column_bytes(stmt, 0)) > CHUNK_SIZE) {
+		ERROR("sqlite3 query returned %d bytes, more than %d.\n",
+				len, CHUNK_SIZE);
+	} else {
+		TRACE("sqlite3 query got chunk.\n");
+		/* trailing zeros aren't stored */
+		memcpy(chunk, sqlite3_column_blob(stmt, 0), len);
+		memset(chunk + len, 0, CHUNK_SIZE - len);
+		status = true;
+	}
+
+	sqlite3_reset(stmt);
+	return status;
+}
+
+static unsigned write_chunks_sqlite(const unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info_ptr)
+{
+	struct db_info *db_info = db_info_ptr;
+	sqlite3_stmt *stmt;
+	unsigned i, n = 0;
+
+	lock_db(db_info);
+
+	stmt = prepare_stmt(db_info, write_sql);
+	if (!stmt)
+		goto out;
+
+	/*
+	 * One transaction for the whole batch, so sqlite
+	 * only has to sync once.
+	 */
+	if (count > 1)
+		sqlite3_exec(db_info->db, "BEGIN", NULL, NULL, NULL);
+
+	for (i = 0; i < count; i ++) {
+		ok[i] = __write_chunk_sqlite(stmt, chunks[i], digests[i]);
+		n += ok[i];
+	}
+
+	if (count > 1 && sqlite3_exec(db_info->db, "COMMIT", NULL, NULL,
+				NULL) != SQLITE_OK) {
+		ERROR("COMMIT failed: %s\n", sqlite3_errmsg(db_info->db));
+		memset(ok, 0, count * sizeof(bool));
+		n = 0;
+	}
+
 	if (sqlite3_finalize(stmt) != SQLITE_OK) {
 		ERROR("sqlite3_finalize failed: %s\n",
 				sqlite3_errmsg(db_info->db));
-		unlock_db(db_info);
-		return false;
+	}
+out:
+	unlock_db(db_info);
+	return n;
+}
+
+static bool write_chunk_sqlite(const unsigned char *chunk,
+		const unsigned char *digest, void *db_info_ptr)
+{
+	bool ok;
+
+	return write_chunks_sqlite(&chunk, &digest, &ok, 1, db_info_ptr) == 1;
+}
+
+static unsigned read_chunks_sqlite(unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count,
+		void *db_info_ptr)
+{
+	struct db_info *db_info = db_info_ptr;
+	sqlite3_stmt *stmt;
+	unsigned i, n = 0;
+
+	lock_db(db_info);
+
+	stmt = prepare_stmt(db_info, read_sql);
+	if (!stmt)
+		goto out;
+
+	for (i = 0; i < count; i ++) {
+		ok[i] = __read_chunk_sqlite(db_info, stmt, chunks[i],
+				digests[i]);
+		n += ok[i];
 	}
 
+	sqlite3_finalize(stmt);
+out:
 	unlock_db(db_info);
-	return true;
+	return n;
 }
 
 static bool read_chunk_sqlite(unsigned char *chunk, const unsigned char *digest,
 		void *db_info_ptr)
 {
-	static const char sql[] = "SELECT data FROM chunk WHERE hash = ?";
+	bool ok;
+
+	return read_chunks_sqlite(&chunk, &digest, &ok, 1, db_info_ptr) == 1;
+}
+
+static bool has_chunk_sqlite(const unsigned char *digest, void *db_info_ptr)
+{
 	struct db_info *db_info = db_info_ptr;
 	sqlite3_stmt *stmt;
-	int err;
-	bool status = false;
+	bool status;
 
 	lock_db(db_info);
-	err = sqlite3_prepare(db_info->db, sql, -1, &stmt, 0);
-	if (err != SQLITE_OK) {
-		ERROR("sqlite3_prepare failed: %d\n",
-				sqlite3_errmsg(db_info->db));
+
+	stmt = prepare_stmt(db_info, has_sql);
+	if (!stmt) {
 		unlock_db(db_info);
 		return false;
 	}
 
-	TRACE("%s\n", digest_string(digest));
+	sqlite3_bind_text(stmt, 1, digest_string(digest), -1,
+			SQLITE_TRANSIENT);
+	status = sqlite3_step(stmt) == SQLITE_ROW;
 
-	sqlite3_bind_text(stmt, 1, digest_string(digest), -1, SQLITE_STATIC);
+	sqlite3_finalize(stmt);
+	unlock_db(db_info);
 
-	err = sqlite3_step(stmt);
-	if (err != SQLITE_ROW) {
-		ERROR("sqlite3_step failed: %s\n",
-				sqlite3_errmsg(db_info->db));
-	} else if (sqlite3_column_bytes(stmt, 0) != CHUNK_SIZE) {
-		ERROR("sqlite3 query returned %d bytes instead of %d.\n",
-				sqlite3_column_bytes(stmt, 0), CHUNK_SIZE);
-	} else {
-		TRACE("sqlite3 query got chunk.\n");
-		memcpy(chunk, sqlite3_column_blob(stmt, 0), CHUNK_SIZE);
-		status = true;
+	return status;
+}
+
+static bool scan_chunks_sqlite(void (*func)(const unsigned char *digest,
+			void *arg), void *arg, void *db_info_ptr)
+{
+	struct db_info *db_info = db_info_ptr;
+	unsigned char digest[CHUNK_DIGEST_LEN];
+	const unsigned char *hash;
+	sqlite3_stmt *stmt;
+	int err;
+
+	lock_db(db_info);
+
+	stmt = prepare_stmt(db_info, scan_sql);
+	if (!stmt) {
+		unlock_db(db_info);
+		return false;
 	}
 
+	while ((err = sqlite3_step(stmt)) == SQLITE_ROW) {
+		hash = sqlite3_column_text(stmt, 0);
+		if (hash && !IS_ERR(__string_digest((const char *)hash, digest)))
+			func(digest, arg);
+	}
+
+	if (err != SQLITE_DONE)
+		ERROR("sqlite3_step failed: %s\n", sqlite3_errmsg(db_info->db));
+
 	sqlite3_finalize(stmt);
 	unlock_db(db_info);
 
-	return status;
+	return err == SQLITE_DONE;
 }
 
 static char *sqlite_chunkdb_ctor(const char *spec, struct chunk_db *chunk_db)
@@ -122,11 +252,23 @@ static char *sqlite_chunkdb_ctor(const char *spec, struct chunk_db *chunk_db)
 	return 0;
 }
 
+static void sqlite_chunkdb_dtor(struct chunk_db *chunk_db)
+{
+	struct db_info *db_info = chunk_db->db_info;
+
+	sqlite3_close(db_info->db);
+}
+
 static struct chunk_db_type sqlite_chunkdb_type = {
 	.spec_prefix = "sqlite:",
 	.ctor = sqlite_chunkdb_ctor,
+	.dtor = sqlite_chunkdb_dtor,
 	.read_chunk = read_chunk_sqlite,
 	.write_chunk = write_chunk_sqlite,
+	.read_chunks = read_chunks_sqlite,
+	.write_chunks = write_chunks_sqlite,
+	.has_chunk = has_chunk_sqlite,
+	.scan_chunks = scan_chunks_sqlite,
 	.info_size = sizeof(struct db_info),
 	.help =
 "   sqlite:<database>       SQLite storage for chunks. Database schema:\n"
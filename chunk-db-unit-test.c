@@ -108,10 +108,12 @@ static int proc_opt(int opt, char *arg)
 
 static int do_store(int fd)
 {
-	unsigned char chunk[CHUNK_SIZE] = {0};
+	unsigned char chunk[CHUNK_SIZE];
 	unsigned char digest[CHUNK_DIGEST_LEN];
 	int err, n, size = 0;
 
+	memset(chunk, 0, CHUNK_SIZE);
+
 	while (size < CHUNK_SIZE) {
 		n = read(fd, chunk + size, CHUNK_SIZE - size);
 		if (n < 0) {
@@ -141,9 +143,11 @@ static int do_store(int fd)
 
 static void do_find(const unsigned char *digest)
 {
-	unsigned char chunk[CHUNK_SIZE] = {0};
+	unsigned char chunk[CHUNK_SIZE];
 	int err;
 
+	memset(chunk, 0, CHUNK_SIZE);
+
 	err = read_chunk(chunk, digest);
 	if (err < 0)
 		fprintf(stderr, "read_chunk: %s\n", strerror(-err));
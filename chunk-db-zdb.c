@@ -49,6 +49,7 @@ struct request {
 	unsigned char *chunk;
 	const unsigned char *digest;
 	enum request_state state;
+	bool have;
 	struct addr_queue addr_queue;
 	struct list_head connecting_nodes;
 	struct timeval connect_timeout;
@@ -203,6 +204,9 @@ static void store_node(struct request *request, char *addr_str)
 #define STORE_NODE_LEN		(sizeof(STORE_NODE) - 1)
 #define FORWARD_CHUNK		"forward_chunk"
 #define FORWARD_CHUNK_LEN	(sizeof(FORWARD_CHUNK) - 1)
+#define HAS_CHUNK		"has_chunk"
+#define HAVE_CHUNK		"have_chunk"
+#define HAVE_CHUNK_LEN		(sizeof(HAVE_CHUNK) - 1)
 
 static int proc_msg(const char *buf, size_t len, struct node *node)
 {
@@ -219,10 +223,16 @@ static int proc_msg(const char *buf, size_t len, struct node *node)
 		if (req->chunk)
 			base64_decode(msg, req->chunk, CHUNK_SIZE);
 
+	} else if (!strncmp(msg, HAVE_CHUNK, HAVE_CHUNK_LEN)) {
+		msg += HAVE_CHUNK_LEN + 1;
+		if (!strcmp(msg, digest_string(req->digest)))
+			req->have = true;
+
 	} else if (!strncmp(msg, REQUEST_DONE, REQUEST_DONE_LEN)) {
 		msg += REQUEST_DONE_LEN + 1;
 		if (!strcmp(msg, digest_string(req->digest))) {
-			if (req->chunk || addr_queue_empty(&req->addr_queue))
+			if (req->chunk || req->have ||
+					addr_queue_empty(&req->addr_queue))
 				req->state = request_complete;
 			else
 				req->state = request_pending;
@@ -489,7 +499,7 @@ static int __issue_request(struct request *request)
 }
 
 static int issue_request(struct evbuffer *evbuf, struct zdb_info *db_info,
-		const unsigned char *digest, unsigned char *chunk)
+		const unsigned char *digest, unsigned char *chunk, bool *have)
 {
 	struct request request;
 	int error;
@@ -507,6 +517,7 @@ static int issue_request(struct evbuffer *evbuf, struct zdb_info *db_info,
 	request.chunk = chunk;
 	request.digest = digest;
 	request.state = request_pending;
+	request.have = false;
 	request.connect_timeout = db_info->connect_timeout;
 	request.timeout = db_info->request_timeout;
 
@@ -533,6 +544,9 @@ static int issue_request(struct evbuffer *evbuf, struct zdb_info *db_info,
 	list_splice(&request.connecting_nodes, &node_cache);
 	unlock(&cache_mutex);
 
+	if (have)
+		*have = request.have;
+
 	return error;
 }
 
@@ -545,7 +559,7 @@ static bool zdb_read_chunk(unsigned char *chunk, const unsigned char *digest,
 
 	request = evbuffer_new();
 	if (!request)
-		return -ENOMEM;
+		return false;
 
 	if (evbuffer_add_printf(request, "%s %s\r\n", FIND_CHUNK,
 				digest_string(digest)) < 0) {
@@ -554,7 +568,31 @@ static bool zdb_read_chunk(unsigned char *chunk, const unsigned char *digest,
 		return false;
 	}
 
-	return issue_request(request, db_info, digest, chunk) == 0;
+	return issue_request(request, db_info, digest, chunk, NULL) ==
+		CHUNK_SIZE;
+}
+
+static bool zdb_has_chunk(const unsigned char *digest, void *db_info)
+{
+	struct evbuffer *request;
+	bool have = false;
+
+	TRACE("digest=%s\n", digest_string(digest));
+
+	request = evbuffer_new();
+	if (!request)
+		return false;
+
+	if (evbuffer_add_printf(request, "%s %s\r\n", HAS_CHUNK,
+				digest_string(digest)) < 0) {
+		TRACE("evbuffer_add failed\n");
+		evbuffer_free(request);
+		return false;
+	}
+
+	issue_request(request, db_info, digest, NULL, &have);
+
+	return have;
 }
 
 static bool zdb_write_chunk(const unsigned char *chunk,
@@ -567,7 +605,7 @@ static bool zdb_write_chunk(const unsigned char *chunk,
 
 	request = evbuffer_new();
 	if (!request)
-		return -ENOMEM;
+		return false;
 
 	if (evbuffer_add_printf(request, "%s ", zdb_info->store_method) < 0 ||
 			base64_encode_evbuf(request, chunk, CHUNK_SIZE) < 0 ||
@@ -577,7 +615,8 @@ static bool zdb_write_chunk(const unsigned char *chunk,
 		return false;
 	}
 
-	return issue_request(request, db_info, digest, NULL) == 0;
+	return issue_request(request, db_info, digest, NULL, NULL) ==
+		CHUNK_SIZE;
 }
 
 static const char *suffix(const char *str, const char *prefix)
@@ -677,6 +716,8 @@ static struct chunk_db_type zdb_chunkdb_type = {
 	.ctor = zdb_chunkdb_ctor,
 	.read_chunk = zdb_read_chunk,
 	.write_chunk = zdb_write_chunk,
+	.has_chunk = zdb_has_chunk,
+	.remote = true,
 	.help =
 "   zunkdb:<node>[,opts]    Use a \"zunk\" database for chunk storage.\n"
 "                           Initial node is passed in as <ip|name>:<port>.\n"
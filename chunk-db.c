@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
+#include <time.h>
 
 #include <openssl/sha.h>
 #include <sys/stat.h>
@@ -20,32 +21,65 @@
 #include "zunkfs.h"
 #include "chunk-db.h"
 #include "utils.h"
+#include "mutex.h"
+#include "workqueue.h"
+#include "bloom.h"
 
 static LIST_HEAD(chunkdb_types);
 static LIST_HEAD(chunkdb_list);
 
+struct chunkdb_stats chunkdb_stats;
+
+unsigned chunk_shift = __builtin_ctzl(CHUNK_SIZE_DEFAULT);
+unsigned long digests_per_chunk = CHUNK_SIZE_DEFAULT / CHUNK_DIGEST_LEN;
+
+int set_chunk_size(unsigned long size)
+{
+	unsigned shift = size ? __builtin_ctzl(size) : 0;
+
+	if (size != 1UL << shift || shift < CHUNK_SHIFT_MIN ||
+			shift > CHUNK_SHIFT_MAX)
+		return -EINVAL;
+
+	chunk_shift = shift;
+	digests_per_chunk = CHUNK_SIZE / CHUNK_DIGEST_LEN;
+	return 0;
+}
+
 static inline int cmp_digest(const unsigned char *a, const unsigned char *b)
 {
 	return memcmp(a, b, CHUNK_DIGEST_LEN);
 }
 
-static inline unsigned char *digest_chunk(const unsigned char *chunk, 
-		unsigned char *digest)
+bool random_chunk(unsigned char *chunk, unsigned char *digest)
 {
-	SHA1(chunk, CHUNK_SIZE, digest);
-	return digest;
-}
+	int i, r;
+
+	for (i = 0; i < CHUNK_SIZE; i += sizeof(int)) {
+		r = rand();
+		memcpy(chunk + i, &r, sizeof(int));
+	}
 
-#define INT_CHUNK_SIZE	((CHUNK_SIZE + sizeof(int) - 1) / sizeof(int))
+	return write_chunk(chunk, digest);
+}
 
 int random_chunk_digest(unsigned char *digest)
 {
-	int i, chunk_data[INT_CHUNK_SIZE] = {0};
+	unsigned char *chunk;
+	int err;
 
-	for (i = 0; i < INT_CHUNK_SIZE; i ++)
-		chunk_data[i] = rand();
+	chunk = malloc(CHUNK_SIZE);
+	if (!chunk)
+		return -ENOMEM;
 
-	return write_chunk((void *)chunk_data, digest);
+	err = random_chunk(chunk, digest) ? 0 : -EIO;
+	free(chunk);
+	return err;
+}
+
+void zero_chunk_digest(unsigned char *digest)
+{
+	memset(digest, 0, CHUNK_DIGEST_LEN);
 }
 
 static void __attribute__((constructor)) seed_random_number_generator(void)
@@ -53,6 +87,116 @@ static void __attribute__((constructor)) seed_random_number_generator(void)
 	sranddev();
 }
 
+/*
+ * Remember chunks that weren't found in a db for 'ttl' seconds,
+ * so slow dbs aren't asked for them over and over. The cache is
+ * direct mapped; a new miss simply replaces whatever was there.
+ */
+#define NEG_CACHE_SIZE	1024
+
+struct neg_entry {
+	unsigned char digest[CHUNK_DIGEST_LEN];
+	time_t expires;
+};
+
+struct neg_cache {
+	struct mutex mutex;
+	unsigned ttl;
+	struct neg_entry entries[NEG_CACHE_SIZE];
+};
+
+static inline uint32_t digest_key(const unsigned char *digest)
+{
+	uint32_t key;
+	memcpy(&key, digest, sizeof(uint32_t));
+	return key;
+}
+
+static inline struct neg_entry *neg_entry(struct neg_cache *neg_cache,
+		const unsigned char *digest)
+{
+	return neg_cache->entries + digest_key(digest) % NEG_CACHE_SIZE;
+}
+
+static struct neg_cache *new_neg_cache(unsigned ttl)
+{
+	struct neg_cache *neg_cache;
+
+	neg_cache = calloc(1, sizeof(struct neg_cache));
+	if (!neg_cache)
+		return ERR_PTR(ENOMEM);
+
+	init_mutex(&neg_cache->mutex);
+	neg_cache->ttl = ttl;
+
+	return neg_cache;
+}
+
+static void neg_cache_add(struct neg_cache *neg_cache,
+		const unsigned char *digest)
+{
+	struct neg_entry *entry = neg_entry(neg_cache, digest);
+
+	lock(&neg_cache->mutex);
+	memcpy(entry->digest, digest, CHUNK_DIGEST_LEN);
+	entry->expires = time(NULL) + neg_cache->ttl;
+	unlock(&neg_cache->mutex);
+}
+
+static void neg_cache_del(struct neg_cache *neg_cache,
+		const unsigned char *digest)
+{
+	struct neg_entry *entry = neg_entry(neg_cache, digest);
+
+	lock(&neg_cache->mutex);
+	if (!cmp_digest(entry->digest, digest))
+		entry->expires = 0;
+	unlock(&neg_cache->mutex);
+}
+
+static bool neg_cache_test(struct neg_cache *neg_cache,
+		const unsigned char *digest)
+{
+	struct neg_entry *entry = neg_entry(neg_cache, digest);
+	bool hit;
+
+	lock(&neg_cache->mutex);
+	hit = !cmp_digest(entry->digest, digest) && entry->expires > time(NULL);
+	unlock(&neg_cache->mutex);
+
+	return hit;
+}
+
+/*
+ * Returns false if 'cdb' definitely doesn't have the chunk.
+ */
+static bool cdb_may_have(struct chunk_db *cdb, const unsigned char *digest)
+{
+	if (cdb->bloom && !bloom_test(cdb->bloom, digest_key(digest)))
+		return false;
+	if (cdb->neg_cache && neg_cache_test(cdb->neg_cache, digest))
+		return false;
+	return true;
+}
+
+static void bloom_add_digest(const unsigned char *digest, void *bloom)
+{
+	bloom_add(bloom, digest_key(digest));
+}
+
+static const char *opt_value(const char *spec, unsigned long *value)
+{
+	char *end;
+
+	*value = strtoul(spec, &end, 0);
+	if (end == spec || *end != ',')
+		return NULL;
+
+	return end + 1;
+}
+
+#define DEFAULT_BLOOM_SIZE	(1024 * 1024)
+
 void register_chunkdb(struct chunk_db_type *type)
 {
 	assert(type->spec_prefix);
@@ -65,6 +209,10 @@ char *add_chunkdb(const char *spec)
 {
 	struct chunk_db_type *type;
 	struct chunk_db *cdb;
+	unsigned race_delay = 0;
+	unsigned long bloom_size = 0;
+	unsigned long neg_ttl = 0;
+	unsigned long value;
 	int mode;
 	char *error;
 
@@ -78,17 +226,35 @@ char *add_chunkdb(const char *spec)
 		return sprintf_new("No mode (ro/rw) in spec.");
 	}
 
-	if (mode == CHUNKDB_RW) {
-		for (;;) {
-			if (!strncmp(spec, "wt,", 3)) {
-				mode |= CHUNKDB_WT;
-				spec += 3;
-			}  else if (!strncmp(spec, "nc,", 3)) {
-				mode |= CHUNKDB_NC;
-				spec += 3;
-			} else
-				break;
-		}
+	for (;;) {
+		if (mode == CHUNKDB_RW && !strncmp(spec, "wt,", 3)) {
+			mode |= CHUNKDB_WT;
+			spec += 3;
+		}  else if (mode == CHUNKDB_RW && !strncmp(spec, "nc,", 3)) {
+			mode |= CHUNKDB_NC;
+			spec += 3;
+		} else if (!strncmp(spec, "race,", 5)) {
+			mode |= CHUNKDB_RACE;
+			spec += 5;
+		} else if (!strncmp(spec, "race=", 5)) {
+			spec = opt_value(spec + 5, &value);
+			if (!spec)
+				return sprintf_new("Bad race delay.");
+			race_delay = value;
+			mode |= CHUNKDB_RACE;
+		} else if (!strncmp(spec, "bloom,", 6)) {
+			bloom_size = DEFAULT_BLOOM_SIZE;
+			spec += 6;
+		} else if (!strncmp(spec, "bloom=", 6)) {
+			spec = opt_value(spec + 6, &bloom_size);
+			if (!spec || !bloom_size)
+				return sprintf_new("Bad bloom filter size.");
+		} else if (!strncmp(spec, "neg=", 4)) {
+			spec = opt_value(spec + 4, &neg_ttl);
+			if (!spec || !neg_ttl)
+				return sprintf_new("Bad negative cache TTL.");
+		} else
+			break;
 	}
 
 	list_for_each_entry(type, &chunkdb_types, type_entry) {
@@ -99,10 +265,12 @@ char *add_chunkdb(const char *spec)
 
 	return sprintf_new("Unknown chunk-db.");
 found:
-	if ((mode & (CHUNKDB_RO|CHUNKDB_RW)) && !type->read_chunk)
-		return sprintf_new("Chunk-db does not spport reading.");
+	if (!type->read_chunk)
+		return sprintf_new("Chunk-db does not support reading.");
 	if ((mode & CHUNKDB_RW) && !type->write_chunk)
 		return sprintf_new("Chunk-db does not support writing.");
+	if (bloom_size && !type->scan_chunks)
+		return sprintf_new("Chunk-db does not support bloom filters.");
 
 	cdb = malloc(sizeof(struct chunk_db) + type->info_size);
 	if (!cdb)
@@ -110,17 +278,50 @@ found:
 
 	cdb->type = type;
 	cdb->mode = mode;
+	cdb->race_delay = race_delay;
+	cdb->bloom = NULL;
+	cdb->neg_cache = NULL;
 	cdb->db_info = (void *)(cdb + 1);
 
+	/* before the ctor, so there's less to undo */
+	if (neg_ttl) {
+		cdb->neg_cache = new_neg_cache(neg_ttl);
+		if (IS_ERR(cdb->neg_cache)) {
+			cdb->neg_cache = NULL;
+			error = sprintf_new("Can't allocate negative cache.");
+			goto error;
+		}
+	}
+
+	if (bloom_size) {
+		cdb->bloom = new_bloom(bloom_size);
+		if (IS_ERR(cdb->bloom)) {
+			cdb->bloom = NULL;
+			error = sprintf_new("Can't allocate bloom filter.");
+			goto error;
+		}
+	}
+
 	error = type->ctor(spec + strlen(type->spec_prefix), cdb);
-	if (error) {
-		free(cdb);
-		return error;
+	if (error)
+		goto error;
+
+	if (bloom_size && !type->scan_chunks(bloom_add_digest, cdb->bloom,
+				cdb->db_info)) {
+		error = sprintf_new("Can't scan chunk-db.");
+		if (type->dtor)
+			type->dtor(cdb);
+		goto error;
 	}
 
 	list_add_tail(&cdb->db_entry, &chunkdb_list);
 
 	return NULL;
+error:
+	free(cdb->bloom);
+	free(cdb->neg_cache);
+	free(cdb);
+	return error;
 }
 
 void help_chunkdb(void)
@@ -132,56 +333,782 @@ void help_chunkdb(void)
 			fprintf(stderr, "%s\n", type->help);
 }
 
-bool read_chunk(unsigned char *chunk, const unsigned char *digest)
+static unsigned __cdb_read_chunks(struct chunk_db *cdb, unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count)
 {
-	struct chunk_db *cdb;
-	struct chunk_db_type *type;
+	struct chunk_db_type *type = cdb->type;
+	unsigned i, n;
 
-	list_for_each_entry(cdb, &chunkdb_list, db_entry) {
-		type = cdb->type;
-		if ((cdb->mode & (CHUNKDB_RO|CHUNKDB_RW))) {
-			if (type->read_chunk(chunk, digest, cdb->db_info))
-				goto cache_chunk;
+	if (type->read_chunks)
+		return type->read_chunks(chunks, digests, ok, count,
+				cdb->db_info);
+
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = type->read_chunk(chunks[i], digests[i], cdb->db_info);
+		n += ok[i];
+	}
+
+	return n;
+}
+
+/*
+ * Only asks the db for chunks that pass its filters.
+ */
+static unsigned cdb_read_chunks(struct chunk_db *cdb, unsigned char **chunks,
+		const unsigned char **digests, bool *ok, unsigned count)
+{
+	unsigned char **pchunks;
+	const unsigned char **pdigests;
+	unsigned *index;
+	bool *pok;
+	unsigned i, n, nr_read;
+
+	if (!cdb->bloom && !cdb->neg_cache)
+		return __cdb_read_chunks(cdb, chunks, digests, ok, count);
+
+	pchunks = alloca(count * sizeof(unsigned char *));
+	pdigests = alloca(count * sizeof(unsigned char *));
+	index = alloca(count * sizeof(unsigned));
+	pok = alloca(count * sizeof(bool));
+
+	for (i = n = 0; i < count; i ++) {
+		if (!cdb_may_have(cdb, digests[i]))
+			continue;
+		index[n] = i;
+		pchunks[n] = chunks[i];
+		pdigests[n] = digests[i];
+		n ++;
+	}
+
+	if (!n)
+		return 0;
+
+	memset(pok, 0, n * sizeof(bool));
+	nr_read = __cdb_read_chunks(cdb, pchunks, pdigests, pok, n);
+
+	for (i = 0; i < n; i ++) {
+		ok[index[i]] = pok[i];
+		if (!pok[i] && cdb->neg_cache)
+			neg_cache_add(cdb->neg_cache, pdigests[i]);
+	}
+
+	return nr_read;
+}
+
+static unsigned __cdb_write_chunks(struct chunk_db *cdb,
+		const unsigned char **chunks, const unsigned char **digests,
+		bool *ok, unsigned count)
+{
+	struct chunk_db_type *type = cdb->type;
+	unsigned i, n;
+
+	if (type->write_chunks)
+		return type->write_chunks(chunks, digests, ok, count,
+				cdb->db_info);
+
+	for (i = n = 0; i < count; i ++) {
+		ok[i] = type->write_chunk(chunks[i], digests[i], cdb->db_info);
+		n += ok[i];
+	}
+
+	return n;
+}
+
+static bool cdb_has_chunk(struct chunk_db *cdb, const unsigned char *digest)
+{
+	if (!cdb->type->has_chunk)
+		return false;
+	if (cdb->bloom && !bloom_test(cdb->bloom, digest_key(digest)))
+		return false;
+	return cdb->type->has_chunk(digest, cdb->db_info);
+}
+
+/*
+ * Chunks the db already has are not sent again. Remote dbs are only
+ * asked about chunks their bloom filter has seen, as asking about
+ * new ones one at a time would cost more than the batched write.
+ */
+static unsigned cdb_write_chunks(struct chunk_db *cdb,
+		const unsigned char **chunks, const unsigned char **digests,
+		bool *ok, unsigned count)
+{
+	const unsigned char **pchunks = alloca(count * sizeof(unsigned char *));
+	const unsigned char **pdigests = alloca(count * sizeof(unsigned char *));
+	unsigned *index = alloca(count * sizeof(unsigned));
+	bool *pok = alloca(count * sizeof(bool));
+	bool probe = !cdb->type->remote || cdb->bloom;
+	unsigned i, n, m;
+
+	for (i = m = n = 0; i < count; i ++) {
+		if (probe && cdb_has_chunk(cdb, digests[i])) {
+			ok[i] = true;
+			m ++;
+			continue;
 		}
+		index[n] = i;
+		pchunks[n] = chunks[i];
+		pdigests[n] = digests[i];
+		n ++;
 	}
 
-	TRACE("chunk not found: %s\n", digest_string(digest));
+	if (m)
+		__sync_fetch_and_add(&chunkdb_stats.write_bytes_avoided,
+				m * CHUNK_SIZE);
+
+	if (n) {
+		memset(pok, 0, n * sizeof(bool));
+		n = __cdb_write_chunks(cdb, pchunks, pdigests, pok, n);
+		for (i = 0; i < count - m; i ++)
+			ok[index[i]] = pok[i];
+	}
+
+	for (i = 0; n && i < count; i ++) {
+		if (!ok[i])
+			continue;
+		if (cdb->bloom)
+			bloom_add(cdb->bloom, digest_key(digests[i]));
+		if (cdb->neg_cache)
+			neg_cache_del(cdb->neg_cache, digests[i]);
+	}
+
+	return m + n;
+}
+
+bool has_chunk(const unsigned char *digest)
+{
+	struct chunk_db *cdb;
+
+	list_for_each_entry(cdb, &chunkdb_list, db_entry)
+		if (cdb_has_chunk(cdb, digest))
+			return true;
+
 	return false;
-cache_chunk:
+}
+
+/*
+ * Race mode: a run of consecutive dbs marked with "race" is queried
+ * in parallel. Each db joins the race once its race_delay has passed,
+ * or as soon as all running racers are done. Racers read into their
+ * own buffers, and the first verified copy of a chunk wins. There's
+ * no way to interrupt a backend mid-read, so losers are left to run
+ * to completion on a detached thread, and their results are dropped.
+ */
+struct race {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned refs;
+	unsigned running;
+	bool done;
+	unsigned count;
+	unsigned nr_found;
+	unsigned char **chunks;
+	unsigned char *digests;
+	bool *found;
+};
+
+struct racer {
+	struct race *race;
+	struct chunk_db *cdb;
+};
+
+static void put_race(struct race *race)
+{
+	bool last = !--race->refs;
+
+	pthread_mutex_unlock(&race->mutex);
+	if (last) {
+		pthread_cond_destroy(&race->cond);
+		pthread_mutex_destroy(&race->mutex);
+		free(race);
+	}
+}
+
+static void *racer_thread(void *arg)
+{
+	struct racer *racer = arg;
+	struct race *race = racer->race;
+	unsigned char **chunks;
+	const unsigned char **digests;
+	unsigned char *buf = NULL;
+	unsigned *index;
+	bool *ok;
+	unsigned i, n;
+
+	chunks = alloca(race->count * sizeof(unsigned char *));
+	digests = alloca(race->count * sizeof(unsigned char *));
+	index = alloca(race->count * sizeof(unsigned));
+	ok = alloca(race->count * sizeof(bool));
+
+	pthread_mutex_lock(&race->mutex);
+	for (i = n = 0; i < race->count; i ++) {
+		if (race->found[i])
+			continue;
+		index[n] = i;
+		digests[n] = race->digests + i * CHUNK_DIGEST_LEN;
+		n ++;
+	}
+	pthread_mutex_unlock(&race->mutex);
+
+	if (n)
+		buf = malloc(n * CHUNK_SIZE);
+	if (buf) {
+		for (i = 0; i < n; i ++)
+			chunks[i] = buf + i * CHUNK_SIZE;
+		memset(ok, 0, n * sizeof(bool));
+		if (!cdb_read_chunks(racer->cdb, chunks, digests, ok, n))
+			n = 0;
+	}
+
+	pthread_mutex_lock(&race->mutex);
+	for (i = 0; buf && !race->done && i < n; i ++) {
+		if (!ok[i] || race->found[index[i]])
+			continue;
+		if (!verify_chunk(chunks[i], digests[i])) {
+			WARNING("%s returned bad chunk %s\n",
+					racer->cdb->type->spec_prefix,
+					digest_string(digests[i]));
+			continue;
+		}
+		memcpy(race->chunks[index[i]], chunks[i], CHUNK_SIZE);
+		race->found[index[i]] = true;
+		race->nr_found ++;
+	}
+	race->running --;
+	pthread_cond_broadcast(&race->cond);
+	put_race(race);
+
+	free(buf);
+	free(racer);
+	return NULL;
+}
+
+static void start_racer(struct race *race, struct chunk_db *cdb)
+{
+	struct racer *racer;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	racer = malloc(sizeof(struct racer));
+	if (!racer) {
+		WARNING("racer: %s\n", strerror(ENOMEM));
+		return;
+	}
+
+	racer->race = race;
+	racer->cdb = cdb;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	err = pthread_create(&thread, &attr, racer_thread, racer);
+	if (err) {
+		WARNING("pthread_create: %s\n", strerror(err));
+		free(racer);
+	} else {
+		race->running ++;
+		race->refs ++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static void add_msecs(struct timespec *ts, const struct timespec *start,
+		unsigned msecs)
+{
+	ts->tv_sec = start->tv_sec + msecs / 1000;
+	ts->tv_nsec = start->tv_nsec + (msecs % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec ++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Race 'nr_dbs' dbs, starting with 'cdb', for the given chunks.
+ */
+static unsigned race_chunks(struct chunk_db *cdb, unsigned nr_dbs,
+		unsigned char **chunks, const unsigned char **digests,
+		bool *ok, unsigned count)
+{
+	struct timespec start, deadline;
+	struct race *race;
+	unsigned i, nr_found;
+	int err;
+
+	race = calloc(1, sizeof(struct race) +
+			count * (CHUNK_DIGEST_LEN + sizeof(bool)));
+	if (!race)
+		return cdb_read_chunks(cdb, chunks, digests, ok, count);
+
+	pthread_mutex_init(&race->mutex, NULL);
+	pthread_cond_init(&race->cond, NULL);
+	race->refs = 1;
+	race->count = count;
+	race->chunks = chunks;
+	race->digests = (unsigned char *)(race + 1);
+	race->found = (bool *)(race->digests + count * CHUNK_DIGEST_LEN);
+
+	for (i = 0; i < count; i ++)
+		memcpy(race->digests + i * CHUNK_DIGEST_LEN, digests[i],
+				CHUNK_DIGEST_LEN);
+
+	clock_gettime(CLOCK_REALTIME, &start);
+
+	pthread_mutex_lock(&race->mutex);
+	for (i = 0; i < nr_dbs; i ++) {
+		add_msecs(&deadline, &start, cdb->race_delay);
+		while (race->nr_found < count && race->running) {
+			err = pthread_cond_timedwait(&race->cond, &race->mutex,
+					&deadline);
+			if (err == ETIMEDOUT)
+				break;
+		}
+		if (race->nr_found == count)
+			break;
+		start_racer(race, cdb);
+		cdb = list_next_entry(cdb, db_entry);
+	}
+
+	while (race->nr_found < count && race->running)
+		pthread_cond_wait(&race->cond, &race->mutex);
+
+	memcpy(ok, race->found, count * sizeof(bool));
+	nr_found = race->nr_found;
+	race->done = true;
+	put_race(race);
+
+	return nr_found;
+}
+
+/*
+ * Chunks found in 'cdb' are written to all preceeding
+ * writable dbs that are not marked as not-a-cache.
+ */
+static void cache_chunks(struct chunk_db *cdb, const unsigned char **chunks,
+		const unsigned char **digests, unsigned count)
+{
+	bool *ok = alloca(count * sizeof(bool));
+
 	for (;;) {
 		cdb = list_prev_entry(cdb, db_entry);
 		if (&cdb->db_entry == &chunkdb_list)
 			break;
-		type = cdb->type;
+		if ((cdb->mode & (CHUNKDB_RW|CHUNKDB_NC)) == CHUNKDB_RW) {
+			memset(ok, 0, count * sizeof(bool));
+			cdb_write_chunks(cdb, chunks, digests, ok, count);
+		}
+	}
+}
+
+static bool have_cache_before(struct chunk_db *cdb)
+{
+	for (;;) {
+		cdb = list_prev_entry(cdb, db_entry);
+		if (&cdb->db_entry == &chunkdb_list)
+			return false;
 		if ((cdb->mode & (CHUNKDB_RW|CHUNKDB_NC)) == CHUNKDB_RW)
-			type->write_chunk(chunk, digest, cdb->db_info);
+			return true;
 	}
+}
 
-	return true;
+/*
+ * Caches are filled in the background, so reads don't have
+ * to wait for them. A chunk that is already waiting to be
+ * cached is not queued again. When the queue is full, the
+ * chunk is simply not cached.
+ */
+#define CACHE_FILL_THREADS	2
+#define CACHE_FILL_MAX		256
+
+struct cache_fill {
+	struct work work;
+	struct chunk_db *cdb;
+	struct list_head fill_entry;
+	unsigned char digest[CHUNK_DIGEST_LEN];
+	unsigned char chunk[];
+};
+
+static DECLARE_WORKQUEUE(cache_fill_wq, CACHE_FILL_THREADS, CACHE_FILL_MAX);
+static LIST_HEAD(cache_fill_list);
+static DECLARE_MUTEX(cache_fill_mutex);
+
+static void do_cache_fill(struct work *work)
+{
+	struct cache_fill *fill = container_of(work, struct cache_fill, work);
+	const unsigned char *chunk = fill->chunk;
+	const unsigned char *digest = fill->digest;
+
+	cache_chunks(fill->cdb, &chunk, &digest, 1);
+
+	lock(&cache_fill_mutex);
+	list_del(&fill->fill_entry);
+	unlock(&cache_fill_mutex);
+
+	free(fill);
 }
 
-bool write_chunk(const unsigned char *chunk, unsigned char *digest)
+static void queue_cache_fill(struct chunk_db *cdb, const unsigned char *chunk,
+		const unsigned char *digest)
+{
+	struct cache_fill *fill;
+
+	lock(&cache_fill_mutex);
+	list_for_each_entry(fill, &cache_fill_list, fill_entry) {
+		if (!cmp_digest(fill->digest, digest)) {
+			unlock(&cache_fill_mutex);
+			return;
+		}
+	}
+
+	fill = malloc(sizeof(struct cache_fill) + CHUNK_SIZE);
+	if (!fill) {
+		unlock(&cache_fill_mutex);
+		return;
+	}
+
+	init_work(&fill->work, do_cache_fill);
+	fill->cdb = cdb;
+	memcpy(fill->digest, digest, CHUNK_DIGEST_LEN);
+	memcpy(fill->chunk, chunk, CHUNK_SIZE);
+
+	/*
+	 * The worker takes cache_fill_mutex to unlink the fill,
+	 * so it can't free it before it's on the list.
+	 */
+	if (queue_work(&cache_fill_wq, &fill->work)) {
+		list_add_tail(&fill->fill_entry, &cache_fill_list);
+	} else {
+		TRACE("cache fill queue full, not caching %s\n",
+				digest_string(digest));
+		free(fill);
+	}
+	unlock(&cache_fill_mutex);
+}
+
+void flush_chunkdb(void)
+{
+	flush_workqueue(&cache_fill_wq);
+}
+
+static unsigned __read_chunks(unsigned char **chunks,
+		const unsigned char **digests, bool *found, unsigned count)
+{
+	unsigned char **pchunks = alloca(count * sizeof(unsigned char *));
+	const unsigned char **pdigests = alloca(count * sizeof(unsigned char *));
+	unsigned *index = alloca(count * sizeof(unsigned));
+	bool *ok = alloca(count * sizeof(bool));
+	struct chunk_db *cdb, *last;
+	unsigned i, n, m, nr_dbs, nr_found = 0;
+
+	memset(found, 0, count * sizeof(bool));
+
+	list_for_each_entry(cdb, &chunkdb_list, db_entry) {
+		if (nr_found == count)
+			break;
+
+		for (i = n = 0; i < count; i ++) {
+			if (found[i])
+				continue;
+			index[n] = i;
+			pchunks[n] = chunks[i];
+			pdigests[n] = digests[i];
+			n ++;
+		}
+
+		nr_dbs = 1;
+		last = cdb;
+		while (last->mode & CHUNKDB_RACE) {
+			struct chunk_db *next = list_next_entry(last, db_entry);
+			if (&next->db_entry == &chunkdb_list ||
+					!(next->mode & CHUNKDB_RACE))
+				break;
+			last = next;
+			nr_dbs ++;
+		}
+
+		memset(ok, 0, n * sizeof(bool));
+		if (nr_dbs > 1)
+			m = race_chunks(cdb, nr_dbs, pchunks, pdigests, ok, n);
+		else
+			m = cdb_read_chunks(cdb, pchunks, pdigests, ok, n);
+
+		if (!m) {
+			cdb = last;
+			continue;
+		}
+
+		for (i = m = 0; i < n; i ++) {
+			if (!ok[i])
+				continue;
+			found[index[i]] = true;
+			pchunks[m] = pchunks[i];
+			pdigests[m] = pdigests[i];
+			m ++;
+		}
+
+		/*
+		 * Chunks won by a race are cached by the dbs preceeding
+		 * the whole group.
+		 */
+		nr_found += m;
+		if (have_cache_before(cdb))
+			for (i = 0; i < m; i ++)
+				queue_cache_fill(cdb, pchunks[i], pdigests[i]);
+		cdb = last;
+	}
+
+	for (i = 0; i < count; i ++)
+		if (!found[i])
+			TRACE("chunk not found: %s\n", digest_string(digests[i]));
+
+	return nr_found;
+}
+
+/*
+ * Single-flight reads: only one thread fetches a given digest
+ * at a time. Anybody else asking for it while the fetch is in
+ * progress waits for the result, and gets a copy of the chunk.
+ */
+#define FLIGHT_BUCKETS	256
+
+struct flight {
+	unsigned char digest[CHUNK_DIGEST_LEN];
+	struct list_head flight_entry;
+	unsigned refs;
+	bool done;
+	bool found;
+	unsigned char *chunk;
+};
+
+static struct list_head flight_table[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_cond = PTHREAD_COND_INITIALIZER;
+
+static void __attribute__((constructor)) init_flight_table(void)
+{
+	int i;
+
+	for (i = 0; i < FLIGHT_BUCKETS; i ++)
+		list_head_init(&flight_table[i]);
+}
+
+static struct flight *get_flight(const unsigned char *digest, bool *leader)
+{
+	struct list_head *bucket;
+	struct flight *flight;
+
+	bucket = flight_table + digest_key(digest) % FLIGHT_BUCKETS;
+
+	list_for_each_entry(flight, bucket, flight_entry) {
+		if (!cmp_digest(flight->digest, digest)) {
+			flight->refs ++;
+			*leader = false;
+			return flight;
+		}
+	}
+
+	/*
+	 * Without memory for the flight, just read the chunk
+	 * without coalescing.
+	 */
+	*leader = true;
+
+	flight = malloc(sizeof(struct flight));
+	if (!flight)
+		return NULL;
+
+	memcpy(flight->digest, digest, CHUNK_DIGEST_LEN);
+	flight->refs = 1;
+	flight->done = false;
+	flight->found = false;
+	flight->chunk = NULL;
+	list_add(&flight->flight_entry, bucket);
+
+	return flight;
+}
+
+static void put_flight(struct flight *flight)
+{
+	if (!--flight->refs) {
+		free(flight->chunk);
+		free(flight);
+	}
+}
+
+unsigned read_chunks(unsigned char **chunks, const unsigned char **digests,
+		bool *found, unsigned count)
+{
+	struct flight **flights = alloca(count * sizeof(struct flight *));
+	bool *leader = alloca(count * sizeof(bool));
+	unsigned char **pchunks = alloca(count * sizeof(unsigned char *));
+	const unsigned char **pdigests = alloca(count * sizeof(unsigned char *));
+	unsigned *index = alloca(count * sizeof(unsigned));
+	bool *ok = alloca(count * sizeof(bool));
+	struct flight *flight;
+	unsigned i, n, nr_found;
+
+	__sync_fetch_and_add(&chunkdb_stats.reads, count);
+
+	pthread_mutex_lock(&flight_mutex);
+	for (i = 0; i < count; i ++) {
+		flights[i] = get_flight(digests[i], &leader[i]);
+		if (!leader[i])
+			chunkdb_stats.coalesced ++;
+	}
+	pthread_mutex_unlock(&flight_mutex);
+
+	for (i = n = 0; i < count; i ++) {
+		if (!leader[i])
+			continue;
+		index[n] = i;
+		pchunks[n] = chunks[i];
+		pdigests[n] = digests[i];
+		n ++;
+	}
+
+	memset(ok, 0, count * sizeof(bool));
+	if (n)
+		__read_chunks(pchunks, pdigests, ok, n);
+
+	/*
+	 * Publish results before waiting on anybody else, so
+	 * threads waiting on each other's digests can't deadlock.
+	 */
+	pthread_mutex_lock(&flight_mutex);
+	for (i = 0; i < n; i ++) {
+		found[index[i]] = ok[i];
+		flight = flights[index[i]];
+		if (!flight)
+			continue;
+		flight->found = ok[i];
+		if (ok[i] && flight->refs > 1) {
+			flight->chunk = malloc(CHUNK_SIZE);
+			if (flight->chunk)
+				memcpy(flight->chunk, pchunks[i], CHUNK_SIZE);
+		}
+		flight->done = true;
+		list_del(&flight->flight_entry);
+		put_flight(flight);
+	}
+	pthread_cond_broadcast(&flight_cond);
+
+	for (i = 0; i < count; i ++) {
+		if (leader[i])
+			continue;
+		while (!flights[i]->done)
+			pthread_cond_wait(&flight_cond, &flight_mutex);
+	}
+	pthread_mutex_unlock(&flight_mutex);
+
+	/*
+	 * Finished flights don't change, so there's no need to hold
+	 * the lock while copying. If the leader couldn't make a copy,
+	 * read the chunk again.
+	 */
+	for (i = n = 0; i < count; i ++) {
+		if (leader[i])
+			continue;
+		flight = flights[i];
+		found[i] = flight->found && flight->chunk;
+		if (found[i])
+			memcpy(chunks[i], flight->chunk, CHUNK_SIZE);
+		else if (flight->found) {
+			index[n] = i;
+			pchunks[n] = chunks[i];
+			pdigests[n] = digests[i];
+			n ++;
+		}
+	}
+
+	pthread_mutex_lock(&flight_mutex);
+	for (i = 0; i < count; i ++)
+		if (!leader[i])
+			put_flight(flights[i]);
+	pthread_mutex_unlock(&flight_mutex);
+
+	if (n) {
+		memset(ok, 0, n * sizeof(bool));
+		__read_chunks(pchunks, pdigests, ok, n);
+		for (i = 0; i < n; i ++)
+			found[index[i]] = ok[i];
+	}
+
+	for (i = nr_found = 0; i < count; i ++)
+		nr_found += found[i];
+
+	return nr_found;
+}
+
+void log_chunkdb_stats(void)
+{
+	TRACE("reads=%lu coalesced=%lu write_bytes_avoided=%lu\n",
+			chunkdb_stats.reads, chunkdb_stats.coalesced,
+			chunkdb_stats.write_bytes_avoided);
+}
+
+bool read_chunk(unsigned char *chunk, const unsigned char *digest)
+{
+	bool found;
+
+	return read_chunks(&chunk, &digest, &found, 1) == 1;
+}
+
+bool write_chunks(const unsigned char **chunks, unsigned char **digests,
+		unsigned count)
 {
+	const unsigned char **pchunks = alloca(count * sizeof(unsigned char *));
+	const unsigned char **pdigests = alloca(count * sizeof(unsigned char *));
+	unsigned *index = alloca(count * sizeof(unsigned));
+	bool *wrote = alloca(count * sizeof(bool));
+	bool *done = alloca(count * sizeof(bool));
+	bool *ok = alloca(count * sizeof(bool));
 	struct chunk_db *cdb;
-	struct chunk_db_type *type;
-	bool wrote = false;
+	unsigned i, n;
 
-	digest_chunk(chunk, digest);
+	digest_many(chunks, CHUNK_SIZE, digests, count);
+	for (i = 0; i < count; i ++)
+		TRACE("digest=%s\n", digest_string(digests[i]));
 
-	TRACE("digest=%s\n", digest_string(digest));
+	memset(wrote, 0, count * sizeof(bool));
+	memset(done, 0, count * sizeof(bool));
 
 	list_for_each_entry(cdb, &chunkdb_list, db_entry) {
-		type = cdb->type;
-		if ((cdb->mode & CHUNKDB_RW)) {
-			if (!type->write_chunk(chunk, digest, cdb->db_info))
+		if (!(cdb->mode & CHUNKDB_RW))
+			continue;
+
+		for (i = n = 0; i < count; i ++) {
+			if (done[i])
+				continue;
+			index[n] = i;
+			pchunks[n] = chunks[i];
+			pdigests[n] = digests[i];
+			n ++;
+		}
+		if (!n)
+			break;
+
+		memset(ok, 0, n * sizeof(bool));
+		cdb_write_chunks(cdb, pchunks, pdigests, ok, n);
+
+		for (i = 0; i < n; i ++) {
+			if (!ok[i])
 				continue;
-			wrote = true;
+			wrote[index[i]] = true;
 			if (!(cdb->mode & CHUNKDB_WT))
-				break;
+				done[index[i]] = true;
 		}
 	}
 
-	return wrote;
+	for (i = 0; i < count; i ++)
+		if (!wrote[i])
+			return false;
+
+	return true;
 }
 
+bool write_chunk(const unsigned char *chunk, unsigned char *digest)
+{
+	return write_chunks(&chunk, &digest, 1);
+}
 
@@ -5,6 +5,8 @@
 #include "list.h"
 
 struct chunk_db;
+struct bloom;
+struct neg_cache;
 
 struct chunk_db_type {
 	const char *spec_prefix;
@@ -12,11 +14,46 @@ struct chunk_db_type {
 	struct list_head type_entry;
 	/* return error string, freed by caller, NULL if successful */
 	char *(*ctor)(const char *spec, struct chunk_db *chunk_db);
+	/*
+	 * Optional. Undoes ctor, when the db can't be added after all.
+	 * Needed by dbs that hold resources and support scan_chunks.
+	 */
+	void (*dtor)(struct chunk_db *chunk_db);
 	/* return TRUE if successful, FALSE otherwise. */
 	bool (*read_chunk)(unsigned char *chunk, const unsigned char *digest,
 			void *db_info);
 	bool (*write_chunk)(const unsigned char *chunk,
 			const unsigned char *digest, void *db_info);
+	/*
+	 * Optional vectored versions of the above. Set ok[i] for
+	 * every chunk that was transferred, and return the number of
+	 * chunks transferred. When missing, chunk-db.c falls back
+	 * to calling read_chunk/write_chunk in a loop.
+	 */
+	unsigned (*read_chunks)(unsigned char **chunks,
+			const unsigned char **digests, bool *ok,
+			unsigned count, void *db_info);
+	unsigned (*write_chunks)(const unsigned char **chunks,
+			const unsigned char **digests, bool *ok,
+			unsigned count, void *db_info);
+	/*
+	 * Optional. Return TRUE if the db already has the chunk.
+	 * Used to skip writing chunks that are already there.
+	 */
+	bool (*has_chunk)(const unsigned char *digest, void *db_info);
+	/*
+	 * Set if has_chunk costs a round trip, like a write does.
+	 * Writes then only ask it when the db's bloom filter says
+	 * the chunk may be there.
+	 */
+	bool remote;
+	/*
+	 * Optional. Call 'func' for every chunk in the db. Used to
+	 * build the db's bloom filter, so only the first 4 bytes
+	 * of 'digest' have to be valid.
+	 */
+	bool (*scan_chunks)(void (*func)(const unsigned char *digest,
+				void *arg), void *arg, void *db_info);
 	/*
 	 * Help string. Format is:
 	 * <spec>   <description>.
@@ -33,6 +70,9 @@ struct chunk_db_type {
 struct chunk_db {
 	struct chunk_db_type *type;
 	int mode;
+	unsigned race_delay; /* msecs, for CHUNKDB_RACE */
+	struct bloom *bloom; /* chunks that may be in the db */
+	struct neg_cache *neg_cache; /* chunks recently not found */
 	void *db_info;
 	struct list_head db_entry;
 };
@@ -41,12 +81,26 @@ struct chunk_db {
 #define CHUNKDB_RW 1 /* read-write */
 #define CHUNKDB_WT 2 /* write thru */
 #define CHUNKDB_NC 4 /* not-a-cache */
+#define CHUNKDB_RACE 8 /* read in parallel with neighbouring race dbs */
 
 void register_chunkdb(struct chunk_db_type *type);
 char *add_chunkdb(const char *spec);
 
 void help_chunkdb(void);
 
+/* Wait for background cache fills to complete. */
+void flush_chunkdb(void);
+
+struct chunkdb_stats {
+	unsigned long reads;     /* chunks asked for */
+	unsigned long coalesced; /* ...that waited on another thread's read */
+	unsigned long write_bytes_avoided; /* chunks the db already had */
+};
+
+extern struct chunkdb_stats chunkdb_stats;
+
+void log_chunkdb_stats(void);
+
 #define REGISTER_CHUNKDB(type) \
 static void __attribute__((constructor)) register_chunkdb_##type(void) \
 { \
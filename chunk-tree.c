@@ -8,14 +8,32 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "zunkfs.h"
 #include "chunk-tree.h"
+#include "workqueue.h"
+#include "pool.h"
 #include "utils.h"
 
 #define children_of(cnode) \
 	((struct chunk_node **)(cnode)->_private)
 
+static size_t cnode_size(void)
+{
+	return sizeof(struct chunk_node) + CHUNK_SIZE;
+}
+
+static size_t children_size(void)
+{
+	return DIGESTS_PER_CHUNK * sizeof(void *);
+}
+
+static DECLARE_RUNTIME_POOL(cnode_pool, cnode_size);
+static DECLARE_RUNTIME_POOL(children_pool, children_size);
+
+unsigned long nr_dirty_cnodes;
+
 static struct chunk_node *new_chunk_node(struct chunk_tree *ctree,
 		unsigned char *chunk_digest, int leaf)
 {
@@ -24,14 +42,14 @@ static struct chunk_node *new_chunk_node(struct chunk_tree *ctree,
 
 	assert(chunk_digest != NULL);
 
-	cnode = malloc(sizeof(struct chunk_node));
+	cnode = pool_alloc(&cnode_pool);
 	if (!cnode)
 		return ERR_PTR(ENOMEM);
 
 	err = -ENOMEM;
 	cnode->_private = NULL;
 	if (!leaf) {
-		cnode->_private = calloc(DIGESTS_PER_CHUNK, sizeof(void *));
+		cnode->_private = pool_zalloc(&children_pool);
 		if (!cnode->_private)
 			goto error;
 	}
@@ -44,10 +62,23 @@ static struct chunk_node *new_chunk_node(struct chunk_tree *ctree,
 
 	return cnode;
 error:
-	free(cnode);
+	pool_free(&cnode_pool, cnode);
 	return ERR_PTR(-err);
 }
 
+static void free_chunk_node(struct chunk_node *cnode, int leaf)
+{
+	/* only if it couldn't be written */
+	clear_cnode_dirty(cnode);
+	if (cnode->_private) {
+		if (leaf)
+			cnode->ctree->ops->free_private(cnode->_private);
+		else
+			pool_free(&children_pool, cnode->_private);
+	}
+	pool_free(&cnode_pool, cnode);
+}
+
 static void __put_chunk_node(struct chunk_node *node, int leaf);
 
 static int grow_chunk_tree(struct chunk_tree *ctree)
@@ -137,6 +168,7 @@ again:
 		if (IS_ERR(cnode))
 			return cnode;
 		
+		cnode->parent = parent;
 		if (max_path && max_path[i] != path[i]) {
 			memset(cnode->chunk_data, 0, CHUNK_SIZE);
 			mark_cnode_dirty(cnode);
@@ -144,12 +176,11 @@ again:
 			err = ctree->ops->read_chunk(cnode->chunk_data,
 					cnode->chunk_digest);
 			if (err < 0) {
-				free(cnode);
+				free_chunk_node(cnode, !i);
 				return ERR_PTR(-err);
 			}
 		}
 
-		cnode->parent = parent;
 		children_of(parent)[path[i]] = cnode;
 		parent->ref_count ++;
 	}
@@ -170,13 +201,303 @@ static inline unsigned __chunk_nr(const struct chunk_node *cnode)
 
 unsigned chunk_nr(const struct chunk_node *cnode)
 {
-	if (cnode == cnode->ctree->root)
+	if (!cnode->parent)
 		return 0;
 
 	return DIGESTS_PER_CHUNK * chunk_nr(cnode->parent) +
 		__chunk_nr(cnode);
 }
 
+unsigned chunk_level(const struct chunk_node *cnode)
+{
+	unsigned level = cnode->ctree->height;
+
+	for (; cnode->parent; cnode = cnode->parent)
+		level --;
+
+	return level;
+}
+
+/*
+ * Returns the (pinned) parent of leaf 'chunk_nr'.
+ * The leaf must already exist.
+ */
+static struct chunk_node *get_leaf_parent(struct chunk_tree *ctree,
+		unsigned chunk_nr)
+{
+	struct chunk_node *parent;
+	struct chunk_node *cnode;
+	unsigned *path;
+	unsigned nr;
+	int i, err;
+
+	assert(ctree->height > 0);
+	assert(chunk_nr < ctree->nr_leafs);
+
+	path = alloca(sizeof(unsigned *) * ctree->height);
+	assert(path != NULL);
+
+	nr = chunk_nr;
+	for (i = 0; i < ctree->height; i ++) {
+		path[i] = nr % DIGESTS_PER_CHUNK;
+		nr /= DIGESTS_PER_CHUNK;
+	}
+
+	cnode = ctree->root;
+	for (i = ctree->height; --i > 0; ) {
+		parent = cnode;
+
+		cnode = children_of(parent)[path[i]];
+		if (cnode)
+			continue;
+
+		cnode = new_chunk_node(ctree, parent->chunk_data +
+				path[i] * CHUNK_DIGEST_LEN, 0);
+		if (IS_ERR(cnode))
+			return cnode;
+
+		cnode->parent = parent;
+		err = ctree->ops->read_chunk(cnode->chunk_data,
+				cnode->chunk_digest);
+		if (err < 0) {
+			free_chunk_node(cnode, 0);
+			return ERR_PTR(-err);
+		}
+
+		children_of(parent)[path[i]] = cnode;
+		parent->ref_count ++;
+	}
+
+	cnode->ref_count ++;
+	return cnode;
+}
+
+void init_chunk_cursor(struct chunk_tree_cursor *cursor,
+		struct chunk_tree *ctree, unsigned chunk_nr)
+{
+	cursor->ctree = ctree;
+	cursor->parent = NULL;
+	cursor->chunk_nr = chunk_nr;
+}
+
+void release_chunk_cursor(struct chunk_tree_cursor *cursor)
+{
+	if (cursor->parent) {
+		__put_chunk_node(cursor->parent, 0);
+		cursor->parent = NULL;
+	}
+}
+
+/*
+ * Pin the parent of leaf 'chunk_nr' in the cursor. The old parent is
+ * dropped only after the new one is found, so their common ancestors
+ * stay in memory.
+ */
+static int cursor_parent(struct chunk_tree_cursor *cursor, unsigned chunk_nr)
+{
+	struct chunk_node *parent;
+
+	if (cursor->parent &&
+			cursor->parent_nr == chunk_nr / DIGESTS_PER_CHUNK)
+		return 0;
+
+	parent = get_leaf_parent(cursor->ctree, chunk_nr);
+	if (IS_ERR(parent))
+		return -PTR_ERR(parent);
+
+	release_chunk_cursor(cursor);
+	cursor->parent = parent;
+	cursor->parent_nr = chunk_nr / DIGESTS_PER_CHUNK;
+
+	return 0;
+}
+
+/*
+ * Leaves that are not in memory yet are read with a single
+ * ->read_chunks() call.
+ */
+int get_cursor_chunks(struct chunk_tree_cursor *cursor, unsigned count,
+		struct chunk_node **cnodes)
+{
+	struct chunk_tree *ctree = cursor->ctree;
+	struct chunk_node *parent;
+	struct chunk_node **pending;
+	unsigned char **chunks;
+	const unsigned char **digests;
+	unsigned chunk_nr = cursor->chunk_nr;
+	unsigned i, nr, index, nr_pending = 0;
+	int err = 0;
+
+	if (!ctree->height || !ctree->ops->read_chunks ||
+			chunk_nr + count > ctree->nr_leafs) {
+		for (i = 0; i < count; i ++) {
+			cnodes[i] = get_nth_chunk(ctree, chunk_nr + i);
+			if (IS_ERR(cnodes[i])) {
+				err = -PTR_ERR(cnodes[i]);
+				goto error;
+			}
+		}
+		cursor->chunk_nr += count;
+		return 0;
+	}
+
+	pending = alloca(count * sizeof(struct chunk_node *));
+	chunks = alloca(count * sizeof(unsigned char *));
+	digests = alloca(count * sizeof(unsigned char *));
+
+	for (i = 0; i < count; i ++) {
+		nr = chunk_nr + i;
+		index = nr % DIGESTS_PER_CHUNK;
+
+		err = cursor_parent(cursor, nr);
+		if (err)
+			goto error;
+		parent = cursor->parent;
+
+		cnodes[i] = children_of(parent)[index];
+		if (cnodes[i]) {
+			cnodes[i]->ref_count ++;
+			continue;
+		}
+
+		cnodes[i] = new_chunk_node(ctree, parent->chunk_data +
+				index * CHUNK_DIGEST_LEN, 1);
+		if (IS_ERR(cnodes[i])) {
+			err = -PTR_ERR(cnodes[i]);
+			goto error;
+		}
+
+		/*
+		 * Link the new leaf right away, so the parent stays
+		 * pinned. Its data is filled in below.
+		 */
+		cnodes[i]->parent = parent;
+		cnodes[i]->ref_count ++;
+		children_of(parent)[index] = cnodes[i];
+		parent->ref_count ++;
+
+		pending[nr_pending] = cnodes[i];
+		chunks[nr_pending] = cnodes[i]->chunk_data;
+		digests[nr_pending] = cnodes[i]->chunk_digest;
+		nr_pending ++;
+	}
+
+	if (nr_pending) {
+		err = ctree->ops->read_chunks(chunks, digests, nr_pending);
+		if (err < 0) {
+			/*
+			 * Unlink the unread leaves before anybody
+			 * else gets to see them.
+			 */
+			for (nr = 0; nr < nr_pending; nr ++) {
+				parent = pending[nr]->parent;
+				children_of(parent)[__chunk_nr(pending[nr])] =
+					NULL;
+				__put_chunk_node(parent, 0);
+				pending[nr]->ref_count = 0;
+			}
+			goto error;
+		}
+	}
+
+	cursor->chunk_nr += count;
+	return 0;
+error:
+	while (i --) {
+		if (IS_ERR(cnodes[i]))
+			continue;
+		if (cnodes[i]->ref_count)
+			put_chunk_node(cnodes[i]);
+		else
+			free_chunk_node(cnodes[i], 1);
+	}
+	return err;
+}
+
+int get_nth_chunks(struct chunk_tree *ctree, unsigned chunk_nr, unsigned count,
+		struct chunk_node **cnodes)
+{
+	struct chunk_tree_cursor cursor;
+	int err;
+
+	init_chunk_cursor(&cursor, ctree, chunk_nr);
+	err = get_cursor_chunks(&cursor, count, cnodes);
+	release_chunk_cursor(&cursor);
+
+	return err;
+}
+
+int find_missing_leaves(struct chunk_tree *ctree, unsigned chunk_nr,
+		unsigned count, unsigned *nrs,
+		unsigned char (*digests)[CHUNK_DIGEST_LEN])
+{
+	struct chunk_tree_cursor cursor;
+	unsigned i, nr, index;
+	int err, nr_missing = 0;
+
+	if (!ctree->height || chunk_nr >= ctree->nr_leafs)
+		return 0;
+	if (count > ctree->nr_leafs - chunk_nr)
+		count = ctree->nr_leafs - chunk_nr;
+
+	init_chunk_cursor(&cursor, ctree, chunk_nr);
+	for (i = 0; i < count; i ++) {
+		nr = chunk_nr + i;
+		index = nr % DIGESTS_PER_CHUNK;
+
+		err = cursor_parent(&cursor, nr);
+		if (err) {
+			nr_missing = err;
+			break;
+		}
+
+		if (children_of(cursor.parent)[index])
+			continue;
+
+		nrs[nr_missing] = nr;
+		memcpy(digests[nr_missing], cursor.parent->chunk_data +
+				index * CHUNK_DIGEST_LEN, CHUNK_DIGEST_LEN);
+		nr_missing ++;
+	}
+	release_chunk_cursor(&cursor);
+
+	return nr_missing;
+}
+
+struct chunk_node *add_nth_chunk(struct chunk_tree *ctree, unsigned chunk_nr,
+		const unsigned char *chunk, const unsigned char *digest)
+{
+	struct chunk_node *parent;
+	struct chunk_node *cnode = NULL;
+	unsigned index = chunk_nr % DIGESTS_PER_CHUNK;
+	unsigned char *leaf_digest;
+
+	if (!ctree->height || chunk_nr >= ctree->nr_leafs)
+		return NULL;
+
+	parent = get_leaf_parent(ctree, chunk_nr);
+	if (IS_ERR(parent))
+		return parent;
+
+	leaf_digest = parent->chunk_data + index * CHUNK_DIGEST_LEN;
+	if (children_of(parent)[index] ||
+			memcmp(leaf_digest, digest, CHUNK_DIGEST_LEN))
+		goto out;
+
+	cnode = new_chunk_node(ctree, leaf_digest, 1);
+	if (IS_ERR(cnode))
+		goto out;
+
+	memcpy(cnode->chunk_data, chunk, CHUNK_SIZE);
+	cnode->parent = parent;
+	cnode->ref_count ++;
+	children_of(parent)[index] = cnode;
+	parent->ref_count ++;
+out:
+	__put_chunk_node(parent, 0);
+	return cnode;
+}
+
 static int flush_chunk_node(struct chunk_node *cnode)
 {
 	int err;
@@ -188,7 +509,7 @@ static int flush_chunk_node(struct chunk_node *cnode)
 			return err;
 		if (cnode->parent)
 			mark_cnode_dirty(cnode->parent);
-		list_del_init(&cnode->dirty_entry);
+		clear_cnode_dirty(cnode);
 	}
 
 	return 0;
@@ -196,7 +517,6 @@ static int flush_chunk_node(struct chunk_node *cnode)
 
 static void __put_chunk_node(struct chunk_node *cnode, int leaf)
 {
-	struct chunk_tree *ctree = cnode->ctree;
 	struct chunk_node *parent;
 	int err;
 
@@ -210,18 +530,11 @@ static void __put_chunk_node(struct chunk_node *cnode, int leaf)
 					strerror(-err));
 		}
 
-		if (cnode->_private) {
-			if (leaf)
-				ctree->ops->free_private(cnode->_private);
-			else
-				free(cnode->_private);
-		}
-
 		parent = cnode->parent;
 		assert(parent != NULL);
 
 		children_of(parent)[__chunk_nr(cnode)] = NULL;
-		free(cnode);
+		free_chunk_node(cnode, leaf);
 
 		cnode = parent;
 		leaf = 0;
@@ -233,6 +546,73 @@ void put_chunk_node(struct chunk_node *cnode)
 	__put_chunk_node(cnode, 1);
 }
 
+/*
+ * Just tall enough for the last leaf, as get_nth_chunk() has it.
+ * DIGESTS_PER_CHUNK isn't a power of two, so no shortcuts.
+ */
+static unsigned tree_height(unsigned nr_leafs)
+{
+	unsigned height = 0;
+
+	for (nr_leafs -= !!nr_leafs; nr_leafs; nr_leafs /= DIGESTS_PER_CHUNK)
+		height ++;
+
+	return height;
+}
+
+int shrink_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs)
+{
+	struct chunk_node *root;
+	struct chunk_node *child;
+	int i, err;
+
+	assert(nr_leafs <= ctree->nr_leafs);
+
+	while (ctree->height > tree_height(nr_leafs)) {
+		root = ctree->root;
+		for (i = 1; i < DIGESTS_PER_CHUNK; i ++) {
+			if (children_of(root)[i])
+				return -EBUSY;
+		}
+
+		child = children_of(root)[0];
+		if (!child) {
+			child = new_chunk_node(ctree, root->chunk_data,
+					ctree->height == 1);
+			if (IS_ERR(child))
+				return -PTR_ERR(child);
+
+			child->parent = root;
+			err = ctree->ops->read_chunk(child->chunk_data,
+					child->chunk_digest);
+			if (err < 0) {
+				free_chunk_node(child, ctree->height == 1);
+				return err;
+			}
+		} else
+			root->ref_count --;
+
+		/*
+		 * A dirty child writes its digest straight to where
+		 * the root's went, so the root needn't be written.
+		 */
+		memcpy(root->chunk_digest, child->chunk_digest,
+				CHUNK_DIGEST_LEN);
+		child->chunk_digest = root->chunk_digest;
+		child->parent = NULL;
+		child->ref_count ++;
+
+		assert(root->ref_count == 1);
+		free_chunk_node(root, 0);
+
+		ctree->root = child;
+		ctree->height --;
+	}
+
+	ctree->nr_leafs = nr_leafs;
+	return 0;
+}
+
 int init_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs,
 		unsigned char *root_digest, struct chunk_tree_operations *ops)
 {
@@ -246,13 +626,7 @@ int init_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs,
 
 	ctree->ops = ops;
 	ctree->nr_leafs = nr_leafs;
-	ctree->height = 0;
-
-	nr_leafs -= !!nr_leafs;
-
-	/* fls(x) ~= log2(x) + 1 */
-	ctree->height = (fls(nr_leafs) - 1) / (fls(DIGESTS_PER_CHUNK) - 1);
-	ctree->height += !!nr_leafs;
+	ctree->height = tree_height(nr_leafs);
 
 	root = new_chunk_node(ctree, root_digest, !ctree->height);
 	if (IS_ERR(root))
@@ -260,7 +634,7 @@ int init_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs,
 
 	err = ctree->ops->read_chunk(root->chunk_data, root_digest);
 	if (err < 0) {
-		free(root);
+		free_chunk_node(root, !ctree->height);
 		return err;
 	}
 
@@ -277,25 +651,198 @@ void free_chunk_tree(struct chunk_tree *ctree)
 	assert(croot->ref_count == 1);
 	if (is_cnode_dirty(croot))
 		flush_chunk_node(croot);
-	if (croot->_private)
-		free(croot->_private);
-	free(croot);
+	free_chunk_node(croot, !ctree->height);
 }
 
-int flush_chunk_tree(struct chunk_tree *ctree)
+static unsigned cnode_depth(const struct chunk_node *cnode)
 {
+	unsigned depth = 0;
+
+	while ((cnode = cnode->parent))
+		depth ++;
+
+	return depth;
+}
+
+/*
+ * Write out a batch of dirty nodes, with a single ->write_chunks() call
+ * if possible. None of them may be an ancestor of another. Doesn't touch
+ * the dirty list, so it can be done without holding the tree's lock.
+ */
+static int write_chunk_nodes(struct chunk_node **cnodes, unsigned count)
+{
+	struct chunk_tree *ctree = cnodes[0]->ctree;
+	const unsigned char *chunks[CHUNK_BATCH_MAX];
+	unsigned char *digests[CHUNK_BATCH_MAX];
+	unsigned i;
+	int err;
+
+	assert(count <= CHUNK_BATCH_MAX);
+
+	if (count == 1 || !ctree->ops->write_chunks) {
+		for (i = 0; i < count; i ++) {
+			err = ctree->ops->write_chunk(cnodes[i]->chunk_data,
+					cnodes[i]->chunk_digest);
+			if (err < 0)
+				return err;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < count; i ++) {
+		chunks[i] = cnodes[i]->chunk_data;
+		digests[i] = cnodes[i]->chunk_digest;
+	}
+
+	err = ctree->ops->write_chunks(chunks, digests, count);
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Batches within a level don't depend on each other, so they are
+ * encrypted, hashed and written by a pool of threads. The caller
+ * waits for the whole level before moving up to the parents.
+ */
+#define FLUSH_THREADS_MAX	8
+#define FLUSH_INFLIGHT		(FLUSH_THREADS_MAX * 2)
+
+static DECLARE_WORKQUEUE(flush_wq, 0, FLUSH_INFLIGHT);
+
+static void __attribute__((constructor)) init_flush_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > FLUSH_THREADS_MAX)
+		cpus = FLUSH_THREADS_MAX;
+	if (cpus > 1)
+		flush_wq.max_threads = cpus;
+}
+
+struct flush_level {
+	pthread_mutex_t mutex;
+	pthread_cond_t done_cond;
+	unsigned pending;
+	int err;
+};
+
+struct flush_batch {
+	struct work work;
+	struct flush_level *level;
+	struct chunk_node *cnodes[CHUNK_BATCH_MAX];
+	unsigned count;
+};
+
+static void flush_batch_work(struct work *work)
+{
+	struct flush_batch *batch = container_of(work, struct flush_batch,
+			work);
+	struct flush_level *level = batch->level;
+	int err;
+
+	err = write_chunk_nodes(batch->cnodes, batch->count);
+
+	pthread_mutex_lock(&level->mutex);
+	if (err < 0 && !level->err)
+		level->err = err;
+	level->pending --;
+	pthread_cond_signal(&level->done_cond);
+	pthread_mutex_unlock(&level->mutex);
+
+	free(batch);
+}
+
+/*
+ * Write all nodes on 'list'. The last batch is written by the caller,
+ * so small flushes never wait on another thread.
+ */
+static int write_level(struct list_head *list)
+{
+	struct flush_level level = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.done_cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct flush_batch *batch = NULL;
 	struct chunk_node *cnode;
-	int error;
-
-	while (!list_empty(&ctree->dirty_list)) {
-		cnode = container_of(ctree->dirty_list.next,
-				struct chunk_node, dirty_entry);
-		error = flush_chunk_node(cnode);
-		if (error)
-			return error;
+
+	list_for_each_entry(cnode, list, dirty_entry) {
+		if (!batch) {
+			batch = malloc(sizeof(struct flush_batch));
+			if (!batch) {
+				level.err = -ENOMEM;
+				break;
+			}
+			init_work(&batch->work, flush_batch_work);
+			batch->level = &level;
+			batch->count = 0;
+		}
+
+		batch->cnodes[batch->count++] = cnode;
+		if (batch->count < CHUNK_BATCH_MAX ||
+				cnode->dirty_entry.next == list)
+			continue;
+
+		pthread_mutex_lock(&level.mutex);
+		while (level.pending >= FLUSH_INFLIGHT)
+			pthread_cond_wait(&level.done_cond, &level.mutex);
+		level.pending ++;
+		pthread_mutex_unlock(&level.mutex);
+
+		if (!queue_work(&flush_wq, &batch->work))
+			flush_batch_work(&batch->work);
+		batch = NULL;
 	}
 
-	return 0;
+	if (batch) {
+		pthread_mutex_lock(&level.mutex);
+		level.pending ++;
+		pthread_mutex_unlock(&level.mutex);
+		flush_batch_work(&batch->work);
+	}
+
+	pthread_mutex_lock(&level.mutex);
+	while (level.pending)
+		pthread_cond_wait(&level.done_cond, &level.mutex);
+	pthread_mutex_unlock(&level.mutex);
+
+	return level.err;
 }
 
+/*
+ * Flush the tree one level at a time, starting with the leaves.
+ * That way, all dirty nodes of a level can be written together,
+ * as their parents are only written after they are.
+ */
+int flush_chunk_tree(struct chunk_tree *ctree)
+{
+	struct chunk_node *cnode, *next;
+	struct list_head level;
+	int depth, err;
+
+	for (depth = ctree->height; depth >= 0; depth --) {
+		list_head_init(&level);
+
+		list_for_each_entry_safe(cnode, next, &ctree->dirty_list,
+				dirty_entry) {
+			if (cnode_depth(cnode) == depth)
+				list_move_tail(&cnode->dirty_entry, &level);
+		}
+
+		if (list_empty(&level))
+			continue;
+
+		err = write_level(&level);
+		if (err) {
+			list_splice(&level, &ctree->dirty_list);
+			return err;
+		}
 
+		list_for_each_entry_safe(cnode, next, &level, dirty_entry) {
+			if (cnode->parent)
+				mark_cnode_dirty(cnode->parent);
+			clear_cnode_dirty(cnode);
+		}
+	}
+
+	assert(list_empty(&ctree->dirty_list));
+	return 0;
+}
@@ -9,16 +9,24 @@ struct chunk_tree_operations {
 	void (*free_private)(void *);
 	int (*read_chunk)(unsigned char *chunk, const unsigned char *digest);
 	int (*write_chunk)(const unsigned char *chunk, unsigned char *digest);
+	/*
+	 * Optional. Transfer 'count' chunks at once.
+	 * Return 0 on success, -errno on failure.
+	 */
+	int (*read_chunks)(unsigned char **chunks,
+			const unsigned char **digests, unsigned count);
+	int (*write_chunks)(const unsigned char **chunks,
+			unsigned char **digests, unsigned count);
 };
 
 struct chunk_node {
-	unsigned char chunk_data[CHUNK_SIZE];
 	unsigned char *chunk_digest;
 	struct chunk_node *parent;
 	struct chunk_tree *ctree;
 	struct list_head dirty_entry;
 	unsigned ref_count;
 	void *_private;
+	unsigned char chunk_data[];	/* CHUNK_SIZE bytes */
 };
 
 struct chunk_tree {
@@ -29,6 +37,11 @@ struct chunk_tree {
 	struct list_head dirty_list;
 };
 
+/*
+ * Number of dirty chunk nodes, in all trees.
+ */
+extern unsigned long nr_dirty_cnodes;
+
 static inline int is_cnode_dirty(const struct chunk_node *cnode)
 {
 	return !list_empty(&cnode->dirty_entry);
@@ -36,18 +49,89 @@ static inline int is_cnode_dirty(const struct chunk_node *cnode)
 
 static inline void mark_cnode_dirty(struct chunk_node *cnode)
 {
+	if (!is_cnode_dirty(cnode))
+		__sync_fetch_and_add(&nr_dirty_cnodes, 1);
 	list_move_tail(&cnode->dirty_entry, &cnode->ctree->dirty_list);
 }
 
+static inline void clear_cnode_dirty(struct chunk_node *cnode)
+{
+	if (is_cnode_dirty(cnode)) {
+		__sync_fetch_and_sub(&nr_dirty_cnodes, 1);
+		list_del_init(&cnode->dirty_entry);
+	}
+}
+
 struct chunk_node *get_nth_chunk(struct chunk_tree *ctree, unsigned chunk_nr);
+int get_nth_chunks(struct chunk_tree *ctree, unsigned chunk_nr, unsigned count,
+		struct chunk_node **cnodes);
 void put_chunk_node(struct chunk_node *cnode);
 
+static inline void get_chunk_node(struct chunk_node *cnode)
+{
+	cnode->ref_count ++;
+}
+
+/*
+ * Cursor for going through leaves in order. It keeps the parent of
+ * the leaves it returns pinned, so the next leaf is usually found
+ * without walking down from the root. get_cursor_chunks() returns the
+ * next 'count' leaves, pinned, and moves past them.
+ */
+struct chunk_tree_cursor {
+	struct chunk_tree *ctree;
+	struct chunk_node *parent;
+	unsigned parent_nr;
+	unsigned chunk_nr;
+};
+
+static inline void seek_chunk_cursor(struct chunk_tree_cursor *cursor,
+		unsigned chunk_nr)
+{
+	cursor->chunk_nr = chunk_nr;
+}
+
+void init_chunk_cursor(struct chunk_tree_cursor *cursor,
+		struct chunk_tree *ctree, unsigned chunk_nr);
+int get_cursor_chunks(struct chunk_tree_cursor *cursor, unsigned count,
+		struct chunk_node **cnodes);
+void release_chunk_cursor(struct chunk_tree_cursor *cursor);
+
+/*
+ * Read-ahead helpers, so leaves can be read without holding the
+ * tree's lock. find_missing_leaves() returns how many of leaves
+ * [chunk_nr, chunk_nr + count) aren't in memory, and copies out their
+ * numbers and digests. Interior nodes are read in as needed.
+ * add_nth_chunk() then links in a leaf read meanwhile, unless it has
+ * been read in or changed since. Returns the pinned leaf, or NULL if
+ * it wasn't added.
+ */
+int find_missing_leaves(struct chunk_tree *ctree, unsigned chunk_nr,
+		unsigned count, unsigned *nrs,
+		unsigned char (*digests)[CHUNK_DIGEST_LEN]);
+struct chunk_node *add_nth_chunk(struct chunk_tree *ctree, unsigned chunk_nr,
+		const unsigned char *chunk, const unsigned char *digest);
+
 int init_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs,
 		unsigned char *root_digest, struct chunk_tree_operations *ops);
 void free_chunk_tree(struct chunk_tree *ctree);
 int flush_chunk_tree(struct chunk_tree *ctree);
 
+/*
+ * Cuts the tree down to 'nr_leafs' leaves, dropping levels it no longer
+ * needs, so that init_chunk_tree() reads it back the same way. Leaves
+ * past the end are forgotten, and may not be in use. Returns -EBUSY if
+ * they are.
+ */
+int shrink_chunk_tree(struct chunk_tree *ctree, unsigned nr_leafs);
+
+/*
+ * Where a node is: its number among the nodes of its level, and its
+ * level, 0 for leaves. Nodes are linked to their parent before
+ * they're read, so ops->read_chunk() can use these.
+ */
 unsigned chunk_nr(const struct chunk_node *cnode);
+unsigned chunk_level(const struct chunk_node *cnode);
 
 #endif
 
@@ -19,7 +19,7 @@ static const char spaces[] = "
 #define indent_start (spaces + sizeof(spaces) - 1)
 
 static unsigned char rand_digest[CHUNK_DIGEST_LEN];
-static unsigned char rand_chunk[CHUNK_SIZE];
+static unsigned char rand_chunk[CHUNK_SIZE_MAX];
 
 static int test_read_chunk(unsigned char *chunk, const unsigned char *digest)
 {
@@ -3,13 +3,125 @@
 #include <string.h>
 
 #include "digest.h"
+#include "blake3.h"
+#include "sha1-mb.h"
 #include "utils.h"
 
+/*
+ * libcrypto already picks the fastest SHA1 for the CPU at runtime
+ * (SHA-NI, AVX2, SSSE3...), so there's no point in doing it here.
+ */
+static void sha1_digest(const unsigned char *data, size_t data_size,
+		unsigned char *digest)
+{
+	SHA1(data, data_size, digest);
+}
+
+static void blake3_digest(const unsigned char *data, size_t data_size,
+		unsigned char *digest)
+{
+	blake3(data, data_size, digest, SHA_DIGEST_LENGTH);
+}
+
+static const struct digest_algo {
+	const char *name;
+	void (*digest)(const unsigned char *data, size_t data_size,
+			unsigned char *digest);
+} digest_algos[] = {
+	[DIGEST_SHA1]	= { "sha1", sha1_digest },
+	[DIGEST_BLAKE3]	= { "blake3", blake3_digest },
+};
+
+#define NR_DIGEST_ALGOS	(sizeof(digest_algos) / sizeof(digest_algos[0]))
+
+static unsigned digest_algo = DIGEST_SHA1;
+
+/*
+ * Must be done before any chunks are hashed.
+ */
+int set_digest_algo(unsigned algo)
+{
+	if (algo >= NR_DIGEST_ALGOS)
+		return -EINVAL;
+
+	digest_algo = algo;
+	TRACE("using %s (%s)\n", digest_algos[algo].name,
+			algo == DIGEST_BLAKE3 ? blake3_impl() : "libcrypto");
+	return 0;
+}
+
+unsigned get_digest_algo(void)
+{
+	return digest_algo;
+}
+
+const char *digest_algo_name(unsigned algo)
+{
+	return algo < NR_DIGEST_ALGOS ? digest_algos[algo].name : NULL;
+}
+
+int find_digest_algo(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_DIGEST_ALGOS; i ++) {
+		if (!strcmp(name, digest_algos[i].name))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+unsigned char *digest_data(const unsigned char *data, size_t data_size,
+		unsigned char *digest)
+{
+	digest_algos[digest_algo].digest(data, data_size, digest);
+	return digest;
+}
+
+void digest_many(const unsigned char **data, size_t data_size,
+		unsigned char **digests, unsigned count)
+{
+	const unsigned char *pdata[SHA1_MB_MAX_LANES];
+	unsigned char *pdigests[SHA1_MB_MAX_LANES];
+	unsigned lanes = sha1_mb_lanes();
+	unsigned i;
+
+	if (digest_algo != DIGEST_SHA1 || !lanes)
+		goto single;
+
+	for (; count >= lanes; count -= lanes) {
+		sha1_mb(data, data_size, digests);
+		data += lanes;
+		digests += lanes;
+	}
+
+	/*
+	 * A multi-buffer pass takes about as long whether or not all
+	 * lanes are used, so fill the unused ones with repeats when
+	 * that's still better than hashing one at a time.
+	 */
+	if (count >= lanes / 2) {
+		unsigned char spare[SHA_DIGEST_LENGTH];
+
+		for (i = 0; i < lanes; i ++) {
+			pdata[i] = data[i < count ? i : 0];
+			pdigests[i] = i < count ? digests[i] : spare;
+		}
+		sha1_mb(pdata, data_size, pdigests);
+		return;
+	}
+single:
+	for (i = 0; i < count; i ++)
+		digest_data(data[i], data_size, digests[i]);
+}
+
 int verify_digest(const unsigned char *digest, const unsigned char *data,
 		size_t data_size)
 {
 	unsigned char tmp_digest[SHA_DIGEST_LENGTH];
-	SHA1(data, data_size, tmp_digest);
+
+	digest_data(data, data_size, tmp_digest);
 	return !memcmp(tmp_digest, digest, SHA_DIGEST_LENGTH);
 }
 
@@ -16,6 +16,27 @@
 #define SHA_DIGEST_STRLEN (SHA_DIGEST_LENGTH * 2)
 #endif
 
+/*
+ * Chunk digest algorithms. Each filesystem uses one of them for all
+ * of its chunks. They all produce SHA_DIGEST_LENGTH bytes; BLAKE3 is
+ * truncated to fit.
+ */
+#define DIGEST_SHA1	0
+#define DIGEST_BLAKE3	1
+
+int set_digest_algo(unsigned algo);
+unsigned get_digest_algo(void);
+const char *digest_algo_name(unsigned algo);
+int find_digest_algo(const char *name);
+
+unsigned char *digest_data(const unsigned char *data, size_t data_size,
+		unsigned char *digest);
+/*
+ * Digests of 'count' buffers of the same size. Faster than
+ * digest_data() on each, when the CPU can hash several at once.
+ */
+void digest_many(const unsigned char **data, size_t data_size,
+		unsigned char **digests, unsigned count);
 int verify_digest(const unsigned char *digest, const unsigned char *data,
 		size_t data_size);
 
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -27,6 +28,9 @@ static void test1(void);
 static void test2(void);
 static void test3(void);
 static void test4(void);
+static void test5(void);
+static void test6(void);
+static void test7(void);
 
 int main(int argc, char **argv)
 {
@@ -72,6 +76,12 @@ int main(int argc, char **argv)
 		test3();
 	if (1)
 		test4();
+	if (1)
+		test5();
+	if (1)
+		test6();
+	if (1)
+		test7();
 
 	return 0;
 }
@@ -115,9 +125,11 @@ static struct dentry *locked_add_dentry(struct dentry *parent, const char *name,
 {
 	struct dentry *dentry;
 
+	write_lock(&parent->rwlock);
 	lock(&parent->mutex);
 	dentry = add_dentry(parent, name, mode);
 	unlock(&parent->mutex);
+	write_unlock(&parent->rwlock);
 
 	return dentry;
 }
@@ -377,3 +389,286 @@ static void test4(void)
 }
 
 
+
+static void check_lookup(const char *path, bool exists,
+		struct dentry *expected)
+{
+	struct dentry *dentry;
+
+	dentry = find_dentry(path, NULL);
+	if (!exists) {
+		if (!IS_ERR(dentry))
+			panic("find_dentry(%s): found a deleted entry\n", path);
+		return;
+	}
+	if (IS_ERR(dentry))
+		panic("find_dentry(%s): %s\n", path, strerror(PTR_ERR(dentry)));
+	if (expected && dentry != expected)
+		panic("find_dentry(%s): wrong dentry\n", path);
+	put_dentry(dentry);
+}
+
+/*
+ * Big directories are looked up through their name index,
+ * which has to follow adds, deletes and renames.
+ */
+#define BIG_DIR_SIZE	5000
+
+static void check_big_dir(struct dentry **dentries)
+{
+	char path[64];
+	int i;
+
+	for (i = 0; i < BIG_DIR_SIZE; i ++) {
+		sprintf(path, "/big/file-%d", i);
+		check_lookup(path, i % 3 == 2 && i % 30 != 2,
+				dentries ? dentries[i] : NULL);
+		sprintf(path, "/big/renamed-%d", i);
+		check_lookup(path, i % 3 == 1, dentries ? dentries[i] : NULL);
+		sprintf(path, "/other/moved-%d", i);
+		check_lookup(path, i % 30 == 2, dentries ? dentries[i] : NULL);
+	}
+}
+
+static void test5(void)
+{
+	static struct dentry *dentries[BIG_DIR_SIZE];
+	struct dentry *root, *big, *other, *dentry;
+	unsigned long reads;
+	char path[64];
+	int i, err;
+
+	root = find_dentry("/", NULL);
+	if (IS_ERR(root))
+		panic("find_dentry(/): %s\n", strerror(PTR_ERR(root)));
+
+	/* entries, buckets and header all go through AES-XTS */
+	ddent_default_flags = DDENT_USE_AES_XTS;
+	big = locked_add_dentry(root, "big", S_IFDIR | S_IRWXU);
+	if (IS_ERR(big))
+		panic("add_dentry(big): %s\n", strerror(PTR_ERR(big)));
+	ddent_default_flags = DDENT_DEFAULT_FLAGS | DDENT_SHORT_SECRET;
+	other = locked_add_dentry(root, "other", S_IFDIR | S_IRWXU);
+	if (IS_ERR(other))
+		panic("add_dentry(other): %s\n", strerror(PTR_ERR(other)));
+	ddent_default_flags = DDENT_DEFAULT_FLAGS;
+
+	for (i = 0; i < BIG_DIR_SIZE; i ++) {
+		sprintf(path, "file-%d", i);
+		dentries[i] = locked_add_dentry(big, path, S_IFREG | S_IRWXU);
+		if (IS_ERR(dentries[i]))
+			panic("add_dentry(%s): %s\n", path,
+					strerror(PTR_ERR(dentries[i])));
+	}
+
+	dentry = locked_add_dentry(big, "file-1234", S_IFREG | S_IRWXU);
+	assert(IS_ERR(dentry) && PTR_ERR(dentry) == EEXIST);
+
+	/* every third goes, which moves the last ones into their slots */
+	for (i = 0; i < BIG_DIR_SIZE; i += 3) {
+		err = del_dentry(dentries[i]);
+		if (err)
+			panic("del_dentry: %s\n", strerror(-err));
+		put_dentry(dentries[i]);
+		dentries[i] = NULL;
+	}
+
+	for (i = 1; i < BIG_DIR_SIZE; i += 3) {
+		sprintf(path, "renamed-%d", i);
+		err = rename_dentry(dentries[i], path, big);
+		if (err)
+			panic("rename_dentry: %s\n", strerror(-err));
+	}
+
+	for (i = 2; i < BIG_DIR_SIZE; i += 30) {
+		sprintf(path, "moved-%d", i);
+		err = rename_dentry(dentries[i], path, other);
+		if (err)
+			panic("rename_dentry: %s\n", strerror(-err));
+	}
+
+	check_big_dir(dentries);
+
+	for (i = 0; i < BIG_DIR_SIZE; i ++)
+		if (dentries[i])
+			put_dentry(dentries[i]);
+	put_dentry(other);
+	put_dentry(big);
+
+	/*
+	 * Big enough for an index on disk, so a cold lookup
+	 * shouldn't read the whole directory.
+	 */
+	if (BIG_DIR_SIZE >= 4 * DIRENTS_PER_CHUNK) {
+		prune_dcache(0);
+		reads = chunkdb_stats.reads;
+		dentry = find_dentry("/big/file-4997", NULL);
+		if (IS_ERR(dentry))
+			panic("find_dentry: %s\n", strerror(PTR_ERR(dentry)));
+		reads = chunkdb_stats.reads - reads;
+		printf("cold lookup: %lu chunks read\n", reads);
+		assert(dentry->parent->ddent->flags & DDENT_DIR_INDEX);
+		assert(reads < 16);
+		put_dentry(dentry);
+	}
+
+	check_big_dir(NULL);
+	put_dentry(root);
+
+	printf("dir index ok\n");
+}
+
+/*
+ * The dentry cache has to forget names as they come and go.
+ */
+static void test6(void)
+{
+	struct dentry *root, *dir, *dentry;
+	unsigned long hits, negative_hits;
+	int err;
+
+	root = find_dentry("/", NULL);
+	if (IS_ERR(root))
+		panic("find_dentry(/): %s\n", strerror(PTR_ERR(root)));
+
+	dir = locked_add_dentry(root, "cached", S_IFDIR | S_IRWXU);
+	if (IS_ERR(dir))
+		panic("add_dentry(cached): %s\n", strerror(PTR_ERR(dir)));
+	put_dentry(dir);
+
+	negative_hits = dcache_stats.negative_hits;
+	check_lookup("/cached/a", false, NULL);
+	check_lookup("/cached/a", false, NULL);
+	assert(dcache_stats.negative_hits == negative_hits + 1);
+
+	dentry = create_dentry("/cached/a", S_IFREG | S_IRWXU);
+	if (IS_ERR(dentry))
+		panic("create_dentry: %s\n", strerror(PTR_ERR(dentry)));
+	put_dentry(dentry);
+
+	hits = dcache_stats.hits;
+	dentry = find_dentry("/cached/a", NULL);
+	if (IS_ERR(dentry))
+		panic("find_dentry: %s\n", strerror(PTR_ERR(dentry)));
+	assert(dcache_stats.hits > hits);
+
+	/* cached dentries can still be deleted and renamed */
+	dir = find_dentry("/cached", NULL);
+	if (IS_ERR(dir))
+		panic("find_dentry: %s\n", strerror(PTR_ERR(dir)));
+	check_lookup("/cached/b", false, NULL);
+	err = rename_dentry(dentry, "b", dir);
+	if (err)
+		panic("rename_dentry: %s\n", strerror(-err));
+	check_lookup("/cached/a", false, NULL);
+	check_lookup("/cached/b", true, dentry);
+
+	check_lookup("/c", false, NULL);
+	err = rename_dentry(dentry, "c", root);
+	if (err)
+		panic("rename_dentry: %s\n", strerror(-err));
+	check_lookup("/cached/b", false, NULL);
+	check_lookup("/c", true, dentry);
+
+	err = del_dentry(dentry);
+	if (err)
+		panic("del_dentry: %s\n", strerror(-err));
+	put_dentry(dentry);
+	check_lookup("/c", false, NULL);
+
+	/* negative entries under a directory don't keep it busy */
+	check_lookup("/cached/x", false, NULL);
+	err = del_dentry(dir);
+	if (err)
+		panic("del_dentry(cached): %s\n", strerror(-err));
+	put_dentry(dir);
+	check_lookup("/cached", false, NULL);
+
+	prune_dcache(0);
+	put_dentry(root);
+
+	log_dcache_stats();
+	printf("dcache ok\n");
+}
+
+static int scan_tree(struct dentry *dentry, void *data)
+{
+	(*(unsigned long *)data) ++;
+	if (S_ISDIR(dentry->mode))
+		return scan_dir(dentry, scan_tree, data);
+	return 0;
+}
+
+static volatile bool scanning;
+
+static void *scanner(void *arg)
+{
+	struct dentry *dir = arg;
+	unsigned long count;
+	int err;
+
+	while (scanning) {
+		count = 0;
+		err = scan_dir(dir, scan_tree, &count);
+		if (err)
+			panic("scan_dir: %s\n", strerror(-err));
+	}
+
+	return NULL;
+}
+
+/*
+ * Scans of a tree, as statfs does, don't deadlock against
+ * subdirectories being renamed and deleted.
+ */
+static void test7(void)
+{
+	struct dentry *scan, *other, *dentry;
+	pthread_t thread;
+	char path[64];
+	int i, err;
+
+	scan = create_dentry("/scan", S_IFDIR | S_IRWXU);
+	if (IS_ERR(scan))
+		panic("create_dentry: %s\n", strerror(PTR_ERR(scan)));
+	other = create_dentry("/scan/other", S_IFDIR | S_IRWXU);
+	if (IS_ERR(other))
+		panic("create_dentry: %s\n", strerror(PTR_ERR(other)));
+
+	scanning = true;
+	err = pthread_create(&thread, NULL, scanner, scan);
+	if (err)
+		panic("pthread_create: %s\n", strerror(err));
+
+	for (i = 0; i < 2000; i ++) {
+		sprintf(path, "/scan/d-%d", i);
+		dentry = create_dentry(path, S_IFDIR | S_IRWXU);
+		if (IS_ERR(dentry))
+			panic("create_dentry: %s\n",
+					strerror(PTR_ERR(dentry)));
+
+		sprintf(path, "e-%d", i);
+		err = rename_dentry(dentry, path, scan);
+		if (err)
+			panic("rename_dentry: %s\n", strerror(-err));
+		err = rename_dentry(dentry, path, other);
+		if (err)
+			panic("rename_dentry: %s\n", strerror(-err));
+
+		/* the scanner may have it pinned */
+		while ((err = del_dentry(dentry)) == -EBUSY)
+			;
+		if (err)
+			panic("del_dentry: %s\n", strerror(-err));
+		put_dentry(dentry);
+	}
+
+	scanning = false;
+	pthread_join(thread, NULL);
+
+	put_dentry(other);
+	put_dentry(scan);
+	prune_dcache(0);
+
+	printf("scan ok\n");
+}
@@ -13,12 +13,18 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 
-#include <openssl/blowfish.h>
+#include <openssl/rand.h>
 
 #include "dir.h"
+#include "chunk-crypt.h"
+#include "cdc-file.h"
+#include "lz.h"
+#include "pool.h"
 
 static struct dentry *root_dentry = NULL;
 
+uint8_t ddent_default_flags = DDENT_DEFAULT_FLAGS;
+
 #define children_of(cnode) \
 	((struct dentry **)(cnode)->_private)
 #define dentry_ptr(dentry) \
@@ -30,41 +36,251 @@ static inline unsigned dentry_index(const struct dentry *dentry)
 		(struct disk_dentry *)dentry->ddent_cnode->chunk_data;
 }
 
+static size_t dentry_ptrs_size(void)
+{
+	return DIRENTS_PER_CHUNK * sizeof(struct dentry *);
+}
+
+static DECLARE_RUNTIME_POOL(dentry_ptr_pool, dentry_ptrs_size);
+
+static size_t chunk_buf_size(void)
+{
+	return CHUNK_SIZE;
+}
+
+/*
+ * Scratch chunks for encrypting and decompressing, which can be
+ * too big for the stacks of the threads that need them.
+ */
+static DECLARE_RUNTIME_POOL(chunk_buf_pool, chunk_buf_size);
+
 #define chunk_cnode(chunk) \
 	container_of(chunk, struct chunk_node, chunk_data)
 #define chunk_dentry(chunk) \
 	container_of(chunk_cnode(chunk)->ctree, struct dentry, chunk_tree)
 
-static void xor_chunk(unsigned char *dst, const unsigned char *src,
-		const unsigned char *secret)
+/*
+ * Chunks are told apart by where they are, for ciphers that care:
+ * which tree, their level in it, and their number in that level.
+ * Extents move around, so they all share one place.
+ */
+#define DATA_TREE	0ULL
+#define BUCKET_TREE	(1ULL << 63)
+#define EXTENT_POS	(~0ULL)
+
+static uint64_t cnode_pos(const struct chunk_node *cnode, uint64_t tree)
 {
-	int i;
-	for (i = 0; i < CHUNK_SIZE; i ++)
-		*dst++ = *src++ ^ *secret++;
+	return tree | (uint64_t)chunk_level(cnode) << 32 | chunk_nr(cnode);
 }
 
-static void bf_chunk(unsigned char *dst, const unsigned char *src,
-		const unsigned char *secret, int enc)
+static int crypt_data(const struct dentry *dentry, unsigned char *dst,
+		const unsigned char *src, unsigned len, uint64_t pos, int enc)
 {
-	BF_KEY bf_key;
-	int i;
+	if (!dentry->key)
+		return -ENOTSUP;
+
+	return crypt_chunk(dentry->key, dst, src, len, pos, enc);
+}
+
+/*
+ * Takes over 'secret', and works out the dentry's chunk key from it.
+ */
+static int set_dentry_secret(struct dentry *dentry, unsigned char *secret,
+		unsigned secret_len)
+{
+	int cipher = dentry->ddent->flags & DDENT_CRYPTO_MASK;
+	struct chunk_key *key;
+	int err;
+
+	/* XOR needs a chunk's worth */
+	if (cipher == DDENT_USE_XOR && secret_len < CHUNK_SIZE) {
+		free(secret);
+		return -ENOTSUP;
+	}
 
-	BF_set_key(&bf_key, CHUNK_SIZE, secret);
+	key = malloc(sizeof(struct chunk_key));
+	if (!key) {
+		free(secret);
+		return -ENOMEM;
+	}
 
-	/* BF_ecb_encrypt works with 64bits at a time */
-	for (i = 0; i < CHUNK_SIZE/8; i ++) {
-		BF_ecb_encrypt(src, dst, &bf_key, enc);
-		src += 8;
-		dst += 8;
+	err = set_chunk_key(key, cipher, secret, secret_len);
+	if (err) {
+		free(key);
+		free(secret);
+		return err;
 	}
+
+	free(dentry->key);
+	free(dentry->secret_chunk);
+	dentry->secret_chunk = secret;
+	dentry->key = key;
+
+	return 0;
 }
 
-static int read_dentry_chunk(unsigned char *chunk, const unsigned char *digest)
+/*
+ * With DDENT_COMPRESS, a chunk is stored as a header, followed by
+ * the encrypted compressed data, and zeros up to CHUNK_SIZE, which
+ * chunk-dbs don't have to keep. The header is in the clear. Chunks
+ * that don't compress well are stored the usual way, and are told
+ * apart by their header not checking out.
+ */
+struct lz_header {
+	le32_t magic;
+	le32_t len;
+	le32_t csum; /* of the compressed data */
+} __attribute__((packed));
+
+#define LZ_MAGIC	0x315a4c5a
+#define LZ_MAX_LEN	(CHUNK_SIZE - CHUNK_SIZE / 16 - sizeof(struct lz_header))
+
+static uint32_t lz_csum(const unsigned char *data, unsigned len)
+{
+	uint32_t csum = 2166136261U;
+
+	while (len --)
+		csum = (csum ^ *data++) * 16777619U;
+
+	return csum;
+}
+
+static int compress_chunk(const struct dentry *dentry, unsigned char *dst,
+		const unsigned char *src, uint64_t pos)
+{
+	struct lz_header *hdr = (struct lz_header *)dst;
+	unsigned char *payload = dst + sizeof(struct lz_header);
+	int len, crypt_len, err;
+
+	len = lz_compress(src, CHUNK_SIZE, payload, LZ_MAX_LEN);
+	if (len < 0)
+		return len;
+
+	crypt_len = chunk_crypt_len(dentry->key, len);
+	memset(payload + len, 0, CHUNK_SIZE - sizeof(struct lz_header) - len);
+
+	hdr->magic = htole32(LZ_MAGIC);
+	hdr->len = htole32(len);
+	hdr->csum = htole32(lz_csum(payload, len));
+
+	err = crypt_data(dentry, payload, payload, crypt_len, pos, BF_ENCRYPT);
+	if (err)
+		return err;
+
+	return 0;
+}
+
+static int decompress_chunk(const struct dentry *dentry, unsigned char *chunk,
+		uint64_t pos)
 {
-	const struct dentry *dentry = chunk_dentry(chunk);
+	const struct lz_header *hdr = (struct lz_header *)chunk;
+	unsigned char *buf;
+	unsigned len, crypt_len;
 	int err;
 
-	assert(dentry->secret_chunk != NULL);
+	if (le32toh(hdr->magic) != LZ_MAGIC)
+		return -EINVAL;
+
+	len = le32toh(hdr->len);
+	if (len > LZ_MAX_LEN)
+		return -EINVAL;
+
+	/* LZ_MAX_LEN leaves room for the cipher's padding */
+	buf = pool_alloc(&chunk_buf_pool);
+	if (!buf)
+		return -ENOMEM;
+
+	crypt_len = chunk_crypt_len(dentry->key, len);
+	err = crypt_data(dentry, buf, chunk + sizeof(struct lz_header),
+			crypt_len, pos, BF_DECRYPT);
+	if (err)
+		goto out;
+
+	err = -EINVAL;
+	if (lz_csum(buf, len) != le32toh(hdr->csum))
+		goto out;
+	if (lz_decompress(buf, len, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+		goto out;
+
+	err = 0;
+out:
+	pool_free(&chunk_buf_pool, buf);
+	return err;
+}
+
+static int decrypt_chunk(const struct dentry *dentry, unsigned char *chunk,
+		uint64_t pos)
+{
+	if ((dentry->ddent->flags & DDENT_COMPRESS) &&
+			!decompress_chunk(dentry, chunk, pos))
+		return 0;
+
+	return crypt_data(dentry, chunk, chunk, CHUNK_SIZE, pos, BF_DECRYPT);
+}
+
+static int encrypt_chunk(const struct dentry *dentry, unsigned char *dst,
+		const unsigned char *src, uint64_t pos)
+{
+	if ((dentry->ddent->flags & DDENT_COMPRESS) &&
+			!compress_chunk(dentry, dst, src, pos))
+		return 0;
+
+	return crypt_data(dentry, dst, src, CHUNK_SIZE, pos, BF_ENCRYPT);
+}
+
+/*
+ * Holes are named by the zero digest. Older XOR-mode files have their
+ * zero chunks stored, but those encrypt to the secret chunk, so their
+ * digest gives them away too.
+ */
+static bool is_hole(const struct dentry *dentry, const unsigned char *digest)
+{
+	if (is_zero_digest(digest))
+		return true;
+
+	return !(dentry->ddent->flags & (DDENT_CRYPTO_MASK | DDENT_COMPRESS)) &&
+		!memcmp(digest, dentry->ddent->secret_digest, CHUNK_DIGEST_LEN);
+}
+
+/*
+ * read_chunks() that zero-fills holes instead of reading them.
+ */
+static unsigned read_chunks_or_holes(const struct dentry *dentry,
+		unsigned char **chunks, const unsigned char **digests,
+		bool *found, unsigned count)
+{
+	unsigned char **rchunks = alloca(count * sizeof(unsigned char *));
+	const unsigned char **rdigests = alloca(count * sizeof(unsigned char *));
+	bool *rfound = alloca(count * sizeof(bool));
+	unsigned *index = alloca(count * sizeof(unsigned));
+	unsigned i, n, nr_found = 0;
+
+	for (i = n = 0; i < count; i ++) {
+		if (is_hole(dentry, digests[i])) {
+			memset(chunks[i], 0, CHUNK_SIZE);
+			found[i] = true;
+			nr_found ++;
+			continue;
+		}
+		rchunks[n] = chunks[i];
+		rdigests[n] = digests[i];
+		index[n ++] = i;
+	}
+
+	if (!n)
+		return nr_found;
+
+	nr_found += read_chunks(rchunks, rdigests, rfound, n);
+	for (i = 0; i < n; i ++)
+		found[index[i]] = rfound[i];
+
+	return nr_found;
+}
+
+static int __read_dentry_chunk(const struct dentry *dentry,
+		unsigned char *chunk, const unsigned char *digest, uint64_t pos)
+{
+	int err;
 
 	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
 		return -ENOTSUP;
@@ -72,33 +288,78 @@ static int read_dentry_chunk(unsigned char *chunk, const unsigned char *digest)
 	/*
 	 * Chunk will be empty, so nothing to read.
 	 */
-	if (!dentry->size)
+	if (!dentry->size) {
+		memset(chunk, 0, CHUNK_SIZE);
 		return 0;
+	}
 
-	err = read_chunk(chunk, digest);
-	if (err == -ENOENT)
+	if (is_hole(dentry, digest)) {
+		memset(chunk, 0, CHUNK_SIZE);
+		return CHUNK_SIZE;
+	}
+
+	assert(dentry->secret_chunk != NULL);
+
+	if (!read_chunk(chunk, digest))
 		return -EIO;
+
+	err = decrypt_chunk(dentry, chunk, pos);
 	if (err < 0)
 		return err;
 
-	switch(dentry->ddent->flags & DDENT_CRYPTO_MASK) {
-	case DDENT_USE_XOR:
-		xor_chunk(chunk, chunk, dentry->secret_chunk);
-		break;
-	case DDENT_USE_BLOWFISH:
-		bf_chunk(chunk, chunk, dentry->secret_chunk, BF_DECRYPT);
-		break;
-	default:
+	return CHUNK_SIZE;
+}
+
+static int __write_dentry_chunk(const struct dentry *dentry,
+		const unsigned char *chunk, unsigned char *digest, uint64_t pos)
+{
+	unsigned char *real_chunk;
+	int err;
+
+	assert(dentry->secret_chunk != NULL);
+
+	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
 		return -ENOTSUP;
+
+	if (is_zero_chunk(chunk)) {
+		zero_chunk_digest(digest);
+		return CHUNK_SIZE;
 	}
 
-	return CHUNK_SIZE;
+	real_chunk = pool_alloc(&chunk_buf_pool);
+	if (!real_chunk)
+		return -ENOMEM;
+
+	err = encrypt_chunk(dentry, real_chunk, chunk, pos);
+	if (err < 0)
+		goto out;
+
+	err = write_chunk(real_chunk, digest);
+	if (err == -EEXIST)
+		err = CHUNK_SIZE;
+out:
+	pool_free(&chunk_buf_pool, real_chunk);
+	return err;
+}
+
+static int read_dentry_chunk(unsigned char *chunk, const unsigned char *digest)
+{
+	return __read_dentry_chunk(chunk_dentry(chunk), chunk, digest,
+			cnode_pos(chunk_cnode(chunk), DATA_TREE));
 }
 
 static int write_dentry_chunk(const unsigned char *chunk, unsigned char *digest)
 {
-	const struct dentry *dentry = chunk_dentry(chunk);
-	unsigned char real_chunk[CHUNK_SIZE];
+	return __write_dentry_chunk(chunk_dentry(chunk), chunk, digest,
+			cnode_pos(chunk_cnode(chunk), DATA_TREE));
+}
+
+static int read_dentry_chunks(unsigned char **chunks,
+		const unsigned char **digests, unsigned count)
+{
+	const struct dentry *dentry = chunk_dentry(chunks[0]);
+	bool *found = alloca(count * sizeof(bool));
+	unsigned i;
 	int err;
 
 	assert(dentry->secret_chunk != NULL);
@@ -106,28 +367,164 @@ static int write_dentry_chunk(const unsigned char *chunk, unsigned char *digest)
 	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
 		return -ENOTSUP;
 
-	switch(dentry->ddent->flags & DDENT_CRYPTO_MASK) {
-	case DDENT_USE_XOR:
-		xor_chunk(real_chunk, chunk, dentry->secret_chunk);
-		break;
-	case DDENT_USE_BLOWFISH:
-		bf_chunk(real_chunk, chunk, dentry->secret_chunk, BF_ENCRYPT);
-		break;
-	default:
+	if (read_chunks_or_holes(dentry, chunks, digests, found,
+				count) != count)
+		return -EIO;
+
+	for (i = 0; i < count; i ++) {
+		if (is_hole(dentry, digests[i]))
+			continue;
+		err = decrypt_chunk(dentry, chunks[i],
+				cnode_pos(chunk_cnode(chunks[i]), DATA_TREE));
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int write_dentry_chunks(const unsigned char **chunks,
+		unsigned char **digests, unsigned count)
+{
+	const struct dentry *dentry = chunk_dentry(chunks[0]);
+	const unsigned char **real_chunks;
+	unsigned char **real_digests;
+	unsigned char *buf;
+	unsigned i, n;
+	int err = 0;
+
+	assert(dentry->secret_chunk != NULL);
+
+	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
 		return -ENOTSUP;
+
+	buf = malloc(count * CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	real_chunks = alloca(count * sizeof(unsigned char *));
+	real_digests = alloca(count * sizeof(unsigned char *));
+	for (i = n = 0; i < count; i ++) {
+		if (is_zero_chunk(chunks[i])) {
+			zero_chunk_digest(digests[i]);
+			continue;
+		}
+		err = encrypt_chunk(dentry, buf + n * CHUNK_SIZE, chunks[i],
+				cnode_pos(chunk_cnode(chunks[i]), DATA_TREE));
+		if (err < 0)
+			goto out;
+		real_chunks[n] = buf + n * CHUNK_SIZE;
+		real_digests[n ++] = digests[i];
 	}
 
-	err = write_chunk(real_chunk, digest);
-	if (err == -EEXIST)
-		return CHUNK_SIZE;
+	if (n)
+		err = write_chunks(real_chunks, real_digests, n) ? 0 : -EIO;
+out:
+	free(buf);
+	return err;
+}
+
+/*
+ * Content-defined chunking stores extents of any length up to
+ * CHUNK_SIZE, each zero-padded to a chunk of its own. Only the extent
+ * itself is encrypted, so the padding stays zeros that chunk-dbs
+ * don't have to keep.
+ */
+int read_dentry_extent(const struct dentry *dentry, unsigned char *chunk,
+		unsigned len, const unsigned char *digest)
+{
+	int err;
+
+	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
+		return -ENOTSUP;
+
+	if (is_zero_digest(digest)) {
+		memset(chunk, 0, CHUNK_SIZE);
+		return 0;
+	}
+
+	assert(dentry->secret_chunk != NULL);
+
+	if (!read_chunk(chunk, digest))
+		return -EIO;
+
+	if ((dentry->ddent->flags & DDENT_COMPRESS) &&
+			!decompress_chunk(dentry, chunk, EXTENT_POS))
+		return 0;
+
+	err = crypt_data(dentry, chunk, chunk,
+			chunk_crypt_len(dentry->key, len), EXTENT_POS,
+			BF_DECRYPT);
+	if (err < 0)
+		return err;
+
+	memset(chunk + len, 0, CHUNK_SIZE - len);
+	return 0;
+}
+
+int write_dentry_extents(const struct dentry *dentry,
+		const unsigned char **extents, const unsigned *lens,
+		unsigned char **digests, unsigned count)
+{
+	const unsigned char **real_chunks;
+	unsigned char **real_digests;
+	unsigned char *buf, *padded, *dst;
+	unsigned i, n, crypt_len;
+	int err = 0;
+
+	assert(dentry->secret_chunk != NULL);
+
+	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
+		return -ENOTSUP;
+
+	buf = malloc((count + 1) * CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	padded = buf + count * CHUNK_SIZE;
+
+	real_chunks = alloca(count * sizeof(unsigned char *));
+	real_digests = alloca(count * sizeof(unsigned char *));
+	for (i = n = 0; i < count; i ++) {
+		memcpy(padded, extents[i], lens[i]);
+		memset(padded + lens[i], 0, CHUNK_SIZE - lens[i]);
+		if (is_zero_chunk(padded)) {
+			zero_chunk_digest(digests[i]);
+			continue;
+		}
 
+		dst = buf + n * CHUNK_SIZE;
+		if (!(dentry->ddent->flags & DDENT_COMPRESS) ||
+				compress_chunk(dentry, dst, padded, EXTENT_POS)) {
+			crypt_len = chunk_crypt_len(dentry->key, lens[i]);
+			err = crypt_data(dentry, dst, padded, crypt_len,
+					EXTENT_POS, BF_ENCRYPT);
+			if (err < 0)
+				goto out;
+			memset(dst + crypt_len, 0, CHUNK_SIZE - crypt_len);
+		}
+
+		real_chunks[n] = dst;
+		real_digests[n ++] = digests[i];
+	}
+
+	if (n)
+		err = write_chunks(real_chunks, real_digests, n) ? 0 : -EIO;
+out:
+	free(buf);
 	return err;
 }
 
+static void free_dentry_ptrs(void *ptrs)
+{
+	pool_free(&dentry_ptr_pool, ptrs);
+}
+
 static struct chunk_tree_operations dentry_ctree_ops = {
-	.free_private = free,
+	.free_private = free_dentry_ptrs,
 	.read_chunk   = read_dentry_chunk,
 	.write_chunk  = write_dentry_chunk,
+	.read_chunks  = read_dentry_chunks,
+	.write_chunks = write_dentry_chunks,
 };
 
 static struct dentry *new_dentry(struct dentry *parent,
@@ -151,10 +548,17 @@ static struct dentry *new_dentry(struct dentry *parent,
 	dentry->mtime.tv_sec = le32toh(ddent->mtime);
 	dentry->mtime.tv_usec = ddent->mtime_csec * 10000;
 
+	init_rwlock(&dentry->rwlock);
 	init_mutex(&dentry->mutex);
 	dentry->ref_count = 0;
+	dentry->dcache_refs = 0;
 	memset(&dentry->chunk_tree, 0, sizeof(struct chunk_tree));
 	dentry->secret_chunk = NULL;
+	dentry->key = NULL;
+	dentry->cdc = NULL;
+	dentry->dir_index = NULL;
+	dentry->disk_index = NULL;
+	list_head_init(&dentry->dcache_negs);
 
 	if (parent) {
 		locked_inc(&parent->ref_count, parent->ddent_mutex);
@@ -180,10 +584,93 @@ int init_disk_dentry(struct disk_dentry *ddent)
 	return err;
 }
 
+/*
+ * From libcrypto rather than rand(), as there's so little of it.
+ */
+static int random_short_secret(unsigned char *secret)
+{
+	return RAND_bytes(secret, CHUNK_DIGEST_LEN) == 1 ? 0 : -EIO;
+}
+
+void get_inline_data(const struct disk_dentry *ddent, unsigned char *buf,
+		unsigned len)
+{
+	const unsigned char *tail = ddent->name +
+		strnlen((char *)ddent->name, DDENT_NAME_MAX) + 1;
+	unsigned n;
+
+	assert(len <= ddent_inline_room(ddent));
+
+	n = len < CHUNK_DIGEST_LEN ? len : CHUNK_DIGEST_LEN;
+	memcpy(buf, ddent->digest, n);
+	buf += n;
+	len -= n;
+
+	n = len < CHUNK_DIGEST_LEN ? len : CHUNK_DIGEST_LEN;
+	memcpy(buf, ddent->secret_digest, n);
+	buf += n;
+	len -= n;
+
+	memcpy(buf, tail, len);
+}
+
+void set_inline_data(struct disk_dentry *ddent, const unsigned char *buf,
+		unsigned len)
+{
+	unsigned char *tail = ddent->name +
+		strnlen((char *)ddent->name, DDENT_NAME_MAX) + 1;
+	unsigned n;
+
+	assert(len <= ddent_inline_room(ddent));
+
+	n = len < CHUNK_DIGEST_LEN ? len : CHUNK_DIGEST_LEN;
+	memcpy(ddent->digest, buf, n);
+	buf += n;
+	len -= n;
+
+	n = len < CHUNK_DIGEST_LEN ? len : CHUNK_DIGEST_LEN;
+	memcpy(ddent->secret_digest, buf, n);
+	buf += n;
+	len -= n;
+
+	memcpy(tail, buf, len);
+}
+
+/*
+ * Renames keep inline data in place, which moves with the name's end.
+ */
+static void set_ddent_name(struct disk_dentry *ddent, const char *name)
+{
+	unsigned char data[2 * CHUNK_DIGEST_LEN + DDENT_NAME_MAX];
+	unsigned size = le64toh(ddent->size);
+
+	if (ddent->flags & DDENT_INLINE)
+		get_inline_data(ddent, data, size);
+	namcpy(ddent->name, name);
+	if (ddent->flags & DDENT_INLINE)
+		set_inline_data(ddent, data, size);
+}
+
+/*
+ * Enough name index buckets for 'entries' to fill them halfway.
+ */
+static unsigned buckets_for(uint64_t entries)
+{
+	unsigned nr = 1;
+
+	while (nr * (BUCKET_ENTRIES / 2) < entries)
+		nr *= 2;
+
+	return nr;
+}
+
 static inline unsigned __dentry_chunk_count(const struct dentry *dentry)
 {
-	if (S_ISREG(dentry->mode))
+	if (S_ISREG(dentry->mode)) {
+		if (dentry->ddent->flags & DDENT_CDC)
+			return cdc_index_chunks(dentry->size);
 		return (dentry->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	}
 	assert(S_ISDIR(dentry->mode));
 	return (dentry->size + DIRENTS_PER_CHUNK - 1) / DIRENTS_PER_CHUNK;
 }
@@ -193,209 +680,1590 @@ unsigned dentry_chunk_count(const struct dentry *dentry)
 	unsigned long chunks;
 	unsigned long total;
 
+	if (dentry->ddent->flags & DDENT_INLINE)
+		return 0;
+
 	chunks = __dentry_chunk_count(dentry);
 	total = 0;
 
+	/* the index's header and buckets */
+	if (dentry->ddent->flags & DDENT_DIR_INDEX)
+		total += 1 + buckets_for(dentry->size);
+
 	while (chunks) {
 		total += chunks;
 		chunks /= DIGESTS_PER_CHUNK;
 	}
 
-	return total + 1; /* account for secret chunk */
+	/* account for secret chunk */
+	return total + !(dentry->ddent->flags & DDENT_SHORT_SECRET);
 }
 
-struct chunk_node *get_dentry_chunk(struct dentry *dentry, unsigned chunk_nr)
-{
-	assert(have_mutex(&dentry->mutex));
-
-	if (dentry->chunk_tree.root == NULL) {
-		int err;
+/*
+ * On-disk name index of DDENT_DIR_INDEX directories, see dir.h. The
+ * dentry keeps the header, and the tree of buckets. Buckets changed
+ * since the last flush stay pinned in ->dirty, so a run of creates
+ * doesn't write out a bucket for each.
+ */
+struct disk_index {
+	struct dentry *dentry;
+	struct dir_header header;
+	struct dir_header written;	/* as last read or written */
+	struct chunk_tree tree;
+	struct chunk_node **dirty;	/* one per bucket */
+};
 
-		/*
-		 * secret must be read before the root chunk is read.
-		 */
-		dentry->secret_chunk = malloc(CHUNK_SIZE);
-		if (!dentry->secret_chunk)
-			return ERR_PTR(ENOMEM);
-		err = read_chunk(dentry->secret_chunk,
-				dentry->ddent->secret_digest);
-		if (err < 0)
-			return ERR_PTR(-err);
-		err = init_chunk_tree(&dentry->chunk_tree,
-				__dentry_chunk_count(dentry),
-				dentry->ddent->digest, &dentry_ctree_ops);
-		if (err < 0)
-			return ERR_PTR(-err);
-	}
+#define bucket_index(chunk) \
+	container_of(chunk_cnode(chunk)->ctree, struct disk_index, tree)
+#define bucket_entries(cnode) \
+	((struct dir_bucket_entry *)(cnode)->chunk_data)
 
-	return get_nth_chunk(&dentry->chunk_tree, chunk_nr);
+static int read_bucket_chunk(unsigned char *chunk, const unsigned char *digest)
+{
+	return __read_dentry_chunk(bucket_index(chunk)->dentry, chunk, digest,
+			cnode_pos(chunk_cnode(chunk), BUCKET_TREE));
+}
+
+static int write_bucket_chunk(const unsigned char *chunk,
+		unsigned char *digest)
+{
+	return __write_dentry_chunk(bucket_index(chunk)->dentry, chunk,
+			digest, cnode_pos(chunk_cnode(chunk), BUCKET_TREE));
+}
+
+static struct chunk_tree_operations bucket_ctree_ops = {
+	.read_chunk   = read_bucket_chunk,
+	.write_chunk  = write_bucket_chunk,
+};
+
+static struct disk_index *new_disk_index(struct dentry *dir,
+		const struct dir_header *header)
+{
+	unsigned nr = le32toh(header->nr_buckets);
+	struct disk_index *dx;
+	int err;
+
+	dx = malloc(sizeof(struct disk_index));
+	if (!dx)
+		return ERR_PTR(ENOMEM);
+
+	dx->dentry = dir;
+	dx->header = *header;
+	dx->written = *header;
+	dx->dirty = calloc(nr, sizeof(struct chunk_node *));
+	if (!dx->dirty) {
+		free(dx);
+		return ERR_PTR(ENOMEM);
+	}
+
+	err = init_chunk_tree(&dx->tree, nr, dx->header.buckets,
+			&bucket_ctree_ops);
+	if (err < 0) {
+		free(dx->dirty);
+		free(dx);
+		return ERR_PTR(-err);
+	}
+
+	return dx;
+}
+
+static int load_disk_index(struct dentry *dir)
+{
+	struct dir_header header;
+	struct disk_index *dx;
+	unsigned char *chunk;
+	unsigned nr;
+	int err;
+
+	chunk = malloc(CHUNK_SIZE);
+	if (!chunk)
+		return -ENOMEM;
+	err = read_dentry_extent(dir, chunk, sizeof(struct dir_header),
+			dir->ddent->digest);
+	memcpy(&header, chunk, sizeof(struct dir_header));
+	free(chunk);
+	if (err < 0)
+		return err;
+
+	nr = le32toh(header.nr_buckets);
+	if (!nr || (nr & (nr - 1)))
+		return -EIO;
+
+	dx = new_disk_index(dir, &header);
+	if (IS_ERR(dx))
+		return -PTR_ERR(dx);
+
+	dir->disk_index = dx;
+	return 0;
+}
+
+static void release_dirty_buckets(struct disk_index *dx)
+{
+	unsigned b;
+
+	for (b = 0; b < le32toh(dx->header.nr_buckets); b ++) {
+		if (dx->dirty[b]) {
+			put_chunk_node(dx->dirty[b]);
+			dx->dirty[b] = NULL;
+		}
+	}
+}
+
+static void free_disk_index(struct dentry *dir)
+{
+	struct disk_index *dx = dir->disk_index;
+
+	if (!dx)
+		return;
+
+	release_dirty_buckets(dx);
+	free_chunk_tree(&dx->tree);
+	free(dx->dirty);
+	free(dx);
+	dir->disk_index = NULL;
+}
+
+/*
+ * Call after flushing the tree of ddents, whose root is in the header.
+ */
+static int flush_disk_index(struct dentry *dir)
+{
+	struct disk_index *dx = dir->disk_index;
+	const unsigned char *header = (unsigned char *)&dx->header;
+	unsigned char *digest = dir->ddent->digest;
+	unsigned len = sizeof(struct dir_header);
+	int err;
+
+	err = flush_chunk_tree(&dx->tree);
+	if (err < 0)
+		return err;
+	release_dirty_buckets(dx);
+
+	if (!memcmp(&dx->header, &dx->written, len))
+		return 0;
+
+	err = write_dentry_extents(dir, &header, &len, &digest, 1);
+	if (err < 0)
+		return err;
+
+	dx->written = dx->header;
+	dir->dirty = 1;
+	return 0;
+}
+
+/*
+ * Goes back to the plain format, if the index can't be kept up to date.
+ */
+static void drop_disk_index(struct dentry *dir, int err)
+{
+	WARNING("%s: dropping name index: %s\n", dir->ddent->name,
+			strerror(-err));
+
+	lock(dir->ddent_mutex);
+	memcpy(dir->ddent->digest, dir->disk_index->header.ddents,
+			CHUNK_DIGEST_LEN);
+	dir->ddent->flags &= ~DDENT_DIR_INDEX;
+	unlock(dir->ddent_mutex);
+
+	dir->chunk_tree.root->chunk_digest = dir->ddent->digest;
+	dir->dirty = 1;
+	free_disk_index(dir);
+}
+
+static inline unsigned hash_bucket(const struct disk_index *dx, uint32_t hash)
+{
+	return hash & (le32toh(dx->header.nr_buckets) - 1);
+}
+
+static void put_bucket(struct disk_index *dx, unsigned b,
+		struct chunk_node *cnode, bool dirty)
+{
+	if (dirty) {
+		mark_cnode_dirty(cnode);
+		if (!dx->dirty[b]) {
+			dx->dirty[b] = cnode;
+			return;
+		}
+	}
+	put_chunk_node(cnode);
+}
+
+/*
+ * Returns the number of entries in use.
+ */
+static unsigned bucket_used(const struct dir_bucket_entry *e)
+{
+	unsigned i;
+
+	for (i = 0; i < BUCKET_ENTRIES && le32toh(e[i].slot); i ++)
+		;
+
+	return i;
+}
+
+static int find_bucket_entry(const struct dir_bucket_entry *e,
+		uint32_t hash, unsigned slot)
+{
+	unsigned i;
+
+	for (i = 0; i < BUCKET_ENTRIES && le32toh(e[i].slot); i ++) {
+		if (le32toh(e[i].hash) == hash &&
+				le32toh(e[i].slot) == slot + 1)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Doubles the number of buckets. Bucket b's entries are split
+ * between it and bucket b + nr, which is added to the tree.
+ */
+static int grow_buckets(struct disk_index *dx)
+{
+	unsigned nr = le32toh(dx->header.nr_buckets);
+	struct chunk_node *lo_cnode, *hi_cnode;
+	struct dir_bucket_entry *lo, *hi;
+	struct chunk_node **dirty;
+	unsigned b, i, j, k;
+
+	dirty = realloc(dx->dirty, 2 * nr * sizeof(struct chunk_node *));
+	if (!dirty)
+		return -ENOMEM;
+	memset(dirty + nr, 0, nr * sizeof(struct chunk_node *));
+	dx->dirty = dirty;
+
+	for (b = 0; b < nr; b ++) {
+		lo_cnode = get_nth_chunk(&dx->tree, b);
+		if (IS_ERR(lo_cnode))
+			return -PTR_ERR(lo_cnode);
+		hi_cnode = get_nth_chunk(&dx->tree, nr + b);
+		if (IS_ERR(hi_cnode)) {
+			put_chunk_node(lo_cnode);
+			return -PTR_ERR(hi_cnode);
+		}
+
+		lo = bucket_entries(lo_cnode);
+		hi = bucket_entries(hi_cnode);
+		for (i = j = k = 0; i < BUCKET_ENTRIES && le32toh(lo[i].slot);
+				i ++) {
+			if (le32toh(lo[i].hash) & nr)
+				hi[k ++] = lo[i];
+			else
+				lo[j ++] = lo[i];
+		}
+		memset(lo + j, 0, (i - j) * sizeof(struct dir_bucket_entry));
+
+		put_bucket(dx, b, lo_cnode, i != j);
+		put_bucket(dx, nr + b, hi_cnode, k != 0);
+	}
+
+	dx->header.nr_buckets = htole32(2 * nr);
+	return 0;
+}
+
+static int disk_index_add(struct disk_index *dx, uint32_t hash, unsigned slot)
+{
+	struct chunk_node *cnode;
+	struct dir_bucket_entry *e;
+	unsigned b, i;
+	int err;
+
+	if (buckets_for(dx->dentry->size + 1) >
+			le32toh(dx->header.nr_buckets)) {
+		err = grow_buckets(dx);
+		if (err < 0)
+			return err;
+	}
+
+	for (;;) {
+		b = hash_bucket(dx, hash);
+		cnode = get_nth_chunk(&dx->tree, b);
+		if (IS_ERR(cnode))
+			return -PTR_ERR(cnode);
+
+		e = bucket_entries(cnode);
+		i = bucket_used(e);
+		if (i < BUCKET_ENTRIES) {
+			e[i].hash = htole32(hash);
+			e[i].slot = htole32(slot + 1);
+			put_bucket(dx, b, cnode, true);
+			return 0;
+		}
+
+		/* full, however unlikely */
+		put_chunk_node(cnode);
+		err = grow_buckets(dx);
+		if (err < 0)
+			return err;
+	}
+}
+
+static int disk_index_del(struct disk_index *dx, uint32_t hash, unsigned slot)
+{
+	struct chunk_node *cnode;
+	struct dir_bucket_entry *e;
+	unsigned b, last;
+	int i;
+
+	b = hash_bucket(dx, hash);
+	cnode = get_nth_chunk(&dx->tree, b);
+	if (IS_ERR(cnode))
+		return -PTR_ERR(cnode);
+
+	e = bucket_entries(cnode);
+	i = find_bucket_entry(e, hash, slot);
+	if (i < 0) {
+		put_chunk_node(cnode);
+		return -EIO;
+	}
+
+	last = bucket_used(e) - 1;
+	e[i] = e[last];
+	memset(e + last, 0, sizeof(struct dir_bucket_entry));
+
+	put_bucket(dx, b, cnode, true);
+	return 0;
+}
+
+static int disk_index_swap(struct disk_index *dx, uint32_t hash_a,
+		unsigned slot_a, uint32_t hash_b, unsigned slot_b)
+{
+	struct chunk_node *a, *b;
+	int i, j;
+
+	a = get_nth_chunk(&dx->tree, hash_bucket(dx, hash_a));
+	if (IS_ERR(a))
+		return -PTR_ERR(a);
+	b = get_nth_chunk(&dx->tree, hash_bucket(dx, hash_b));
+	if (IS_ERR(b)) {
+		put_chunk_node(a);
+		return -PTR_ERR(b);
+	}
+
+	i = find_bucket_entry(bucket_entries(a), hash_a, slot_a);
+	j = find_bucket_entry(bucket_entries(b), hash_b, slot_b);
+	if (i < 0 || j < 0) {
+		put_chunk_node(a);
+		put_chunk_node(b);
+		return -EIO;
+	}
+
+	bucket_entries(a)[i].slot = htole32(slot_b + 1);
+	bucket_entries(b)[j].slot = htole32(slot_a + 1);
+
+	put_bucket(dx, hash_bucket(dx, hash_a), a, true);
+	put_bucket(dx, hash_bucket(dx, hash_b), b, true);
+	return 0;
+}
+
+/*
+ * Inline files get a one-leaf tree that's filled in from the ddent. Its
+ * digest is that of a hole to begin with, so setting it up reads nothing.
+ */
+static int init_inline_tree(struct dentry *dentry)
+{
+	static unsigned char hole_digest[CHUNK_DIGEST_LEN];
+	struct chunk_node *root;
+	int err;
+
+	err = init_chunk_tree(&dentry->chunk_tree, 1, hole_digest,
+			&dentry_ctree_ops);
+	if (err < 0)
+		return err;
+
+	root = dentry->chunk_tree.root;
+	root->chunk_digest = dentry->ddent->digest;
+	memset(root->chunk_data, 0, CHUNK_SIZE);
+	get_inline_data(dentry->ddent, root->chunk_data, dentry->size);
+
+	return 0;
+}
+
+int init_dentry_tree(struct dentry *dentry)
+{
+	if (dentry->chunk_tree.root == NULL) {
+		unsigned char *root_digest, *secret;
+		int err;
+
+		if (dentry->ddent->flags & DDENT_INLINE)
+			return init_inline_tree(dentry);
+
+		/*
+		 * secret must be read before the root chunk is read.
+		 */
+		if (dentry->ddent->flags & DDENT_SHORT_SECRET) {
+			secret = malloc(CHUNK_DIGEST_LEN);
+			if (!secret)
+				return -ENOMEM;
+			memcpy(secret, dentry->ddent->secret_digest,
+					CHUNK_DIGEST_LEN);
+			err = set_dentry_secret(dentry, secret,
+					CHUNK_DIGEST_LEN);
+		} else {
+			secret = malloc(CHUNK_SIZE);
+			if (!secret)
+				return -ENOMEM;
+			if (!read_chunk(secret, dentry->ddent->secret_digest)) {
+				free(secret);
+				return -EIO;
+			}
+			err = set_dentry_secret(dentry, secret, CHUNK_SIZE);
+		}
+		if (err)
+			return err;
+		root_digest = dentry->ddent->digest;
+		if (dentry->ddent->flags & DDENT_DIR_INDEX) {
+			err = load_disk_index(dentry);
+			if (err < 0)
+				return err;
+			root_digest = dentry->disk_index->header.ddents;
+		}
+		err = init_chunk_tree(&dentry->chunk_tree,
+				__dentry_chunk_count(dentry), root_digest,
+				&dentry_ctree_ops);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+struct chunk_node *get_dentry_chunk(struct dentry *dentry, unsigned chunk_nr)
+{
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return ERR_PTR(-err);
+
+	return get_nth_chunk(&dentry->chunk_tree, chunk_nr);
+}
+
+int get_dentry_chunks(struct dentry *dentry, unsigned chunk_nr, unsigned count,
+		struct chunk_node **cnodes)
+{
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+
+	return get_nth_chunks(&dentry->chunk_tree, chunk_nr, count, cnodes);
+}
+
+/*
+ * dentry->mutex is dropped while the chunks are being read.
+ */
+int prefetch_dentry_chunks(struct dentry *dentry, unsigned chunk_nr,
+		unsigned count, struct chunk_node **cnodes)
+{
+	unsigned char (*digests)[CHUNK_DIGEST_LEN];
+	const unsigned char **dp;
+	unsigned char **chunks;
+	unsigned char *buf;
+	unsigned *nrs;
+	bool *found;
+	struct chunk_node *cnode;
+	int i, n, err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	memset(cnodes, 0, count * sizeof(struct chunk_node *));
+
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+	if ((dentry->ddent->flags & ~DDENT_VALID_FLAGS) != 0)
+		return -ENOTSUP;
+
+	nrs = alloca(count * sizeof(unsigned));
+	digests = alloca(count * CHUNK_DIGEST_LEN);
+
+	n = find_missing_leaves(&dentry->chunk_tree, chunk_nr, count, nrs,
+			digests);
+	if (n <= 0)
+		return n;
+
+	buf = malloc(n * CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	dp = alloca(n * sizeof(unsigned char *));
+	chunks = alloca(n * sizeof(unsigned char *));
+	found = alloca(n * sizeof(bool));
+	for (i = 0; i < n; i ++) {
+		chunks[i] = buf + i * CHUNK_SIZE;
+		dp[i] = digests[i];
+	}
+
+	unlock(&dentry->mutex);
+	read_chunks_or_holes(dentry, chunks, dp, found, n);
+	for (i = 0; i < n; i ++) {
+		if (found[i] && !is_hole(dentry, dp[i]) &&
+				decrypt_chunk(dentry, chunks[i],
+					DATA_TREE | nrs[i]) < 0)
+			found[i] = false;
+	}
+	lock(&dentry->mutex);
+
+	err = 0;
+	for (i = 0; i < n; i ++) {
+		if (!found[i])
+			continue;
+		cnode = add_nth_chunk(&dentry->chunk_tree, nrs[i], chunks[i],
+				digests[i]);
+		if (IS_ERR(cnode)) {
+			err = -PTR_ERR(cnode);
+			break;
+		}
+		cnodes[nrs[i] - chunk_nr] = cnode;
+	}
+
+	free(buf);
+	return err;
+}
+
+/*
+ * Moves an inline file's data out to chunks, giving it a secret
+ * first. The ddent is left pointing at a hole until the next flush.
+ * For DDENT_CDC files, the tree's one chunk becomes an empty index,
+ * and the data is buffered to be cut into extents.
+ */
+static int uninline_dentry(struct dentry *dentry)
+{
+	unsigned char secret_digest[CHUNK_DIGEST_LEN];
+	struct chunk_node *root;
+	unsigned char *secret;
+	unsigned secret_len;
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+
+	secret_len = CHUNK_SIZE;
+	if (dentry->ddent->flags & DDENT_SHORT_SECRET)
+		secret_len = CHUNK_DIGEST_LEN;
+
+	secret = malloc(secret_len);
+	if (!secret)
+		return -ENOMEM;
+	if (dentry->ddent->flags & DDENT_SHORT_SECRET) {
+		err = random_short_secret(secret);
+		memcpy(secret_digest, secret, CHUNK_DIGEST_LEN);
+	} else
+		err = random_chunk(secret, secret_digest) ? 0 : -EIO;
+	if (err) {
+		free(secret);
+		return err;
+	}
+	err = set_dentry_secret(dentry, secret, secret_len);
+	if (err)
+		return err;
+
+	root = dentry->chunk_tree.root;
+	if (dentry->ddent->flags & DDENT_CDC) {
+		err = cdc_set_data(dentry, root->chunk_data, dentry->size);
+		if (err < 0)
+			return err;
+		memset(root->chunk_data, 0, CHUNK_SIZE);
+	}
+
+	lock(dentry->ddent_mutex);
+	memcpy(dentry->ddent->secret_digest, secret_digest, CHUNK_DIGEST_LEN);
+	zero_chunk_digest(dentry->ddent->digest);
+	dentry->ddent->flags &= ~DDENT_INLINE;
+	unlock(dentry->ddent_mutex);
+
+	mark_cnode_dirty(root);
+	dentry->dirty = 1;
+
+	return 0;
+}
+
+int prepare_dentry_write(struct dentry *dentry, uint64_t end)
+{
+	assert(have_mutex(&dentry->mutex));
+
+	if (!(dentry->ddent->flags & DDENT_INLINE) ||
+			end <= ddent_inline_room(dentry->ddent))
+		return 0;
+
+	return uninline_dentry(dentry);
+}
+
+int init_dentry_cursor(struct dentry *dentry, struct chunk_tree_cursor *cursor,
+		unsigned chunk_nr)
+{
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	err = init_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+
+	init_chunk_cursor(cursor, &dentry->chunk_tree, chunk_nr);
+	return 0;
+}
+
+/*
+ * 'cnode' is the chunk holding dentry 'nr', and the reference
+ * to it is passed on to the dentry.
+ */
+static struct dentry *__get_nth_dentry(struct dentry *parent,
+		struct chunk_node *cnode, unsigned nr)
+{
+	struct dentry *dentry;
+	struct disk_dentry *ddent;
+	unsigned chunk_off;
+
+	assert(have_mutex(&parent->mutex));
+
+	chunk_off = nr % DIRENTS_PER_CHUNK;
+
+	if (!cnode->_private) {
+		cnode->_private = pool_zalloc(&dentry_ptr_pool);
+		if (!cnode->_private) {
+			dentry = ERR_PTR(ENOMEM);
+			goto error;
+		}
+	}
+
+	dentry = children_of(cnode)[chunk_off];
+	if (dentry)
+		goto got_dentry;
+
+	ddent = (struct disk_dentry *)cnode->chunk_data + chunk_off;
+	dentry = new_dentry(parent, ddent, cnode, &parent->mutex);
+	if (IS_ERR(dentry))
+		goto error;
+
+got_dentry:
+	if (dentry->ref_count)
+		put_chunk_node(cnode);
+	dentry->ref_count ++;
+	return dentry;
+error:
+	put_chunk_node(cnode);
+	return dentry;
 }
 
 static struct dentry *get_nth_dentry(struct dentry *parent, unsigned nr)
 {
-	struct dentry *dentry;
-	struct disk_dentry *ddent;
 	struct chunk_node *cnode;
-	unsigned chunk_nr;
-	unsigned chunk_off;
-	int err;
 
-	assert(have_mutex(&parent->mutex));
+	assert(have_mutex(&parent->mutex));
+
+	cnode = get_dentry_chunk(parent, nr / DIRENTS_PER_CHUNK);
+	if (IS_ERR(cnode))
+		return (void *)cnode;
+
+	return __get_nth_dentry(parent, cnode, nr);
+}
+
+/*
+ * A directory's tree never shrinks by itself, but is read back just
+ * tall enough for the directory's size. Leaves past the end can still
+ * be pinned by deleted entries, in which case the next flush does it.
+ */
+static int trim_dentry_tree(struct dentry *dentry)
+{
+	unsigned nr = __dentry_chunk_count(dentry);
+	int err;
+
+	if (!S_ISDIR(dentry->mode) || dentry->chunk_tree.nr_leafs == nr)
+		return 0;
+
+	err = shrink_chunk_tree(&dentry->chunk_tree, nr);
+	return err == -EBUSY ? 0 : err;
+}
+
+/*
+ * Dentry must be either unused, but for the dcache, or have
+ * it's mutex locked.
+ */
+static int flush_dentry(struct dentry *dentry)
+{
+	struct chunk_node *root = dentry->chunk_tree.root;
+	int err = 0;
+
+	assert(have_mutex(dentry->ddent_mutex));
+	assert(have_mutex(&dentry->mutex) ||
+			dentry->ref_count == dentry->dcache_refs);
+
+	/*
+	 * Inline data goes back into the ddent, and never to a chunk-db.
+	 */
+	if ((dentry->ddent->flags & DDENT_INLINE) && root &&
+			is_cnode_dirty(root)) {
+		assert(!dentry->chunk_tree.height);
+		set_inline_data(dentry->ddent, root->chunk_data, dentry->size);
+		clear_cnode_dirty(root);
+		dentry->dirty = 1;
+	}
+
+	if (dentry->cdc) {
+		err = cdc_commit(dentry);
+		if (err < 0)
+			WARNING("flush_dentry %p: %s\n", dentry,
+					strerror(-err));
+	}
+
+	if (dentry->chunk_tree.root) {
+		int ret = trim_dentry_tree(dentry);
+		if (!ret)
+			ret = flush_chunk_tree(&dentry->chunk_tree);
+		if (!ret && dentry->disk_index)
+			ret = flush_disk_index(dentry);
+		if (ret < 0) {
+			WARNING("flush_dentry %p: %s\n", dentry,
+					strerror(-ret));
+			return ret;
+		}
+		if (is_cnode_dirty(dentry->chunk_tree.root))
+			dentry->dirty = 1;
+	}
+	
+	if (dentry->dirty) {
+		dentry->ddent->size = htole64(dentry->size);
+		dentry->ddent->mode = htole16(dentry->mode);
+		dentry->ddent->mtime = htole32(dentry->mtime.tv_sec);
+		dentry->ddent->mtime_csec = dentry->mtime.tv_usec / 10000;
+		if (dentry->ddent_cnode)
+			mark_cnode_dirty(dentry->ddent_cnode);
+		dentry->dirty = 0;
+	}
+
+	return err;
+}
+
+int flush_dentry_chunks(struct dentry *dentry)
+{
+	int err;
+
+	assert(have_mutex(&dentry->mutex));
+
+	if (!dentry->chunk_tree.root)
+		return 0;
+
+	/*
+	 * Otherwise the dirty root counts against dirty_max until the
+	 * dentry is freed, and it can sit in the dcache for a long time.
+	 */
+	if (dentry->ddent->flags & DDENT_INLINE) {
+		if (!is_cnode_dirty(dentry->chunk_tree.root))
+			return 0;
+		lock(dentry->ddent_mutex);
+		err = flush_dentry(dentry);
+		unlock(dentry->ddent_mutex);
+		return err;
+	}
+
+	if (dentry->cdc) {
+		err = cdc_commit(dentry);
+		if (err < 0)
+			return err;
+	}
+
+	err = trim_dentry_tree(dentry);
+	if (err < 0)
+		return err;
+
+	if (dentry->disk_index) {
+		err = flush_chunk_tree(&dentry->chunk_tree);
+		if (err < 0)
+			return err;
+		return flush_disk_index(dentry);
+	}
+
+	return flush_chunk_tree(&dentry->chunk_tree);
+}
+
+/*
+ * Frees what init_dentry_tree() reads in, once it's been flushed.
+ */
+static void free_dentry_tree(struct dentry *dentry)
+{
+	cdc_free(dentry);
+	free(dentry->dir_index);
+	dentry->dir_index = NULL;
+
+	if (dentry->chunk_tree.root) {
+		assert(dentry->secret_chunk != NULL ||
+				(dentry->ddent->flags & DDENT_INLINE));
+		/* the tree's root digest may be in the index's header */
+		free_chunk_tree(&dentry->chunk_tree);
+		dentry->chunk_tree.root = NULL;
+		free_disk_index(dentry);
+	}
+	free(dentry->secret_chunk);
+	free(dentry->key);
+	dentry->secret_chunk = NULL;
+	dentry->key = NULL;
+}
+
+/*
+ * Only the dcache holds 'dentry'. Rather than keep its chunks, secret
+ * and key around until it's pruned, write it back to the parent, and
+ * read them in again if it's used.
+ */
+static void release_dentry(struct dentry *dentry)
+{
+	assert(have_mutex(dentry->ddent_mutex));
+	assert(dentry->ref_count == dentry->dcache_refs);
+
+	if (!flush_dentry(dentry))
+		free_dentry_tree(dentry);
+}
+
+static void free_dentry(struct dentry *dentry)
+{
+	assert(have_mutex(dentry->ddent_mutex));
+	assert(dentry->ref_count == 0);
+	assert(dentry->dcache_refs == 0);
+	assert(dentry->ddent != NULL);
+	assert(dentry->ddent_cnode != NULL);
+
+	assert(list_empty(&dentry->dcache_negs));
+
+	flush_dentry(dentry);
+	free_dentry_tree(dentry);
+
+	dentry_ptr(dentry) = NULL;
+
+	put_chunk_node(dentry->ddent_cnode);
+
+	free(dentry);
+}
+
+/*
+ * Call this only if you hold the parent's mutex _and_ ref count.
+ */
+void __put_dentry(struct dentry *dentry)
+{
+	struct dentry *parent;
+
+	assert(have_mutex(dentry->ddent_mutex));
+
+	if (!--dentry->ref_count) {
+		parent = dentry->parent;
+		free_dentry(dentry);
+		locked_dec(&parent->ref_count, parent->ddent_mutex);
+		assert(parent->ref_count != 0);
+	} else if (dentry->ref_count == dentry->dcache_refs)
+		release_dentry(dentry);
+}
+
+/*
+ * Moving a dentry to another directory changes its ddent_mutex,
+ * with the old one held, so look again once it's locked.
+ */
+static struct mutex *lock_ddent(struct dentry *dentry)
+{
+	struct mutex *mutex;
+
+	for (;;) {
+		mutex = dentry->ddent_mutex;
+		lock(mutex);
+		if (mutex == dentry->ddent_mutex)
+			return mutex;
+		unlock(mutex);
+	}
+}
+
+void put_dentry(struct dentry *dentry)
+{
+	struct dentry *parent;
+	struct mutex *mutex;
+
+	for (;;) {
+		mutex = lock_ddent(dentry);
+		if (--dentry->ref_count) {
+			if (dentry->ref_count == dentry->dcache_refs)
+				release_dentry(dentry);
+			unlock(mutex);
+			return;
+		}
+
+		parent = dentry->parent;
+		assert(parent != NULL);
+		assert(&parent->mutex == dentry->ddent_mutex);
+
+		free_dentry(dentry);
+		unlock(&parent->mutex);
+		dentry = parent;
+	}
+}
+
+/*
+ * Directory name index: maps name hashes to slots, so lookups don't
+ * have to go through every entry. It's an open-addressed table with
+ * linear probing, at most half full. Built on the first lookup in a
+ * directory of DIR_INDEX_MIN entries or more, and kept up to date
+ * until the directory's dentry is freed or released. If it can't be, it's dropped,
+ * and lookups go back to scanning.
+ */
+#define DIR_INDEX_MIN		32
+#define DIR_INDEX_EMPTY		(~0U)
+
+struct dir_index_entry {
+	uint32_t hash;
+	uint32_t slot;
+};
+
+struct dir_index {
+	unsigned mask;
+	unsigned count;
+	struct dir_index_entry table[];
+};
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name, unsigned len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len --) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static inline uint32_t ddent_name_hash(const struct disk_dentry *ddent)
+{
+	return name_hash((char *)ddent->name,
+			strnlen((char *)ddent->name, DDENT_NAME_MAX));
+}
+
+static inline unsigned dentry_slot(const struct dentry *dentry)
+{
+	return chunk_nr(dentry->ddent_cnode) * DIRENTS_PER_CHUNK +
+		dentry_index(dentry);
+}
+
+static struct dir_index *alloc_dir_index(unsigned size)
+{
+	struct dir_index *index;
+	unsigned i;
+
+	index = malloc(sizeof(struct dir_index) +
+			size * sizeof(struct dir_index_entry));
+	if (!index)
+		return NULL;
+
+	index->mask = size - 1;
+	index->count = 0;
+	for (i = 0; i < size; i ++)
+		index->table[i].slot = DIR_INDEX_EMPTY;
+
+	return index;
+}
+
+static void __dir_index_insert(struct dir_index *index, uint32_t hash,
+		unsigned slot)
+{
+	unsigned i = hash & index->mask;
+
+	while (index->table[i].slot != DIR_INDEX_EMPTY)
+		i = (i + 1) & index->mask;
+
+	index->table[i].hash = hash;
+	index->table[i].slot = slot;
+	index->count ++;
+}
+
+static struct dir_index_entry *dir_index_find(struct dir_index *index,
+		uint32_t hash, unsigned slot)
+{
+	unsigned i = hash & index->mask;
+
+	for (; index->table[i].slot != DIR_INDEX_EMPTY;
+			i = (i + 1) & index->mask) {
+		if (index->table[i].hash == hash &&
+				index->table[i].slot == slot)
+			return index->table + i;
+	}
+
+	return NULL;
+}
+
+static void drop_dir_index(struct dentry *dir)
+{
+	free(dir->dir_index);
+	dir->dir_index = NULL;
+}
+
+static void dir_index_add(struct dentry *dir, uint32_t hash, unsigned slot)
+{
+	struct dir_index *index = dir->dir_index;
+	struct dir_index *bigger;
+	unsigned i;
+
+	assert(have_mutex(&dir->mutex));
+
+	if (dir->disk_index) {
+		int err = disk_index_add(dir->disk_index, hash, slot);
+		if (err < 0)
+			drop_disk_index(dir, err);
+		return;
+	}
+
+	if (!index)
+		return;
+
+	if (2 * (index->count + 1) > index->mask + 1) {
+		bigger = alloc_dir_index(2 * (index->mask + 1));
+		if (!bigger) {
+			drop_dir_index(dir);
+			return;
+		}
+		for (i = 0; i <= index->mask; i ++) {
+			if (index->table[i].slot != DIR_INDEX_EMPTY)
+				__dir_index_insert(bigger,
+						index->table[i].hash,
+						index->table[i].slot);
+		}
+		free(index);
+		dir->dir_index = index = bigger;
+	}
+
+	__dir_index_insert(index, hash, slot);
+}
+
+/*
+ * Entries after the removed one are shifted back into the gap,
+ * unless that would put them before their home.
+ */
+static void dir_index_del(struct dentry *dir, uint32_t hash, unsigned slot)
+{
+	struct dir_index *index = dir->dir_index;
+	struct dir_index_entry *e;
+	unsigned i, j, home;
+
+	assert(have_mutex(&dir->mutex));
+
+	if (dir->disk_index) {
+		int err = disk_index_del(dir->disk_index, hash, slot);
+		if (err < 0)
+			drop_disk_index(dir, err);
+		return;
+	}
+
+	if (!index)
+		return;
+
+	e = dir_index_find(index, hash, slot);
+	assert(e != NULL);
+
+	i = j = e - index->table;
+	for (;;) {
+		j = (j + 1) & index->mask;
+		if (index->table[j].slot == DIR_INDEX_EMPTY)
+			break;
+		home = index->table[j].hash & index->mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		index->table[i] = index->table[j];
+		i = j;
+	}
+
+	index->table[i].slot = DIR_INDEX_EMPTY;
+	index->count --;
+}
+
+static void dir_index_swap(struct dentry *dir, uint32_t hash_a,
+		unsigned slot_a, uint32_t hash_b, unsigned slot_b)
+{
+	struct dir_index_entry *a, *b;
+
+	assert(have_mutex(&dir->mutex));
+
+	if (dir->disk_index) {
+		int err = disk_index_swap(dir->disk_index, hash_a, slot_a,
+				hash_b, slot_b);
+		if (err < 0)
+			drop_disk_index(dir, err);
+		return;
+	}
+
+	if (!dir->dir_index)
+		return;
+
+	a = dir_index_find(dir->dir_index, hash_a, slot_a);
+	b = dir_index_find(dir->dir_index, hash_b, slot_b);
+	assert(a != NULL && b != NULL);
+
+	a->slot = slot_b;
+	b->slot = slot_a;
+}
+
+/*
+ * Reads the names straight out of the directory's chunks,
+ * without setting up dentries for them.
+ */
+static int build_dir_index(struct dentry *dir)
+{
+	struct chunk_node *batch[CHUNK_BATCH_MAX];
+	struct chunk_node *cnode;
+	struct disk_dentry *ddent;
+	struct dir_index *index;
+	unsigned size, nr, chunk_nr, nr_chunks, count, i;
+	int err = 0;
+
+	assert(have_mutex(&dir->mutex));
 
-	chunk_nr = nr / DIRENTS_PER_CHUNK;
-	chunk_off = nr % DIRENTS_PER_CHUNK;
+	for (size = 2 * DIR_INDEX_MIN; size < 2 * dir->size; size *= 2)
+		;
+	index = alloc_dir_index(size);
+	if (!index)
+		return -ENOMEM;
+
+	nr_chunks = __dentry_chunk_count(dir);
+	for (chunk_nr = 0; chunk_nr < nr_chunks && !err; chunk_nr += count) {
+		count = nr_chunks - chunk_nr;
+		if (count > CHUNK_BATCH_MAX)
+			count = CHUNK_BATCH_MAX;
+
+		/*
+		 * Reads in the batch with the mutex dropped. The names
+		 * can't change meanwhile, as the caller holds ->rwlock.
+		 */
+		prefetch_dentry_chunks(dir, chunk_nr, count, batch);
+
+		for (i = 0; i < count; i ++) {
+			cnode = get_dentry_chunk(dir, chunk_nr + i);
+			if (IS_ERR(cnode)) {
+				err = -PTR_ERR(cnode);
+				break;
+			}
+			for (nr = (chunk_nr + i) * DIRENTS_PER_CHUNK;
+					nr < dir->size; nr ++) {
+				if (nr / DIRENTS_PER_CHUNK != chunk_nr + i)
+					break;
+				ddent = (struct disk_dentry *)cnode->chunk_data +
+					nr % DIRENTS_PER_CHUNK;
+				__dir_index_insert(index, ddent_name_hash(ddent),
+						nr);
+			}
+			put_chunk_node(cnode);
+		}
+
+		for (i = 0; i < count; i ++) {
+			if (batch[i])
+				put_chunk_node(batch[i]);
+		}
+	}
+
+	/* another lookup may have got there while the mutex was dropped */
+	if (err || dir->dir_index || dir->disk_index) {
+		free(index);
+		return err;
+	}
+
+	dir->dir_index = index;
+	return 0;
+}
+
+static struct dentry *indexed_lookup(struct dentry *parent, const char *name,
+		int len)
+{
+	struct dir_index *index = parent->dir_index;
+	uint32_t hash = name_hash(name, len);
+	struct dentry *dentry;
+	unsigned i;
+
+	for (i = hash & index->mask; index->table[i].slot != DIR_INDEX_EMPTY;
+			i = (i + 1) & index->mask) {
+		if (index->table[i].hash != hash)
+			continue;
+		dentry = get_nth_dentry(parent, index->table[i].slot);
+		if (IS_ERR(dentry))
+			return dentry;
+		if (!namcmp(dentry->ddent->name, name, len) &&
+				!dentry->ddent->name[len])
+			return dentry;
+		__put_dentry(dentry);
+	}
+
+	return NULL;
+}
+
+static struct dentry *disk_index_lookup(struct dentry *parent,
+		const char *name, int len)
+{
+	struct disk_index *dx = parent->disk_index;
+	uint32_t hash = name_hash(name, len);
+	struct dentry *dentry = NULL;
+	struct dir_bucket_entry *e;
+	struct chunk_node *cnode;
+	unsigned i, slot;
 
-	cnode = get_dentry_chunk(parent, chunk_nr);
+	cnode = get_nth_chunk(&dx->tree, hash_bucket(dx, hash));
 	if (IS_ERR(cnode))
 		return (void *)cnode;
 
-	if (!cnode->_private) {
-		cnode->_private = calloc(DIRENTS_PER_CHUNK,
-				sizeof(struct dentry *));
-		if (!cnode->_private)
-			return ERR_PTR(ENOMEM);
+	e = bucket_entries(cnode);
+	for (i = 0; i < BUCKET_ENTRIES && (slot = le32toh(e[i].slot)); i ++) {
+		if (le32toh(e[i].hash) != hash)
+			continue;
+		if (slot > parent->size) {
+			dentry = ERR_PTR(EIO);
+			break;
+		}
+		dentry = get_nth_dentry(parent, slot - 1);
+		if (IS_ERR(dentry))
+			break;
+		if (!namcmp(dentry->ddent->name, name, len) &&
+				!dentry->ddent->name[len])
+			break;
+		__put_dentry(dentry);
+		dentry = NULL;
 	}
 
-	dentry = children_of(cnode)[chunk_off];
-	if (dentry)
-		goto got_dentry;
+	put_chunk_node(cnode);
+	return dentry;
+}
 
-	ddent = (struct disk_dentry *)cnode->chunk_data + chunk_off;
-	if (nr == parent->size) {
-		err = init_disk_dentry(ddent);
+/*
+ * Directories that span DIR_UPGRADE_CHUNKS chunks get an index on
+ * disk, once their names have been read to build the one in memory,
+ * which is then no longer needed.
+ */
+#define DIR_UPGRADE_CHUNKS	4
+
+static void upgrade_dir(struct dentry *dir)
+{
+	struct dir_index *index = dir->dir_index;
+	struct dir_header header;
+	struct disk_index *dx;
+	unsigned i;
+	int err;
+
+	assert(have_mutex(&dir->mutex));
+
+	memset(&header, 0, sizeof(struct dir_header));
+	memcpy(header.ddents, dir->ddent->digest, CHUNK_DIGEST_LEN);
+	header.nr_buckets = htole32(buckets_for(dir->size));
+
+	dx = new_disk_index(dir, &header);
+	if (IS_ERR(dx)) {
+		WARNING("%s: no name index: %s\n", dir->ddent->name,
+				strerror(PTR_ERR(dx)));
+		return;
+	}
+	/* so the header gets written */
+	memset(&dx->written, 0, sizeof(struct dir_header));
+	dir->disk_index = dx;
+
+	for (i = 0; i <= index->mask; i ++) {
+		if (index->table[i].slot == DIR_INDEX_EMPTY)
+			continue;
+		err = disk_index_add(dx, index->table[i].hash,
+				index->table[i].slot);
 		if (err < 0) {
-			dentry = ERR_PTR(-err);
-			goto error;
+			WARNING("%s: no name index: %s\n", dir->ddent->name,
+					strerror(-err));
+			free_disk_index(dir);
+			return;
 		}
 	}
 
-	dentry = new_dentry(parent, ddent, cnode, &parent->mutex);
-	if (IS_ERR(dentry))
-		goto error;
+	lock(dir->ddent_mutex);
+	dir->ddent->flags |= DDENT_DIR_INDEX;
+	unlock(dir->ddent_mutex);
 
-got_dentry:
-	if (dentry->ref_count)
-		put_chunk_node(cnode);
-	dentry->ref_count ++;
-	return dentry;
-error:
-	put_chunk_node(cnode);
-	return dentry;
+	dir->chunk_tree.root->chunk_digest = dx->header.ddents;
+	dir->dirty = 1;
+	drop_dir_index(dir);
+}
+
+/*
+ * Dentry cache: remembers recent lookups by parent and name, so paths
+ * can be resolved without going through the directory again. Positive
+ * entries hold a reference to their dentry, which keeps it and its
+ * ddent's chunk in memory. Negative ones, for names that weren't
+ * there, hold one to the parent. These are counted in ->dcache_refs,
+ * and once they are all that's left, release_dentry() lets go of the
+ * dentry's chunks. Entries are dropped when their name
+ * is added, deleted or renamed, and the least recently used once
+ * there are more than dcache_max.
+ *
+ * dcache_mutex nests inside dentry mutexes. References that can't be
+ * put where an entry is dropped are put by prune_dcache() later on.
+ */
+#define DCACHE_BUCKETS		1024
+
+struct dcache_entry {
+	struct list_head hash_entry;
+	struct list_head lru_entry;
+	struct list_head neg_entry;	/* on parent->dcache_negs */
+	struct dentry *parent;
+	struct dentry *dentry;		/* NULL if negative */
+	uint32_t hash;
+	unsigned len;
+	char name[DDENT_NAME_MAX];
+};
+
+unsigned long dcache_max = DCACHE_MAX_DEFAULT;
+struct dcache_stats dcache_stats;
+
+static struct list_head dcache_table[DCACHE_BUCKETS];
+static LIST_HEAD(dcache_lru);
+static LIST_HEAD(dcache_dead);
+static unsigned long dcache_count;
+static DECLARE_MUTEX(dcache_mutex);
+
+static void __attribute__((constructor)) init_dcache(void)
+{
+	int i;
+
+	for (i = 0; i < DCACHE_BUCKETS; i ++)
+		list_head_init(&dcache_table[i]);
+}
+
+static inline struct list_head *dcache_bucket(const struct dentry *parent,
+		uint32_t hash)
+{
+	return &dcache_table[(hash ^ ((uintptr_t)parent >> 4)) %
+		DCACHE_BUCKETS];
+}
+
+static struct dcache_entry *dcache_find(const struct dentry *parent,
+		const char *name, unsigned len, uint32_t hash)
+{
+	struct dcache_entry *entry;
+
+	assert(have_mutex(&dcache_mutex));
+
+	list_for_each_entry(entry, dcache_bucket(parent, hash), hash_entry) {
+		if (entry->parent == parent && entry->hash == hash &&
+				entry->len == len &&
+				!memcmp(entry->name, name, len))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void dcache_unlink(struct dcache_entry *entry)
+{
+	assert(have_mutex(&dcache_mutex));
+
+	list_del(&entry->hash_entry);
+	list_del(&entry->lru_entry);
+	list_del(&entry->neg_entry);
+	dcache_count --;
 }
 
 /*
- * Dentry must be either about-to-be freed or have
- * it's mutex locked.
+ * Returns 1 and sets *pdentry if the name is in the cache,
+ * either to a new reference or to NULL.
  */
-static void flush_dentry(struct dentry *dentry)
+static int dcache_lookup(struct dentry *parent, const char *name,
+		unsigned len, struct dentry **pdentry)
 {
-	assert(have_mutex(dentry->ddent_mutex));
-	assert(have_mutex(&dentry->mutex) || dentry->ref_count == 0);
+	struct dcache_entry *entry;
 
-	if (dentry->chunk_tree.root) {
-		int err = flush_chunk_tree(&dentry->chunk_tree);
-		if (err < 0) {
-			WARNING("flush_dentry %p: %s\n", dentry,
-					strerror(-err));
-			return;
-		}
-		if (is_cnode_dirty(dentry->chunk_tree.root))
-			dentry->dirty = 1;
-	}
-	
-	if (dentry->dirty) {
-		dentry->ddent->size = htole64(dentry->size);
-		dentry->ddent->mode = htole16(dentry->mode);
-		dentry->ddent->mtime = htole32(dentry->mtime.tv_sec);
-		dentry->ddent->mtime_csec = dentry->mtime.tv_usec / 10000;
-		if (dentry->ddent_cnode)
-			mark_cnode_dirty(dentry->ddent_cnode);
-		dentry->dirty = 0;
+	assert(have_mutex(&parent->mutex));
+
+	if (!dcache_max)
+		return 0;
+
+	lock(&dcache_mutex);
+	entry = dcache_find(parent, name, len, name_hash(name, len));
+	if (!entry) {
+		dcache_stats.misses ++;
+		unlock(&dcache_mutex);
+		return 0;
 	}
+
+	list_move(&entry->lru_entry, &dcache_lru);
+	dcache_stats.hits ++;
+	if (!entry->dentry)
+		dcache_stats.negative_hits ++;
+	else
+		entry->dentry->ref_count ++;
+	*pdentry = entry->dentry;
+	unlock(&dcache_mutex);
+
+	return 1;
 }
 
-static void free_dentry(struct dentry *dentry)
+static void dcache_add(struct dentry *parent, const char *name, unsigned len,
+		struct dentry *dentry)
 {
-	assert(have_mutex(dentry->ddent_mutex));
-	assert(dentry->ref_count == 0);
-	assert(dentry->ddent != NULL);
-	assert(dentry->ddent_cnode != NULL);
+	struct dcache_entry *entry;
 
-	flush_dentry(dentry);
+	assert(have_mutex(&parent->mutex));
 
-	if (dentry->chunk_tree.root) {
-		assert(dentry->secret_chunk != NULL);
-		free(dentry->secret_chunk);
-		free_chunk_tree(&dentry->chunk_tree);
+	if (!dcache_max)
+		return;
+
+	entry = malloc(sizeof(struct dcache_entry));
+	if (!entry)
+		return;
+
+	entry->parent = parent;
+	entry->dentry = dentry;
+	entry->hash = name_hash(name, len);
+	entry->len = len;
+	memcpy(entry->name, name, len);
+
+	list_head_init(&entry->neg_entry);
+	if (dentry) {
+		assert(dentry->ddent_mutex == &parent->mutex);
+		dentry->ref_count ++;
+		dentry->dcache_refs ++;
+	} else {
+		lock(parent->ddent_mutex);
+		parent->ref_count ++;
+		parent->dcache_refs ++;
+		unlock(parent->ddent_mutex);
 	}
 
-	dentry_ptr(dentry) = NULL;
+	lock(&dcache_mutex);
+	/* another lookup can miss while the parent's mutex is dropped */
+	if (dcache_find(parent, name, len, entry->hash)) {
+		list_add(&entry->lru_entry, &dcache_dead);
+		unlock(&dcache_mutex);
+		return;
+	}
+	list_add(&entry->hash_entry, dcache_bucket(parent, entry->hash));
+	list_add(&entry->lru_entry, &dcache_lru);
+	if (!dentry)
+		list_add(&entry->neg_entry, &parent->dcache_negs);
+	dcache_count ++;
+	unlock(&dcache_mutex);
+}
 
-	put_chunk_node(dentry->ddent_cnode);
+/*
+ * Drops the entry for a name that is being added, deleted or renamed.
+ * If the caller holds a reference to the dentry, the entry's is put
+ * right away, so the dentry can be deleted.
+ */
+static void dcache_forget(struct dentry *parent, const char *name,
+		unsigned len)
+{
+	struct dcache_entry *entry;
 
-	free(dentry);
+	assert(have_mutex(&parent->mutex));
+
+	lock(&dcache_mutex);
+	entry = dcache_find(parent, name, len, name_hash(name, len));
+	if (entry) {
+		dcache_unlink(entry);
+		if (entry->dentry && entry->dentry->ref_count > 1) {
+			entry->dentry->ref_count --;
+			entry->dentry->dcache_refs --;
+			free(entry);
+		} else
+			list_add(&entry->lru_entry, &dcache_dead);
+	}
+	unlock(&dcache_mutex);
+}
+
+static inline void dcache_forget_dentry(struct dentry *dentry)
+{
+	dcache_forget(dentry->parent, (char *)dentry->ddent->name,
+			strnlen((char *)dentry->ddent->name, DDENT_NAME_MAX));
 }
 
 /*
- * Call this only if you hold the parent's mutex _and_ ref count.
+ * Drops the negative entries under a directory that's being deleted.
  */
-void __put_dentry(struct dentry *dentry)
+static void dcache_forget_dir(struct dentry *dir)
 {
-	struct dentry *parent;
+	struct dcache_entry *entry, *next;
 
-	assert(have_mutex(dentry->ddent_mutex));
+	assert(have_mutex(dir->ddent_mutex));
 
-	if (!--dentry->ref_count) {
-		parent = dentry->parent;
-		free_dentry(dentry);
-		locked_dec(&parent->ref_count, parent->ddent_mutex);
-		assert(parent->ref_count != 0);
+	lock(&dcache_mutex);
+	list_for_each_entry_safe(entry, next, &dir->dcache_negs, neg_entry) {
+		dcache_unlink(entry);
+		assert(dir->ref_count > 1);
+		dir->ref_count --;
+		dir->dcache_refs --;
+		free(entry);
 	}
+	unlock(&dcache_mutex);
 }
 
-void put_dentry(struct dentry *dentry)
+static void put_dcache_ref(struct dentry *dentry)
 {
-	struct dentry *parent;
+	struct mutex *mutex = lock_ddent(dentry);
 
-	for (;;) {
-		lock(dentry->ddent_mutex);
-		if (--dentry->ref_count) {
-			unlock(dentry->ddent_mutex);
-			return;
-		}
+	assert(dentry->dcache_refs != 0);
+	dentry->dcache_refs --;
+	unlock(mutex);
 
-		parent = dentry->parent;
-		assert(parent != NULL);
-		assert(&parent->mutex == dentry->ddent_mutex);
+	put_dentry(dentry);
+}
 
-		free_dentry(dentry);
-		unlock(&parent->mutex);
-		dentry = parent;
+void prune_dcache(unsigned long max)
+{
+	struct dcache_entry *entry;
+	struct list_head dead;
+
+	lock(&dcache_mutex);
+	while (dcache_count > max) {
+		entry = list_entry(dcache_lru.prev, struct dcache_entry,
+				lru_entry);
+		dcache_unlink(entry);
+		list_add(&entry->lru_entry, &dcache_dead);
+	}
+	list_head_init(&dead);
+	list_splice_init(&dcache_dead, &dead);
+	unlock(&dcache_mutex);
+
+	while (!list_empty(&dead)) {
+		entry = list_pop_entry(&dead, struct dcache_entry, lru_entry);
+		put_dcache_ref(entry->dentry ?: entry->parent);
+		free(entry);
 	}
 }
 
-static struct dentry *lookup(struct dentry *parent, const char *name, int len)
+void log_dcache_stats(void)
+{
+	unsigned long lookups = dcache_stats.hits + dcache_stats.misses;
+
+	TRACE("hits=%lu (%lu%%) negative=%lu misses=%lu\n",
+			dcache_stats.hits, lookups ?
+			dcache_stats.hits * 100 / lookups : 0,
+			dcache_stats.negative_hits, dcache_stats.misses);
+}
+
+static struct dentry *lookup_name(struct dentry *parent, const char *name,
+		int len)
 {
 	struct dentry *prev = NULL;
 	struct dentry *dentry;
 	unsigned nr;
 
-	assert(S_ISDIR(parent->mode));
-	assert(have_mutex(&parent->mutex));
-
-	if (len >= DDENT_NAME_MAX)
-		return ERR_PTR(ENAMETOOLONG);
-
-	if (!strncmp(name, ".", len)) {
-		locked_inc(&parent->ref_count, parent->ddent_mutex);
-		return parent;
+	if (parent->ddent->flags & DDENT_DIR_INDEX) {
+		int err = init_dentry_tree(parent);
+		if (err < 0)
+			return ERR_PTR(-err);
+	} else if (parent->size >= DIR_INDEX_MIN) {
+		if (!parent->dir_index)
+			build_dir_index(parent);
+		if (parent->dir_index && parent->size >=
+				DIR_UPGRADE_CHUNKS * DIRENTS_PER_CHUNK)
+			upgrade_dir(parent);
 	}
 
-	if (!strncmp(name, "..", len)) {
-		dentry = parent->parent ?: parent;
-		locked_inc(&dentry->ref_count, dentry->ddent_mutex);
-		return dentry;
-	}
+	if (parent->disk_index)
+		return disk_index_lookup(parent, name, len);
+	if (parent->dir_index)
+		return indexed_lookup(parent, name, len);
 
 	for (nr = 0; nr < parent->size; nr ++) {
 		dentry = get_nth_dentry(parent, nr);
@@ -416,6 +2284,37 @@ out:
 	return dentry;
 }
 
+static struct dentry *lookup(struct dentry *parent, const char *name, int len)
+{
+	struct dentry *dentry;
+
+	assert(S_ISDIR(parent->mode));
+	assert(have_mutex(&parent->mutex));
+
+	if (len >= DDENT_NAME_MAX)
+		return ERR_PTR(ENAMETOOLONG);
+
+	if (!strncmp(name, ".", len)) {
+		locked_inc(&parent->ref_count, parent->ddent_mutex);
+		return parent;
+	}
+
+	if (!strncmp(name, "..", len)) {
+		dentry = parent->parent ?: parent;
+		locked_inc(&dentry->ref_count, dentry->ddent_mutex);
+		return dentry;
+	}
+
+	if (dcache_lookup(parent, name, len, &dentry))
+		return dentry;
+
+	dentry = lookup_name(parent, name, len);
+	if (!IS_ERR(dentry))
+		dcache_add(parent, name, len, dentry);
+
+	return dentry;
+}
+
 struct dentry *__add_dentry(struct dentry *parent, const char *name,
 		mode_t mode, uint8_t flags)
 {
@@ -423,6 +2322,7 @@ struct dentry *__add_dentry(struct dentry *parent, const char *name,
 	unsigned name_len;
 	struct timeval now;
 
+	assert(have_write_lock(&parent->rwlock));
 	assert(have_mutex(&parent->mutex));
 
 	if (!name[0])
@@ -444,9 +2344,31 @@ struct dentry *__add_dentry(struct dentry *parent, const char *name,
 	if (IS_ERR(dentry))
 		return dentry;
 
+	if (!S_ISREG(mode))
+		flags &= ~(DDENT_INLINE | DDENT_CDC);
+	if (!S_ISDIR(mode))
+		flags &= ~DDENT_DIR_INDEX;
+	if ((flags & DDENT_CRYPTO_MASK) == DDENT_USE_XOR)
+		flags &= ~DDENT_SHORT_SECRET;
+	if (!(flags & DDENT_INLINE)) {
+		int err;
+
+		if (flags & DDENT_SHORT_SECRET) {
+			err = random_short_secret(dentry->ddent->secret_digest);
+			zero_chunk_digest(dentry->ddent->digest);
+		} else
+			err = init_disk_dentry(dentry->ddent);
+		if (err < 0) {
+			__put_dentry(dentry);
+			return ERR_PTR(-err);
+		}
+	}
+
 	gettimeofday(&now, NULL);
 
 	namcpy(dentry->ddent->name, name);
+	dir_index_add(parent, name_hash(name, name_len), parent->size);
+	dcache_forget(parent, name, name_len);
 
 	dentry->ddent->mode = htole16(mode);
 	dentry->ddent->size = htole64(0);
@@ -512,8 +2434,13 @@ static int make_last_dentry(struct dentry *dentry, struct dentry *parent)
 		struct dentry *tmp = get_nth_dentry(parent, parent->size - 1);
 		if (IS_ERR(tmp))
 			return -PTR_ERR(tmp);
-		if (tmp != dentry)
+		if (tmp != dentry) {
+			dir_index_swap(parent, ddent_name_hash(dentry->ddent),
+					dentry_slot(dentry),
+					ddent_name_hash(tmp->ddent),
+					parent->size - 1);
 			swap_dentries(dentry, tmp);
+		}
 		__put_dentry(tmp);
 	}
 
@@ -540,10 +2467,17 @@ int del_dentry(struct dentry *dentry)
 	struct dentry *parent = NULL;
 	int err;
 
-	lock(dentry->ddent_mutex);
+	/* so it isn't moved meanwhile */
+	lock(&dentry->mutex);
 	parent = dentry->parent;
+	write_lock(&parent->rwlock);
+	lock(&parent->mutex);
 	assert(parent->size >= 1);
 
+	dcache_forget_dentry(dentry);
+	if (S_ISDIR(dentry->mode))
+		dcache_forget_dir(dentry);
+
 	err = -EBUSY;
 	if (dentry->ref_count > 1)
 		goto out;
@@ -552,9 +2486,12 @@ int del_dentry(struct dentry *dentry)
 	if (err)
 		goto out;
 
+	dir_index_del(parent, ddent_name_hash(dentry->ddent), parent->size - 1);
 	__del_dentry(dentry, parent);
 out:
 	unlock(&parent->mutex);
+	write_unlock(&parent->rwlock);
+	unlock(&dentry->mutex);
 	return err;
 }
 
@@ -570,6 +2507,8 @@ struct dentry *find_dentry_parent(const char *path, struct dentry **pparent,
 	assert(pparent != NULL);
 	assert(name != NULL);
 
+	prune_dcache(dcache_max);
+
 	parent = NULL;
 	dentry = root_dentry;
 	locked_inc(&dentry->ref_count, dentry->ddent_mutex);
@@ -578,9 +2517,11 @@ struct dentry *find_dentry_parent(const char *path, struct dentry **pparent,
 		parent = dentry;
 		next = strchr(path, '/');
 		len = next ? next - path : strnlen(path, DDENT_NAME_MAX);
+		read_lock(&parent->rwlock);
 		lock(&parent->mutex);
 		dentry = lookup(parent, path, len);
 		unlock(&parent->mutex);
+		read_unlock(&parent->rwlock);
 		if (IS_ERR(dentry)) {
 			put_dentry(parent);
 			return dentry;
@@ -646,6 +2587,9 @@ void flush_root(void)
 {
 	assert(root_dentry != NULL);
 
+	/* cached dentries are only flushed once they're let go */
+	prune_dcache(0);
+
 	lock(&root_dentry->mutex);
 	lock(root_dentry->ddent_mutex);
 	flush_dentry(root_dentry);
@@ -668,9 +2612,11 @@ struct dentry *create_dentry(const char *path, mode_t mode)
 		return ERR_PTR(EEXIST);
 	}
 
+	write_lock(&parent->rwlock);
 	lock(&parent->mutex);
 	dentry = add_dentry(parent, name, mode);
 	unlock(&parent->mutex);
+	write_unlock(&parent->rwlock);
 	put_dentry(parent);
 	return dentry;
 }
@@ -683,57 +2629,27 @@ static struct dentry *lock_order(struct dentry *a, struct dentry *b)
 		if (c->parent == b)
 			return a;
 
-	for (c = b; b; b = b->parent)
-		if (b->parent == a)
+	for (c = b; c; c = c->parent)
+		if (c->parent == a)
 			return b;
 
 	return (b > a) ? a : b;
 }
 
-static int __rename_dentry(struct dentry *dentry, const char *new_name,
-		struct dentry *new_parent)
+/*
+ * Second half of a rename to another directory, with both
+ * directories' rwlocks held. 'first' is the one whose mutex
+ * is taken first.
+ */
+static int move_dentry(struct dentry *dentry, const char *new_name,
+		unsigned name_len, struct dentry *new_parent,
+		struct dentry *first)
 {
 	struct dentry *old_parent = dentry->parent;
 	struct dentry *shadow;
-	struct dentry *tmp;
 	int err;
 
-	if (strnlen(new_name, DDENT_NAME_MAX) == DDENT_NAME_MAX)
-		return -ENAMETOOLONG;
-	if (!dentry->parent)
-		return -EINVAL;
-
-	/*
-	 * Simple case: same directory.
-	 */
-	if (old_parent == new_parent) {
-		lock(dentry->ddent_mutex);
-		namcpy(dentry->ddent->name, new_name);
-		unlock(dentry->ddent_mutex);
-		return 0;
-	}
-
-	/*
-	 * Can't make a dentry be its own decendent.
-	 */
-	for (tmp = new_parent; tmp; tmp = tmp->parent)
-		if (tmp == dentry)
-			return -EINVAL;
-
-	/*
-	 * The hard part: moving from one directory to another.
-	 * Need to do two things: make it easy to delete dentry 
-	 * from old_parent, and allocate a new disk_dentry
-	 * in new_parent. The order of these two operations does
-	 * not matter, except that locking needs to be consitant
-	 * and non-recursive.
-	 *
-	 * If either one of these operations fails,
-	 * the FS is still consistant, and we can bail
-	 * out. But after that, it's do or die.
-	 */
-	tmp = lock_order(old_parent, new_parent);
-	if (tmp == new_parent) {
+	if (first == new_parent) {
 		lock(&new_parent->mutex);
 		shadow = get_nth_dentry(new_parent, new_parent->size);
 		if (IS_ERR(shadow)) {
@@ -749,8 +2665,14 @@ static int __rename_dentry(struct dentry *dentry, const char *new_name,
 			return err;
 		}
 
+		dcache_forget_dentry(dentry);
+		dcache_forget(new_parent, new_name, name_len);
+		dir_index_del(old_parent, ddent_name_hash(dentry->ddent),
+				old_parent->size - 1);
 		swap_dentries(shadow, dentry);
-		namcpy(dentry->ddent->name, new_name);
+		set_ddent_name(dentry->ddent, new_name);
+		dir_index_add(new_parent, name_hash(new_name, name_len),
+				new_parent->size);
 
 		__del_dentry(shadow, old_parent);
 		unlock(&old_parent->mutex);
@@ -778,8 +2700,14 @@ static int __rename_dentry(struct dentry *dentry, const char *new_name,
 			return -PTR_ERR(shadow);
 		}
 
+		dcache_forget_dentry(dentry);
+		dcache_forget(new_parent, new_name, name_len);
+		dir_index_del(old_parent, ddent_name_hash(dentry->ddent),
+				old_parent->size - 1);
 		swap_dentries(shadow, dentry);
-		namcpy(dentry->ddent->name, new_name);
+		set_ddent_name(dentry->ddent, new_name);
+		dir_index_add(new_parent, name_hash(new_name, name_len),
+				new_parent->size);
 
 		new_parent->size ++;
 		new_parent->dirty = 1;
@@ -793,6 +2721,79 @@ static int __rename_dentry(struct dentry *dentry, const char *new_name,
 	}
 }
 
+static int __rename_dentry(struct dentry *dentry, const char *new_name,
+		struct dentry *new_parent)
+{
+	struct dentry *old_parent = dentry->parent;
+	struct dentry *tmp;
+	unsigned name_len;
+	int err;
+
+	name_len = strnlen(new_name, DDENT_NAME_MAX);
+	if (name_len == DDENT_NAME_MAX)
+		return -ENAMETOOLONG;
+	if (!dentry->parent)
+		return -EINVAL;
+
+	if ((dentry->ddent->flags & DDENT_INLINE) &&
+			dentry->size > inline_room(name_len)) {
+		err = uninline_dentry(dentry);
+		if (err)
+			return err;
+	}
+
+	/*
+	 * Simple case: same directory.
+	 */
+	if (old_parent == new_parent) {
+		write_lock(&old_parent->rwlock);
+		lock(dentry->ddent_mutex);
+		dcache_forget_dentry(dentry);
+		dcache_forget(old_parent, new_name, name_len);
+		dir_index_del(old_parent, ddent_name_hash(dentry->ddent),
+				dentry_slot(dentry));
+		set_ddent_name(dentry->ddent, new_name);
+		dir_index_add(old_parent, name_hash(new_name, name_len),
+				dentry_slot(dentry));
+		unlock(dentry->ddent_mutex);
+		write_unlock(&old_parent->rwlock);
+		return 0;
+	}
+
+	/*
+	 * Can't make a dentry be its own decendent.
+	 */
+	for (tmp = new_parent; tmp; tmp = tmp->parent)
+		if (tmp == dentry)
+			return -EINVAL;
+
+	/*
+	 * The hard part: moving from one directory to another.
+	 * Need to do two things: make it easy to delete dentry 
+	 * from old_parent, and allocate a new disk_dentry
+	 * in new_parent. The order of these two operations does
+	 * not matter, except that locking needs to be consitant
+	 * and non-recursive.
+	 *
+	 * If either one of these operations fails,
+	 * the FS is still consistant, and we can bail
+	 * out. But after that, it's do or die.
+	 *
+	 * Mutexes go in lock_order(), rwlocks the other way round,
+	 * so parents' are taken first.
+	 */
+	tmp = lock_order(old_parent, new_parent);
+	write_lock(tmp == new_parent ? &old_parent->rwlock :
+			&new_parent->rwlock);
+	write_lock(&tmp->rwlock);
+	err = move_dentry(dentry, new_name, name_len, new_parent, tmp);
+	write_unlock(&tmp->rwlock);
+	write_unlock(tmp == new_parent ? &old_parent->rwlock :
+			&new_parent->rwlock);
+
+	return err;
+}
+
 int rename_dentry(struct dentry *dentry, const char *new_name,
 		struct dentry *new_parent)
 {
@@ -824,42 +2825,76 @@ void dentry_chmod(struct dentry *dentry, mode_t mode)
 int scan_dir(struct dentry *dentry, int (*func)(struct dentry *, void *),
 		void *scan_data)
 {
+	struct chunk_node *batch[CHUNK_BATCH_MAX];
+	unsigned batch_start = 0, batch_len = 0;
+	struct chunk_tree_cursor cursor;
+	struct chunk_node *cnode;
 	struct dentry *child;
-	struct dentry *last;
-	unsigned i;
+	unsigned i, chunk_nr, nr_chunks;
 	int err;
 
 	if (!S_ISDIR(dentry->mode))
 		return -ENOTDIR;
 
-	/*
-	 * Avoid constant build-up and tear-down of dir's chunk tree
-	 * by caching the previous child dentry.
-	 */
-	last = NULL;
-	err = 0;
-
+	read_lock(&dentry->rwlock);
 	lock(&dentry->mutex);
+	err = dentry->size ? init_dentry_cursor(dentry, &cursor, 0) : 0;
+	if (err || !dentry->size) {
+		unlock(&dentry->mutex);
+		read_unlock(&dentry->rwlock);
+		return err;
+	}
+
 	for (i = 0; i < dentry->size; i ++) {
-		child = get_nth_dentry(dentry, i);
+		/*
+		 * Pull in directory chunks a batch at a time, and keep
+		 * them pinned until the scan moves past them.
+		 */
+		chunk_nr = i / DIRENTS_PER_CHUNK;
+		if (chunk_nr >= batch_start + batch_len) {
+			while (batch_len)
+				put_chunk_node(batch[--batch_len]);
+			nr_chunks = __dentry_chunk_count(dentry);
+			batch_start = chunk_nr;
+			batch_len = nr_chunks - chunk_nr;
+			if (batch_len > CHUNK_BATCH_MAX)
+				batch_len = CHUNK_BATCH_MAX;
+			seek_chunk_cursor(&cursor, batch_start);
+			err = get_cursor_chunks(&cursor, batch_len, batch);
+			if (err) {
+				batch_len = 0;
+				goto out;
+			}
+		}
+
+		cnode = batch[chunk_nr - batch_start];
+		get_chunk_node(cnode);
+		child = __get_nth_dentry(dentry, cnode, i);
 		if (IS_ERR(child))
 			goto error;
 
+		/*
+		 * func() may lock 'child', or scan it, and rename and
+		 * delete take the child's mutex before the parent's
+		 * rwlock. 'child' is pinned, so let go of both. It can
+		 * be moved meanwhile, so it's put without them too.
+		 */
 		unlock(&dentry->mutex);
+		read_unlock(&dentry->rwlock);
 		err = func(child, scan_data);
+		put_dentry(child);
+		read_lock(&dentry->rwlock);
 		lock(&dentry->mutex);
 
 		if (err)
 			goto out;
-
-		if (last)
-			__put_dentry(last);
-		last = child;
 	}
 out:
-	if (last)
-		__put_dentry(last);
+	while (batch_len)
+		put_chunk_node(batch[--batch_len]);
+	release_chunk_cursor(&cursor);
 	unlock(&dentry->mutex);
+	read_unlock(&dentry->rwlock);
 	return err;
 error:
 	err = -PTR_ERR(child);
@@ -873,14 +2908,21 @@ int dup_disk_dentry(struct dentry *parent, const struct disk_dentry *src)
 	struct disk_dentry *dst;
 	struct dentry *dentry;
 
+	if ((src->flags & DDENT_INLINE) && (!S_ISREG(le16toh(src->mode)) ||
+			le64toh(src->size) > ddent_inline_room(src)))
+		return -EINVAL;
+
 	dentry = __add_dentry(parent, (char *)src->name, le16toh(src->mode),
 			src->flags);
 	if (IS_ERR(dentry))
 		return -PTR_ERR(dentry);
 
+	/* inline data is in the digests and after the name */
 	dst = dentry->ddent;
 	memcpy(dst->digest, src->digest, CHUNK_DIGEST_LEN);
 	memcpy(dst->secret_digest, src->secret_digest, CHUNK_DIGEST_LEN);
+	if (src->flags & DDENT_INLINE)
+		memcpy(dst->name, src->name, DDENT_NAME_MAX);
 
 	dentry->size = le64toh(src->size);
 	dentry->dirty = 1;
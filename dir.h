@@ -11,6 +11,11 @@
 
 #define DIR_AS_FILE	".super_secret_file"
 
+struct cdc_file;
+struct chunk_key;
+struct dir_index;
+struct disk_index;
+
 /* I'd like disk_dentry to fit into 256 bytes. */
 #define DDENT_NAME_MAX	(256 - 60)
 
@@ -26,22 +31,105 @@ struct disk_dentry {
 	uint8_t name[DDENT_NAME_MAX];            // .. 256
 } __attribute__((packed));
 
+/*
+ * The root ddent is kept in a file of its own, followed by settings
+ * that apply to the whole filesystem. New fields must treat 0 as the
+ * old behaviour, as older filesystems have them zero-filled.
+ */
+struct superblock {
+	struct disk_dentry root;
+	uint8_t digest_algo;                     // DIGEST_*
+	uint8_t chunk_shift;                     // log2(chunk size)
+} __attribute__((packed));
+
+static inline unsigned long superblock_chunk_size(const struct superblock *sb)
+{
+	return sb->chunk_shift ? 1UL << sb->chunk_shift : CHUNK_SIZE_DEFAULT;
+}
+
 /*
  * disk_dentry flags
  */
 #define DDENT_USE_XOR		0x0 /* use XOR (old default) */
 #define DDENT_USE_BLOWFISH	0x1 /* use Blowfish instead of XOR */
+#define DDENT_USE_AES_XTS	0x2 /* use AES-XTS, see chunk-crypt.c */
+#define DDENT_COMPRESS		0x4 /* compress chunks before encrypting */
+#define DDENT_INLINE		0x8 /* file data is in the ddent, see below */
+#define DDENT_DIR_INDEX		0x10 /* directory has a name index, see below */
+#define DDENT_SHORT_SECRET	0x20 /* no secret chunk, see below */
+#define DDENT_CDC		0x40 /* content-defined chunks, see cdc-file.c */
 
-#define DDENT_VALID_FLAGS	(DDENT_USE_XOR | DDENT_USE_BLOWFISH)
-#define DDENT_CRYPTO_MASK	(DDENT_USE_XOR | DDENT_USE_BLOWFISH)
+#define DDENT_VALID_FLAGS	(DDENT_USE_XOR | DDENT_USE_BLOWFISH | \
+				 DDENT_USE_AES_XTS | DDENT_COMPRESS | \
+				 DDENT_INLINE | DDENT_DIR_INDEX | \
+				 DDENT_SHORT_SECRET | DDENT_CDC)
+#define DDENT_CRYPTO_MASK	(DDENT_USE_XOR | DDENT_USE_BLOWFISH | \
+				 DDENT_USE_AES_XTS)
 
 #define DDENT_DEFAULT_FLAGS	DDENT_USE_BLOWFISH
 
+/*
+ * Flags given to new dentries. DDENT_DEFAULT_FLAGS, unless
+ * changed at mount time.
+ */
+extern uint8_t ddent_default_flags;
+
 COMPILER_ASSERT(sizeof(struct disk_dentry) == 256, sizeof_disk_dentry_is_256);
 
+/*
+ * Small regular files can be kept in their ddent, which saves having
+ * a secret chunk and a data chunk, and reading both on open. With
+ * DDENT_INLINE, the file's data takes the place of the two digests,
+ * and continues after the name's terminating NUL. Files that outgrow
+ * this get their chunks, and lose the flag for good.
+ */
+static inline unsigned inline_room(unsigned name_len)
+{
+	return 2 * CHUNK_DIGEST_LEN + DDENT_NAME_MAX - name_len - 1;
+}
+
+static inline unsigned ddent_inline_room(const struct disk_dentry *ddent)
+{
+	return inline_room(strnlen((char *)ddent->name, DDENT_NAME_MAX));
+}
+
+void get_inline_data(const struct disk_dentry *ddent, unsigned char *buf,
+		unsigned len);
+void set_inline_data(struct disk_dentry *ddent, const unsigned char *buf,
+		unsigned len);
+
 #define DIRENTS_PER_CHUNK	(CHUNK_SIZE / sizeof(struct disk_dentry))
 
-COMPILER_ASSERT(DIRENTS_PER_CHUNK > 0, DIRENTS_PER_CHUNK_NOT_ZERO);
+/*
+ * With DDENT_SHORT_SECRET, secret_digest holds the file's key itself,
+ * random bytes rather than the digest of a random chunk, so new files
+ * needn't write a secret chunk, nor opening them read one. The key is
+ * as safe as the digest was, as secret chunks are stored in the clear.
+ * Files start out as a hole, rather than with the secret's digest.
+ * Not for XOR, which needs a whole chunk of secret.
+ */
+
+/*
+ * Big directories get DDENT_DIR_INDEX, so a name can be found without
+ * reading all of them. Their digest then names a header, which has the
+ * roots of two trees: the usual one of disk_dentries, and one of hash
+ * buckets. Bucket (hash & (nr_buckets - 1)) lists the slots of the
+ * entries whose name has that hash, with free entries at the end.
+ * Hashes are FNV-1a of the name. The header is stored like a CDC
+ * extent, encrypted and padded with zeros.
+ */
+struct dir_header {
+	uint8_t ddents[CHUNK_DIGEST_LEN];
+	uint8_t buckets[CHUNK_DIGEST_LEN];
+	le32_t nr_buckets;                       /* a power of two */
+} __attribute__((packed));
+
+struct dir_bucket_entry {
+	le32_t hash;
+	le32_t slot;                             /* slot + 1, 0 if free */
+} __attribute__((packed));
+
+#define BUCKET_ENTRIES		(CHUNK_SIZE / sizeof(struct dir_bucket_entry))
 
 int init_disk_dentry(struct disk_dentry *ddent);
 
@@ -52,6 +140,15 @@ int init_disk_dentry(struct disk_dentry *ddent);
  * Locking is a bit tricky, as ddent and ddent_cnode
  * belong to the parent dentry. So set ddent_mutex
  * to be ->parent->mutex (in 99% of the cases.)
+ *
+ * ->rwlock guards the contents: a file's data, or a directory's
+ * names. Reads and lookups take it shared, writes and adding,
+ * deleting or renaming entries exclusively. It's taken before
+ * ->mutex, which guards the in-memory state and is only held
+ * briefly. With ->rwlock held, ->mutex can be dropped to read
+ * in chunks, so readers decrypt them in parallel. Parents'
+ * rwlocks are taken before their children's.
+ *
  * The locking rules are:
  * 	lock dentry before ddent_mutex
  * ->ddent->digest	ddent_mutex
@@ -62,7 +159,11 @@ int init_disk_dentry(struct disk_dentry *ddent);
  * ->ddent->name	ddent_mutex
  * ->ddent_cnode->dirty	ddent_mutex
  * ->ref_count 		ddent_mutex
+ * ->dcache_refs		ddent_mutex
  * ->chunk_tree		mutex
+ * ->cdc		mutex
+ * ->dir_index		mutex
+ * ->disk_index		mutex
  * ->dirty              mutex
  * ->size               mutex
  * ->mtime		mutex
@@ -72,10 +173,17 @@ struct dentry {
 	struct chunk_node *ddent_cnode;
 	struct mutex *ddent_mutex;
 	struct dentry *parent;
+	struct rwlock rwlock;
 	struct mutex mutex;
 	unsigned ref_count;
+	unsigned dcache_refs;	/* of ref_count, those the dcache holds */
 	struct chunk_tree chunk_tree;
-	unsigned char *secret_chunk;
+	unsigned char *secret_chunk;	/* or DDENT_SHORT_SECRET's key */
+	struct chunk_key *key;		/* from the secret, see chunk-crypt.h */
+	struct cdc_file *cdc;	/* DDENT_CDC files only */
+	struct dir_index *dir_index;	/* directories only, see dir.c */
+	struct disk_index *disk_index;	/* DDENT_DIR_INDEX only */
+	struct list_head dcache_negs;	/* see dir.c, dcache_mutex */
 	unsigned dirty:1;
 	/*
 	 * mirror some ddent values
@@ -95,11 +203,43 @@ struct dentry *__add_dentry(struct dentry *parent, const char *name,
 static inline struct dentry *add_dentry(struct dentry *parent, const char *name,
 		mode_t mode)
 {
-	return __add_dentry(parent, name, mode, DDENT_DEFAULT_FLAGS);
+	return __add_dentry(parent, name, mode, ddent_default_flags);
 }
 		
 int del_dentry(struct dentry *dentry);
 struct chunk_node *get_dentry_chunk(struct dentry *dentry, unsigned chunk_nr);
+int get_dentry_chunks(struct dentry *dentry, unsigned chunk_nr, unsigned count,
+		struct chunk_node **cnodes);
+int init_dentry_tree(struct dentry *dentry);
+int init_dentry_cursor(struct dentry *dentry, struct chunk_tree_cursor *cursor,
+		unsigned chunk_nr);
+/*
+ * Call before writing to 'dentry' up to offset 'end'.
+ */
+int prepare_dentry_write(struct dentry *dentry, uint64_t end);
+/*
+ * Writes out dirty chunks. Inline files are written back into their
+ * ddent instead, which leaves the parent's chunk dirty.
+ */
+int flush_dentry_chunks(struct dentry *dentry);
+/*
+ * Read-ahead: reads in those of chunks [chunk_nr, chunk_nr + count)
+ * that aren't in memory yet. cnodes[i] is set to the pinned chunk if it
+ * was read in, NULL otherwise.
+ */
+int prefetch_dentry_chunks(struct dentry *dentry, unsigned chunk_nr,
+		unsigned count, struct chunk_node **cnodes);
+
+/*
+ * For DDENT_CDC files, whose data is kept in extents of up to
+ * CHUNK_SIZE bytes. Extents that are all zeros get the zero digest,
+ * and aren't stored. 'chunk' must have room for CHUNK_SIZE bytes.
+ */
+int read_dentry_extent(const struct dentry *dentry, unsigned char *chunk,
+		unsigned len, const unsigned char *digest);
+int write_dentry_extents(const struct dentry *dentry,
+		const unsigned char **extents, const unsigned *lens,
+		unsigned char **digests, unsigned count);
 
 struct dentry *find_dentry_parent(const char *path, struct dentry **pparent,
 		const char **name);
@@ -116,6 +256,25 @@ void dentry_chmod(struct dentry *dentry, mode_t mode);
 int set_root(struct disk_dentry *ddent, struct mutex *ddent_mutex);
 void flush_root(void);
 
+/*
+ * Dentry cache: up to dcache_max recent lookups, including those of
+ * names that weren't there, are remembered (0 turns it off.)
+ * prune_dcache() lets go of all but 'max' of them.
+ */
+#define DCACHE_MAX_DEFAULT	8192
+
+struct dcache_stats {
+	unsigned long hits;
+	unsigned long negative_hits; /* ...of names that weren't there */
+	unsigned long misses;
+};
+
+extern unsigned long dcache_max;
+extern struct dcache_stats dcache_stats;
+
+void prune_dcache(unsigned long max);
+void log_dcache_stats(void);
+
 int scan_dir(struct dentry *dentry, int (*func)(struct dentry *, void *),
 		void *scan_data);
 
@@ -148,6 +148,7 @@ read_again3:
 			file_dentry(ofile)->chunk_tree.height);
 
 	err = close_file(ofile);
+	log_readahead_stats();
 	if (err < 0)
 		panic("close_file: %s\n", strerror(-err));
 
@@ -161,6 +162,543 @@ read_again3:
 			(unsigned long)delta.tv_usec);
 }
 
+static struct open_file *write_small(const char *name, const char *data,
+		int len)
+{
+	struct open_file *ofile;
+	int err, off;
+
+	ofile = open_file(name);
+	if (IS_ERR(ofile))
+		ofile = create_file(name, 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+
+	/* in pieces, so inline files grow across writes */
+	for (off = 0; off < len; off += err) {
+		err = write_file(ofile, data + off, len - off < 100 ?
+				len - off : 100, off);
+		if (err < 0)
+			panic("write_file: %s\n", strerror(-err));
+	}
+
+	return ofile;
+}
+
+static void check_small(const char *name, const char *data, int len,
+		bool inline_data)
+{
+	struct open_file *ofile;
+	unsigned long reads = chunkdb_stats.reads;
+	char buf[1024];
+	int err;
+
+	ofile = open_file(name);
+	if (IS_ERR(ofile))
+		panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+
+	err = read_file(ofile, buf, sizeof(buf), 0);
+	assert(err == len);
+	assert(!memcmp(buf, data, len));
+	assert(!!(file_dentry(ofile)->ddent->flags & DDENT_INLINE) ==
+			inline_data);
+	if (inline_data)
+		assert(chunkdb_stats.reads == reads);
+
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+}
+
+static void test_inline(void)
+{
+	struct open_file *ofile;
+	struct dentry *dentry;
+	char data[1000];
+	int i, err;
+
+	for (i = 0; i < sizeof(data); i ++)
+		data[i] = i * 7;
+
+	ddent_default_flags |= DDENT_INLINE;
+
+	ofile = write_small("tiny", data, 150);
+	close_file(ofile);
+	check_small("tiny", data, 150, true);
+
+	/* a longer name leaves less room, but 150 bytes still fit */
+	dentry = find_dentry("tiny", NULL);
+	assert(!IS_ERR(dentry));
+	err = rename_dentry(dentry, "a-somewhat-longer-name", dentry->parent);
+	assert(!err);
+	put_dentry(dentry);
+	check_small("a-somewhat-longer-name", data, 150, true);
+
+	/* ...but not once it's grown */
+	ofile = write_small("a-somewhat-longer-name", data, sizeof(data));
+	close_file(ofile);
+	check_small("a-somewhat-longer-name", data, sizeof(data), false);
+
+	ddent_default_flags &= ~DDENT_INLINE;
+	fprintf(stderr, "inline ok\n");
+}
+
+static void write_all(struct open_file *ofile, const char *data, int len,
+		off_t off)
+{
+	int n, err;
+
+	for (n = 0; n < len; n += err) {
+		err = write_file(ofile, data + n, len - n < 5000 ?
+				len - n : 5000, off + n);
+		if (err < 0)
+			panic("write_file: %s\n", strerror(-err));
+	}
+}
+
+static void check_all(struct open_file *ofile, const char *data, int len)
+{
+	static char buf[1 << 16];
+	int n, err;
+
+	assert(file_dentry(ofile)->size == len);
+	for (n = 0; n < len; n += err) {
+		err = read_file(ofile, buf, sizeof(buf), n);
+		if (err <= 0)
+			panic("read_file: %s\n", strerror(-err));
+		assert(!memcmp(buf, data + n, err));
+	}
+}
+
+#define CDC_FILE_SIZE	(4 << 20)
+
+static void test_cdc(void)
+{
+	static char v1[CDC_FILE_SIZE], v2[CDC_FILE_SIZE + 100];
+	unsigned char missing[CHUNK_DIGEST_LEN], *buf;
+	struct open_file *ofile;
+	unsigned long avoided;
+	int i, err;
+
+	for (i = 0; i < CDC_FILE_SIZE; i ++)
+		v1[i] = random();
+	memcpy(v2, v1, 5000);
+	memset(v2 + 5000, 'x', 100);
+	memcpy(v2 + 5100, v1 + 5000, CDC_FILE_SIZE - 5000);
+
+	ddent_default_flags |= DDENT_CDC;
+
+	ofile = create_file("cdc", 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+	write_all(ofile, v1, CDC_FILE_SIZE / 2, 0);
+	/* reads see buffered writes */
+	check_all(ofile, v1, CDC_FILE_SIZE / 2);
+	write_all(ofile, v1 + CDC_FILE_SIZE / 2, CDC_FILE_SIZE / 2,
+			CDC_FILE_SIZE / 2);
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	ofile = open_file("cdc");
+	if (IS_ERR(ofile))
+		panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+	check_all(ofile, v1, CDC_FILE_SIZE);
+
+	/* most extents past an insert are the same as before */
+	avoided = chunkdb_stats.write_bytes_avoided;
+	write_all(ofile, v2, sizeof(v2), 0);
+	err = flush_file(ofile);
+	if (err < 0)
+		panic("flush_file: %s\n", strerror(-err));
+	avoided = (chunkdb_stats.write_bytes_avoided - avoided) / CHUNK_SIZE;
+	fprintf(stderr, "cdc: %lu extents already stored after an insert\n",
+			avoided);
+	/* extents average over CHUNK_SIZE / 2, so that's over half */
+	assert(avoided >= CDC_FILE_SIZE / CHUNK_SIZE);
+	check_all(ofile, v2, sizeof(v2));
+
+	/* overwrite in the middle, and append */
+	memset(v2 + 1000000, 'y', 70000);
+	write_file(ofile, v2 + 1000000, 70000, 1000000);
+	check_all(ofile, v2, sizeof(v2));
+	write_all(ofile, v1, 100, sizeof(v2) - 100);
+	memcpy(v2 + sizeof(v2) - 100, v1, 100);
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	ofile = open_file("cdc");
+	if (IS_ERR(ofile))
+		panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+	check_all(ofile, v2, sizeof(v2));
+
+	/* a missing extent is an error, not whatever was in the buffer */
+	memset(missing, 0xab, CHUNK_DIGEST_LEN);
+	buf = malloc(CHUNK_SIZE);
+	assert(buf != NULL);
+	err = read_dentry_extent(file_dentry(ofile), buf, 1000, missing);
+	assert(err == -EIO);
+	free(buf);
+	close_file(ofile);
+
+	/* inline until it grows */
+	ddent_default_flags |= DDENT_INLINE;
+	ofile = write_small("cdc-small", v1, 150);
+	close_file(ofile);
+	check_small("cdc-small", v1, 150, true);
+	ofile = write_small("cdc-small", v1, 1000);
+	close_file(ofile);
+	check_small("cdc-small", v1, 1000, false);
+
+	ddent_default_flags &= ~(DDENT_CDC | DDENT_INLINE);
+	fprintf(stderr, "cdc ok\n");
+}
+
+/*
+ * AES-XTS files read back, with or without compression and
+ * content-defined chunks, and the same data in two places of
+ * a file doesn't make for the same chunk.
+ */
+static void test_aes(void)
+{
+	static const uint8_t flags[] = {
+		0, DDENT_COMPRESS, DDENT_CDC, DDENT_COMPRESS | DDENT_CDC
+	};
+	static char data[2 << 20];
+	struct open_file *ofile;
+	struct dentry *dentry;
+	unsigned char *digests;
+	uint8_t saved = ddent_default_flags;
+	char name[16];
+	int i, err;
+
+	/* compressible from the second chunk on, which repeats */
+	for (i = 0; i < 2 * CHUNK_SIZE; i ++)
+		data[i] = i < CHUNK_SIZE || (i & 0x3ff) < 0x200 ? random() : 0;
+	for (; i < sizeof(data); i ++)
+		data[i] = data[i - CHUNK_SIZE];
+
+	for (i = 0; i < sizeof(flags); i ++) {
+		ddent_default_flags = DDENT_USE_AES_XTS | flags[i];
+
+		sprintf(name, "aes-%d", i);
+		ofile = create_file(name, 0600 | S_IFREG);
+		if (IS_ERR(ofile))
+			panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+		write_all(ofile, data, sizeof(data), 0);
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+
+		ofile = open_file(name);
+		if (IS_ERR(ofile))
+			panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+		dentry = file_dentry(ofile);
+		assert((dentry->ddent->flags & DDENT_CRYPTO_MASK) ==
+				DDENT_USE_AES_XTS);
+		check_all(ofile, data, sizeof(data));
+		if (!(flags[i] & DDENT_CDC) && dentry->chunk_tree.height == 1) {
+			/* leaves 1 and 2 hold the same data */
+			digests = dentry->chunk_tree.root->chunk_data;
+			assert(memcmp(digests + CHUNK_DIGEST_LEN,
+					digests + 2 * CHUNK_DIGEST_LEN,
+					CHUNK_DIGEST_LEN));
+		}
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+	}
+
+	ddent_default_flags = saved;
+	fprintf(stderr, "aes ok\n");
+}
+
+/*
+ * DDENT_SHORT_SECRET files have no secret chunk to read on open.
+ */
+static void test_short_secret(void)
+{
+	static const uint8_t ciphers[] = {
+		DDENT_USE_BLOWFISH, DDENT_USE_AES_XTS
+	};
+	static char data[4000];
+	unsigned char secret_digest[CHUNK_DIGEST_LEN];
+	struct open_file *ofile;
+	struct dentry *dentry;
+	uint8_t saved = ddent_default_flags;
+	unsigned long reads;
+	char name[16];
+	int i, err;
+
+	for (i = 0; i < sizeof(data); i ++)
+		data[i] = random();
+
+	for (i = 0; i < sizeof(ciphers); i ++) {
+		ddent_default_flags = ciphers[i] | DDENT_SHORT_SECRET;
+
+		sprintf(name, "short-%d", i);
+		ofile = create_file(name, 0600 | S_IFREG);
+		if (IS_ERR(ofile))
+			panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+		assert(file_dentry(ofile)->ddent->flags & DDENT_SHORT_SECRET);
+		write_all(ofile, data, sizeof(data), 0);
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+
+		/* just the one data chunk */
+		reads = chunkdb_stats.reads;
+		ofile = open_file(name);
+		if (IS_ERR(ofile))
+			panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+		check_all(ofile, data, sizeof(data));
+		assert(chunkdb_stats.reads - reads == 1);
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+	}
+
+	/* XOR needs its secret chunk */
+	ddent_default_flags = DDENT_USE_XOR | DDENT_SHORT_SECRET;
+	ofile = create_file("short-xor", 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+	assert(!(file_dentry(ofile)->ddent->flags & DDENT_SHORT_SECRET));
+	write_all(ofile, data, sizeof(data), 0);
+	check_all(ofile, data, sizeof(data));
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	/* a missing secret chunk is an error, not a key made of garbage */
+	dentry = find_dentry("short-xor", NULL);
+	assert(!IS_ERR(dentry));
+	lock(dentry->ddent_mutex);
+	memcpy(secret_digest, dentry->ddent->secret_digest, CHUNK_DIGEST_LEN);
+	memset(dentry->ddent->secret_digest, 0xab, CHUNK_DIGEST_LEN);
+	unlock(dentry->ddent_mutex);
+
+	ofile = open_file("short-xor");
+	if (IS_ERR(ofile))
+		assert(PTR_ERR(ofile) == EIO);
+	else {
+		err = read_file(ofile, data, sizeof(data), 0);
+		assert(err == -EIO);
+		close_file(ofile);
+	}
+
+	lock(dentry->ddent_mutex);
+	memcpy(dentry->ddent->secret_digest, secret_digest, CHUNK_DIGEST_LEN);
+	unlock(dentry->ddent_mutex);
+	put_dentry(dentry);
+
+	ddent_default_flags = saved;
+	fprintf(stderr, "short secret ok\n");
+}
+
+/*
+ * Dirty data is written out in the background, and
+ * writers don't get past dirty_max.
+ */
+static void test_writeback(void)
+{
+	static char data[1 << 20];
+	struct open_file *ofile;
+	unsigned long base;
+	int i, err;
+
+	for (i = 0; i < sizeof(data); i ++)
+		data[i] = random();
+
+	ofile = create_file("writeback", 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+
+	base = nr_dirty_cnodes;
+	write_all(ofile, data, sizeof(data), 0);
+	assert(nr_dirty_cnodes > base);
+	for (i = 0; i < 100 && nr_dirty_cnodes > base; i ++)
+		usleep(writeback_interval * 1000 / 10);
+	fprintf(stderr, "writeback: %lu dirty chunks left after %ums\n",
+			nr_dirty_cnodes - base, i * writeback_interval / 10);
+	assert(nr_dirty_cnodes <= base);
+
+	dirty_max = 4 * CHUNK_SIZE;
+	for (i = 0; i < 8; i ++) {
+		write_all(ofile, data, sizeof(data), i * sizeof(data));
+		assert(nr_dirty_cnodes * CHUNK_SIZE <= dirty_max);
+	}
+	dirty_max = DIRTY_MAX_DEFAULT;
+
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	fprintf(stderr, "writeback ok\n");
+}
+
+#define NR_INLINE	40
+
+/*
+ * Rewritten inline files go back into their ddents on writeback,
+ * rather than staying dirty for as long as they are cached.
+ */
+static void test_inline_writeback(void)
+{
+	static char data[1 << 20];
+	struct open_file *ofile;
+	char name[32];
+	int i, err;
+
+	for (i = 0; i < sizeof(data); i ++)
+		data[i] = random();
+
+	ddent_default_flags |= DDENT_INLINE;
+	for (i = 0; i < NR_INLINE; i ++) {
+		sprintf(name, "inline-%d", i);
+		ofile = write_small(name, data, 100);
+		close_file(ofile);
+		/* it's in the dcache now */
+		ofile = write_small(name, data + i, 100);
+		close_file(ofile);
+	}
+	ddent_default_flags &= ~DDENT_INLINE;
+
+	ofile = create_file("inline-writeback", 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+
+	dirty_max = 8 * CHUNK_SIZE;
+	write_all(ofile, data, sizeof(data), 0);
+	assert(nr_dirty_cnodes * CHUNK_SIZE <= dirty_max);
+	dirty_max = DIRTY_MAX_DEFAULT;
+
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	for (i = 0; i < NR_INLINE; i ++) {
+		sprintf(name, "inline-%d", i);
+		check_small(name, data + i, 100, true);
+	}
+
+	fprintf(stderr, "inline writeback ok\n");
+}
+
+#define NR_CACHED	100
+
+/*
+ * Closed files stay in the dcache, but written back and
+ * without their chunks, secret or key.
+ */
+static void test_dcache_release(void)
+{
+	static char data[1 << 18];
+	struct open_file *ofile;
+	struct dentry *dentry;
+	char name[32];
+	int i, err;
+
+	for (i = 0; i < sizeof(data); i ++)
+		data[i] = random();
+
+	for (i = 0; i < NR_CACHED; i ++) {
+		sprintf(name, "cached-%d", i);
+		ofile = create_file(name, 0600 | S_IFREG);
+		if (IS_ERR(ofile))
+			panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+		write_all(ofile, data + i, sizeof(data) - i, 0);
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+	}
+
+	for (i = 0; i < NR_CACHED; i ++) {
+		sprintf(name, "cached-%d", i);
+		dentry = find_dentry(name, NULL);
+		if (IS_ERR(dentry))
+			panic("find_dentry: %s\n", strerror(PTR_ERR(dentry)));
+		assert(dentry->ref_count > dentry->dcache_refs);
+		assert(!dentry->chunk_tree.root);
+		assert(!dentry->secret_chunk && !dentry->key);
+		assert(le64toh(dentry->ddent->size) == sizeof(data) - i);
+		put_dentry(dentry);
+
+		/* and read back in when it's opened again */
+		ofile = open_file(name);
+		if (IS_ERR(ofile))
+			panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+		check_all(ofile, data + i, sizeof(data) - i);
+		err = close_file(ofile);
+		if (err < 0)
+			panic("close_file: %s\n", strerror(-err));
+	}
+
+	fprintf(stderr, "dcache release ok\n");
+}
+
+#define READERS		8
+
+static char shared_data[2 << 20];
+
+static void *reader(void *arg)
+{
+	struct open_file *ofile = arg;
+	char buf[8192];
+	int i, n, err;
+
+	for (i = 0; i < 64; i ++) {
+		n = (random() % (sizeof(shared_data) / sizeof(buf))) *
+			sizeof(buf);
+		err = read_file(ofile, buf, sizeof(buf), n);
+		if (err != sizeof(buf))
+			panic("read_file: %s\n", strerror(-err));
+		assert(!memcmp(buf, shared_data + n, sizeof(buf)));
+	}
+
+	return NULL;
+}
+
+/*
+ * Readers of one file don't wait on each other.
+ */
+static void test_parallel_read(void)
+{
+	pthread_t threads[READERS];
+	struct open_file *ofile;
+	int i, err;
+
+	for (i = 0; i < sizeof(shared_data); i ++)
+		shared_data[i] = random();
+
+	ofile = create_file("shared", 0600 | S_IFREG);
+	if (IS_ERR(ofile))
+		panic("create_file: %s\n", strerror(PTR_ERR(ofile)));
+	write_all(ofile, shared_data, sizeof(shared_data), 0);
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	ofile = open_file("shared");
+	if (IS_ERR(ofile))
+		panic("open_file: %s\n", strerror(PTR_ERR(ofile)));
+
+	for (i = 0; i < READERS; i ++) {
+		err = pthread_create(&threads[i], NULL, reader, ofile);
+		if (err)
+			panic("pthread_create: %s\n", strerror(err));
+	}
+	for (i = 0; i < READERS; i ++)
+		pthread_join(threads[i], NULL);
+
+	err = close_file(ofile);
+	if (err < 0)
+		panic("close_file: %s\n", strerror(-err));
+
+	fprintf(stderr, "parallel read ok\n");
+}
+
 int main(int argc, char **argv)
 {
 	struct disk_dentry root_ddent;
@@ -168,6 +706,9 @@ int main(int argc, char **argv)
 	char *errstr;
 	int i, err;
 
+	/* keep the writeback thread busy during all tests */
+	writeback_interval = 100;
+
 	err = set_logging("T,stdout");
 	if (err)
 		panic("set_logging: %s\n", strerror(-err));
@@ -191,6 +732,15 @@ int main(int argc, char **argv)
 	if (err)
 		panic("set_root: %s\n", strerror(-err));
 
+	test_inline();
+	test_cdc();
+	test_aes();
+	test_short_secret();
+	test_writeback();
+	test_inline_writeback();
+	test_dcache_release();
+	test_parallel_read();
+
 	for (i = 1; i < argc; i ++)
 		test_import(argv[i]);
 
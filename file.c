@@ -10,32 +10,103 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "zunkfs.h"
 #include "file.h"
 #include "dir.h"
+#include "cdc-file.h"
+#include "workqueue.h"
 
 #define MIN_FILE_CHUNK_CACHE_SIZE	16
+#define MAX_FILE_CHUNK_CACHE_SIZE	256
 
-#if CHUNK_SIZE > 4096
-#define FILE_CHUNK_CACHE_SIZE	(MIN_FILE_CHUNK_CACHE_SIZE * CHUNK_SIZE / 4096)
-#else
-#define FILE_CHUNK_CACHE_SIZE	MIN_FILE_CHUNK_CACHE_SIZE
-#endif
+/* 16 chunks per 4K of chunk size, up to 256 */
+#define FILE_CHUNK_CACHE_SIZE \
+	(chunk_shift < 16 ? \
+	 MIN_FILE_CHUNK_CACHE_SIZE << (chunk_shift - CHUNK_SHIFT_MIN) : \
+	 MAX_FILE_CHUNK_CACHE_SIZE)
 
 #define CACHED_CHUNK_MAGIC	((void *)0xf0f0f0f0)
 
+/*
+ * Read-ahead window, in chunks. It starts at RA_WINDOW_MIN once
+ * a file is read sequentially, and doubles with every sequential
+ * read after that.
+ */
+#define RA_WINDOW_MIN		4
+#define RA_WINDOW_MAX		64
+#define RA_THREADS		4
+
+/*
+ * Protected by the dentry's mutex, except for ->busy, which
+ * is protected by ->mutex.
+ */
+struct readahead {
+	struct work work;
+	off_t next_offset;	/* where a sequential read would start */
+	unsigned next;		/* first chunk not read yet */
+	unsigned end;		/* first chunk not prefetched yet */
+	unsigned window;	/* 0 unless reads are sequential */
+	struct chunk_node *cnodes[RA_WINDOW_MAX];
+	unsigned nrs[RA_WINDOW_MAX];
+	pthread_mutex_t mutex;
+	pthread_cond_t idle;
+	bool busy;
+};
+
 struct open_file {
 	struct dentry *dentry;
-	struct chunk_node *ccache[FILE_CHUNK_CACHE_SIZE];
+	struct chunk_node *ccache[MAX_FILE_CHUNK_CACHE_SIZE];
 	unsigned ccache_index;
+	struct chunk_tree_cursor cursor;
+	struct readahead ra;
+	struct list_head wb_entry;	/* writeback.mutex */
+	struct timespec dirtied;	/* when it joined writeback.dirty */
+};
+
+struct readahead_stats readahead_stats;
+
+/*
+ * Open files written to since they were last flushed sit on ->dirty,
+ * oldest first. ->busy is the file being flushed by the thread.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	struct list_head dirty;
+	struct open_file *busy;
+	unsigned long passes;
+	bool started;
+	bool kick;
+} writeback = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.dirty = LIST_HEAD_INIT(writeback.dirty),
 };
 
+unsigned writeback_interval = WRITEBACK_INTERVAL_DEFAULT;
+unsigned long dirty_max = DIRTY_MAX_DEFAULT;
+
+static DECLARE_WORKQUEUE(readahead_wq, RA_THREADS, RA_WINDOW_MAX);
+
 #define lock_file(of)  lock(&(of)->dentry->mutex)
 #define unlock_file(of)  unlock(&(of)->dentry->mutex)
 #define assert_file_locked(of) assert(have_mutex(&(of)->dentry->mutex))
 
+/*
+ * Content-defined chunks are handled in cdc-file.c. Until they outgrow
+ * their ddent, such files are inline, and handled like any other.
+ */
+static inline bool is_cdc(const struct open_file *ofile)
+{
+	return (ofile->dentry->ddent->flags & (DDENT_CDC | DDENT_INLINE)) ==
+		DDENT_CDC;
+}
+
 /*
  * Only regular files may cache their chunks. For other files,
  * it's possible that cnode->_private will already point
@@ -74,6 +145,9 @@ static struct open_file *open_file_dentry(struct dentry *dentry)
 		return ERR_PTR(ENOMEM);
 
 	ofile->dentry = dentry;
+	list_head_init(&ofile->wb_entry);
+	pthread_mutex_init(&ofile->ra.mutex, NULL);
+	pthread_cond_init(&ofile->ra.idle, NULL);
 	return ofile;
 }
 
@@ -130,18 +204,378 @@ static void release_cached_chunks(struct open_file *ofile)
 	}
 }
 
+/*
+ * Read-ahead. Once a file is read sequentially, a worker keeps
+ * ->window chunks past the reader in memory, pinned in ->cnodes until
+ * the reader gets to them.
+ */
+static void drop_prefetched(struct open_file *ofile, unsigned slot)
+{
+	struct readahead *ra = &ofile->ra;
+
+	assert_file_locked(ofile);
+
+	if (ra->cnodes[slot]) {
+		put_chunk_node(ra->cnodes[slot]);
+		ra->cnodes[slot] = NULL;
+		__sync_fetch_and_add(&readahead_stats.wasted, 1);
+	}
+}
+
+static void keep_prefetched(struct open_file *ofile, unsigned chunk_nr,
+		struct chunk_node *cnode)
+{
+	struct readahead *ra = &ofile->ra;
+	unsigned slot = chunk_nr % RA_WINDOW_MAX;
+
+	__sync_fetch_and_add(&readahead_stats.prefetched, 1);
+
+	/* the reader got there first */
+	if (chunk_nr < ra->next) {
+		put_chunk_node(cnode);
+		__sync_fetch_and_add(&readahead_stats.wasted, 1);
+		return;
+	}
+
+	drop_prefetched(ofile, slot);
+	ra->cnodes[slot] = cnode;
+	ra->nrs[slot] = chunk_nr;
+}
+
+static void readahead_work(struct work *work)
+{
+	struct open_file *ofile = container_of(work, struct open_file, ra.work);
+	struct readahead *ra = &ofile->ra;
+	struct dentry *dentry = ofile->dentry;
+	struct chunk_node *cnodes[CHUNK_BATCH_MAX];
+	unsigned start, end, nr, i;
+	int err;
+
+	lock(&dentry->mutex);
+	for (;;) {
+		start = ra->end > ra->next ? ra->end : ra->next;
+		end = (dentry->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		if (end > ra->next + ra->window)
+			end = ra->next + ra->window;
+		if (start >= end)
+			break;
+
+		nr = end - start;
+		if (nr > CHUNK_BATCH_MAX)
+			nr = CHUNK_BATCH_MAX;
+		ra->end = start + nr;
+
+		err = prefetch_dentry_chunks(dentry, start, nr, cnodes);
+		for (i = 0; i < nr; i ++) {
+			if (cnodes[i])
+				keep_prefetched(ofile, start + i, cnodes[i]);
+		}
+		if (err < 0) {
+			TRACE("%s: %s\n", dentry->ddent->name, strerror(-err));
+			ra->window = 0;
+			break;
+		}
+	}
+
+	/*
+	 * Done with ofile once busy is clear. The dentry can't go
+	 * away until close_file() gets its mutex.
+	 */
+	pthread_mutex_lock(&ra->mutex);
+	ra->busy = false;
+	pthread_cond_broadcast(&ra->idle);
+	pthread_mutex_unlock(&ra->mutex);
+	unlock(&dentry->mutex);
+}
+
+/*
+ * Called after reading 'len' bytes at 'offset'.
+ */
+static void readahead(struct open_file *ofile, off_t offset, int len)
+{
+	struct readahead *ra = &ofile->ra;
+	unsigned nr, slot;
+
+	assert_file_locked(ofile);
+
+	if (!cachable(ofile) || is_cdc(ofile) || len <= 0)
+		return;
+
+	for (nr = offset / CHUNK_SIZE; nr <= (offset + len - 1) / CHUNK_SIZE;
+			nr ++) {
+		slot = nr % RA_WINDOW_MAX;
+		if (ra->cnodes[slot] && ra->nrs[slot] == nr) {
+			put_chunk_node(ra->cnodes[slot]);
+			ra->cnodes[slot] = NULL;
+			__sync_fetch_and_add(&readahead_stats.hits, 1);
+		}
+	}
+
+	if (offset == ra->next_offset) {
+		ra->window = ra->window ? ra->window * 2 : RA_WINDOW_MIN;
+		if (ra->window > RA_WINDOW_MAX)
+			ra->window = RA_WINDOW_MAX;
+	} else if (ra->window) {
+		ra->window = 0;
+		ra->end = 0;
+		for (slot = 0; slot < RA_WINDOW_MAX; slot ++)
+			drop_prefetched(ofile, slot);
+	}
+
+	ra->next_offset = offset + len;
+	ra->next = ra->next_offset / CHUNK_SIZE;
+
+	if (!ra->window || ra->end >= ra->next + ra->window)
+		return;
+
+	/*
+	 * ->busy only changes under the dentry's mutex, which
+	 * is held here, so no need for ra->mutex to test it.
+	 */
+	if (ra->busy)
+		return;
+
+	pthread_mutex_lock(&ra->mutex);
+	ra->busy = true;
+	pthread_mutex_unlock(&ra->mutex);
+
+	init_work(&ra->work, readahead_work);
+	if (!queue_work(&readahead_wq, &ra->work)) {
+		pthread_mutex_lock(&ra->mutex);
+		ra->busy = false;
+		pthread_mutex_unlock(&ra->mutex);
+	}
+}
+
+/*
+ * Must be called without the dentry's mutex, as the
+ * worker needs it to finish.
+ */
+static void stop_readahead(struct open_file *ofile)
+{
+	struct readahead *ra = &ofile->ra;
+
+	lock_file(ofile);
+	ra->window = 0;
+	unlock_file(ofile);
+
+	pthread_mutex_lock(&ra->mutex);
+	while (ra->busy)
+		pthread_cond_wait(&ra->idle, &ra->mutex);
+	pthread_mutex_unlock(&ra->mutex);
+}
+
+void log_readahead_stats(void)
+{
+	unsigned long prefetched = readahead_stats.prefetched;
+
+	TRACE("prefetched=%lu hits=%lu (%lu%%) wasted=%lu\n", prefetched,
+			readahead_stats.hits, prefetched ?
+			readahead_stats.hits * 100 / prefetched : 0,
+			readahead_stats.wasted);
+}
+
+/*
+ * Writeback. A thread wakes up every writeback_interval ms, and flushes
+ * the open files that have been dirty for at least that long, so data
+ * doesn't wait for close_file() to be written out. Writers that push
+ * the dirty chunk nodes past dirty_max bytes are throttled: they flush
+ * their own file, and if that isn't enough, wait for the thread to
+ * flush everything else.
+ */
+static inline unsigned long dirty_bytes(void)
+{
+	return nr_dirty_cnodes * CHUNK_SIZE;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec ++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool timespec_before(const struct timespec *a,
+		const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Flushes files on writeback.dirty that were dirtied before 'older',
+ * or all of them if 'older' is NULL. Called with writeback.mutex held.
+ */
+static void writeback_files(const struct timespec *older)
+{
+	struct open_file *ofile;
+	int err;
+
+	while (!list_empty(&writeback.dirty)) {
+		ofile = list_entry(writeback.dirty.next, struct open_file,
+				wb_entry);
+		if (older && !timespec_before(&ofile->dirtied, older))
+			break;
+
+		list_del_init(&ofile->wb_entry);
+		writeback.busy = ofile;
+		pthread_mutex_unlock(&writeback.mutex);
+
+		/*
+		 * close_file() waits for ->busy to clear before letting
+		 * go of the file.
+		 */
+		lock_file(ofile);
+		err = flush_dentry_chunks(ofile->dentry);
+		unlock_file(ofile);
+		if (err < 0)
+			WARNING("writeback %s: %s\n", ofile->dentry->ddent->name,
+					strerror(-err));
+
+		pthread_mutex_lock(&writeback.mutex);
+		writeback.busy = NULL;
+		pthread_cond_broadcast(&writeback.done);
+	}
+}
+
+static void *writeback_thread(void *arg)
+{
+	struct timespec last, next;
+
+	pthread_mutex_lock(&writeback.mutex);
+	clock_gettime(CLOCK_REALTIME, &last);
+	for (;;) {
+		next = last;
+		timespec_add_ms(&next, writeback_interval);
+		while (!writeback.kick && pthread_cond_timedwait(&writeback.wake,
+					&writeback.mutex, &next) != ETIMEDOUT)
+			;
+
+		if (writeback.kick) {
+			writeback.kick = false;
+			writeback_files(NULL);
+		} else {
+			/* files dirtied before the last pass */
+			writeback_files(&last);
+			last = next;
+		}
+
+		writeback.passes ++;
+		pthread_cond_broadcast(&writeback.done);
+	}
+
+	return NULL;
+}
+
+/*
+ * The thread is started on first use, as fuse_main() daemonizes.
+ * Called with writeback.mutex held.
+ */
+static bool start_writeback(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (writeback.started)
+		return true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	err = pthread_create(&thread, &attr, writeback_thread, NULL);
+	if (err)
+		WARNING("writeback: pthread_create: %s\n", strerror(err));
+	else
+		writeback.started = true;
+
+	pthread_attr_destroy(&attr);
+	return writeback.started;
+}
+
+/*
+ * Called with the file locked, after writing to it.
+ */
+static void mark_file_dirty(struct open_file *ofile)
+{
+	assert_file_locked(ofile);
+
+	pthread_mutex_lock(&writeback.mutex);
+	if (list_empty(&ofile->wb_entry) && start_writeback()) {
+		clock_gettime(CLOCK_REALTIME, &ofile->dirtied);
+		list_add_tail(&ofile->wb_entry, &writeback.dirty);
+	}
+	pthread_mutex_unlock(&writeback.mutex);
+}
+
+/*
+ * Called without the file's lock, as the thread may need it.
+ */
+static void throttle_writer(struct open_file *ofile)
+{
+	unsigned long passes;
+	int err;
+
+	if (!dirty_max || dirty_bytes() <= dirty_max)
+		return;
+
+	lock_file(ofile);
+	err = flush_dentry_chunks(ofile->dentry);
+	unlock_file(ofile);
+	if (err < 0)
+		WARNING("writeback %s: %s\n", ofile->dentry->ddent->name,
+				strerror(-err));
+
+	if (dirty_bytes() <= dirty_max)
+		return;
+
+	pthread_mutex_lock(&writeback.mutex);
+	if (start_writeback()) {
+		passes = writeback.passes;
+		writeback.kick = true;
+		pthread_cond_signal(&writeback.wake);
+		while (writeback.passes == passes)
+			pthread_cond_wait(&writeback.done, &writeback.mutex);
+	}
+	pthread_mutex_unlock(&writeback.mutex);
+}
+
+/*
+ * Takes the file off writeback.dirty, waiting for the thread if it's
+ * busy with it. Must be called without the file's lock.
+ */
+static void stop_writeback(struct open_file *ofile)
+{
+	pthread_mutex_lock(&writeback.mutex);
+	list_del_init(&ofile->wb_entry);
+	while (writeback.busy == ofile)
+		pthread_cond_wait(&writeback.done, &writeback.mutex);
+	pthread_mutex_unlock(&writeback.mutex);
+}
+
 int close_file(struct open_file *ofile)
 {
 	unsigned retv = 0;
+	unsigned slot;
+
+	stop_readahead(ofile);
+	stop_writeback(ofile);
 
 	lock_file(ofile);
+	for (slot = 0; slot < RA_WINDOW_MAX; slot ++)
+		drop_prefetched(ofile, slot);
 	release_cached_chunks(ofile);
-	if (ofile->dentry->chunk_tree.root)
-		retv = flush_chunk_tree(&ofile->dentry->chunk_tree);
+	release_chunk_cursor(&ofile->cursor);
+	retv = flush_dentry_chunks(ofile->dentry);
 	unlock_file(ofile);
 
 	put_dentry(ofile->dentry);
 
+	pthread_mutex_destroy(&ofile->ra.mutex);
+	pthread_cond_destroy(&ofile->ra.idle);
 	memset(ofile, 0xcc, sizeof(struct open_file));
 	free(ofile);
 
@@ -154,8 +588,12 @@ int flush_file(struct open_file *ofile)
 
 	lock_file(ofile);
 	release_cached_chunks(ofile);
-	if (ofile->dentry->chunk_tree.root)
-		retv = flush_chunk_tree(&ofile->dentry->chunk_tree);
+	retv = flush_dentry_chunks(ofile->dentry);
+	if (!retv) {
+		pthread_mutex_lock(&writeback.mutex);
+		list_del_init(&ofile->wb_entry);
+		pthread_mutex_unlock(&writeback.mutex);
+	}
 	unlock_file(ofile);
 
 	return retv;
@@ -187,14 +625,96 @@ static inline void cache_file_chunk(struct open_file *ofile,
 		put_chunk_node(cnode);
 }
 
-static int rw_file(struct open_file *ofile, char *buf, size_t bufsz,
-		off_t offset, int read)
+static int rw_chunks(struct open_file *ofile, char *buf, size_t bufsz,
+		off_t offset, uint64_t file_size, int read)
 {
+	struct chunk_node *prefetched[CHUNK_BATCH_MAX];
+	struct chunk_node *cnodes[CHUNK_BATCH_MAX];
 	struct chunk_node *cnode;
 	unsigned chunk_nr;
 	unsigned chunk_off;
+	unsigned i, nr;
+	int len, cplen, err;
+
+	chunk_nr = offset / CHUNK_SIZE;
+	chunk_off = offset % CHUNK_SIZE;
+
+	/*
+	 * The cursor stays put between calls, so sequential
+	 * access doesn't walk the tree for every chunk.
+	 */
+	if (!ofile->cursor.ctree) {
+		err = init_dentry_cursor(ofile->dentry, &ofile->cursor,
+				chunk_nr);
+		if (err < 0)
+			return err;
+	} else
+		seek_chunk_cursor(&ofile->cursor, chunk_nr);
+
+	len = 0;
+	while (len < bufsz) {
+		/*
+		 * Grab as many of the chunks spanned by the rest of
+		 * the request as possible in one go.
+		 */
+		nr = (chunk_off + bufsz - len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		if (nr > CHUNK_BATCH_MAX)
+			nr = CHUNK_BATCH_MAX;
+
+		/*
+		 * Readers hold the dentry's rwlock, so can read in and
+		 * decrypt what's missing with its mutex dropped, side
+		 * by side. Another reader may move the cursor meanwhile.
+		 */
+		if (read) {
+			err = prefetch_dentry_chunks(ofile->dentry, chunk_nr,
+					nr, prefetched);
+			if (err < 0)
+				return err;
+			seek_chunk_cursor(&ofile->cursor, chunk_nr);
+		}
+
+		err = get_cursor_chunks(&ofile->cursor, nr, cnodes);
+		for (i = 0; read && i < nr; i ++) {
+			if (prefetched[i])
+				put_chunk_node(prefetched[i]);
+		}
+		if (err < 0)
+			return err;
+
+		for (i = 0; i < nr; i ++) {
+			cnode = cnodes[i];
+
+			cplen = bufsz - len;
+			if (cplen > CHUNK_SIZE - chunk_off)
+				cplen = CHUNK_SIZE - chunk_off;
+			if (read) {
+				if (cplen > file_size - len)
+					cplen = file_size - len;
+				memcpy(buf + len, cnode->chunk_data + chunk_off,
+						cplen);
+			} else {
+				memcpy(cnode->chunk_data + chunk_off, buf + len,
+						cplen);
+				mark_cnode_dirty(cnode);
+			}
+			len += cplen;
+
+			cache_file_chunk(ofile, cnode);
+
+			chunk_nr ++;
+			chunk_off = 0;
+		}
+	}
+
+	return len;
+}
+
+static int rw_file(struct open_file *ofile, char *buf, size_t bufsz,
+		off_t offset, int read)
+{
 	uint64_t file_size;
-	int len, cplen;
+	int len, err;
 
 	file_size = ofile->dentry->size;
 	if (S_ISDIR(ofile->dentry->mode))
@@ -209,34 +729,19 @@ static int rw_file(struct open_file *ofile, char *buf, size_t bufsz,
 	if (read && (bufsz + offset) > file_size)
 		bufsz = file_size - offset;
 
-	chunk_nr = offset / CHUNK_SIZE;
-	chunk_off = offset % CHUNK_SIZE;
-
-	len = 0;
-	while (len < bufsz) {
-		cnode = get_dentry_chunk(ofile->dentry, chunk_nr);
-		if (IS_ERR(cnode))
-			return PTR_ERR(cnode);
-
-		cplen = bufsz - len;
-		if (cplen > CHUNK_SIZE - chunk_off)
-			cplen = CHUNK_SIZE - chunk_off;
-		if (read) {
-			if (cplen > file_size - len)
-				cplen = file_size - len;
-			memcpy(buf + len, cnode->chunk_data + chunk_off, cplen);
-		} else {
-			memcpy(cnode->chunk_data + chunk_off, buf + len, cplen);
-			mark_cnode_dirty(cnode);
-		}
-		len += cplen;
-
-		cache_file_chunk(ofile, cnode);
-
-		chunk_nr ++;
-		chunk_off = 0;
+	if (!read) {
+		err = prepare_dentry_write(ofile->dentry, offset + bufsz);
+		if (err < 0)
+			return err;
 	}
 
+	if (is_cdc(ofile))
+		len = cdc_rw(ofile->dentry, buf, bufsz, offset, read);
+	else
+		len = rw_chunks(ofile, buf, bufsz, offset, file_size, read);
+	if (len < 0)
+		return len;
+
 	if (!read) {
 		assert(!S_ISDIR(ofile->dentry->mode));
 		if ((len + offset) > file_size)
@@ -290,9 +795,12 @@ int read_file(struct open_file *ofile, char *buf, size_t bufsz, off_t offset)
 {
 	int len;
 
+	read_lock(&ofile->dentry->rwlock);
 	lock_file(ofile);
 	len = rw_file(ofile, buf, bufsz, offset, 1);
+	readahead(ofile, offset, len);
 	unlock_file(ofile);
+	read_unlock(&ofile->dentry->rwlock);
 
 	return len;
 }
@@ -301,12 +809,19 @@ int write_file(struct open_file *ofile, const char *buf, size_t len, off_t off)
 {
 	int retv;
 
+	write_lock(&ofile->dentry->rwlock);
 	lock_file(ofile);
 	if (S_ISDIR(ofile->dentry->mode))
 		retv = write_dir(ofile, buf, len, off);
 	else
 		retv = rw_file(ofile, (char *)buf, len, off, 0);
+	if (retv > 0)
+		mark_file_dirty(ofile);
 	unlock_file(ofile);
+	write_unlock(&ofile->dentry->rwlock);
+
+	if (retv > 0)
+		throttle_writer(ofile);
 
 	return retv;
 }
@@ -16,5 +16,26 @@ int write_file(struct open_file *ofile, const char *buf, size_t len, off_t off);
 
 struct dentry *file_dentry(struct open_file *ofile);
 
+struct readahead_stats {
+	unsigned long prefetched; /* chunks read ahead */
+	unsigned long hits;       /* ...that were then read */
+	unsigned long wasted;     /* ...that were dropped unread */
+};
+
+extern struct readahead_stats readahead_stats;
+
+/*
+ * Writeback: open files dirty for writeback_interval ms are flushed
+ * in the background, and writers are throttled once dirty chunks take
+ * up more than dirty_max bytes (0 for no limit.)
+ */
+#define WRITEBACK_INTERVAL_DEFAULT	5000
+#define DIRTY_MAX_DEFAULT		(256UL << 20)
+
+extern unsigned writeback_interval;
+extern unsigned long dirty_max;
+
+void log_readahead_stats(void);
+
 #endif
 
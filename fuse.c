@@ -28,6 +28,8 @@
 #include "utils.h"
 #include "dir.h"
 #include "file.h"
+#include "pool.h"
+#include "chunk-crypt.h"
 
 #ifndef BLOCK_SIZE
 #define BLOCK_SIZE 512
@@ -421,11 +423,18 @@ static struct fuse_operations zunkfs_operations = {
 	.chmod		= zunkfs_chmod
 };
 
-static void set_root_file(const char *fs_descr)
+static int digest_algo = -1;
+static unsigned long chunk_size;
+static const char **chunkdb_specs;
+static unsigned nr_chunkdb_specs;
+
+/*
+ * The superblock says how chunks are named and sized, and
+ * both must be set before any chunk-db is opened or used.
+ */
+static struct superblock *open_superblock(const char *fs_descr)
 {
-	static DECLARE_MUTEX(root_mutex);
-	struct disk_dentry *root_ddent;
-	struct timeval now;
+	struct superblock *sb;
 	int err, fd;
 
 	fd = open(fs_descr, O_RDWR|O_CREAT, 0600);
@@ -434,13 +443,48 @@ static void set_root_file(const char *fs_descr)
 		exit(-1);
 	}
 
-	root_ddent = mmap(NULL, 4096, PROT_READ|PROT_WRITE,
-			MAP_SHARED, fd, 0);
-	if (root_ddent == MAP_FAILED) {
+	sb = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sb == MAP_FAILED) {
 		ERROR("mmap(%s): %s\n", fs_descr, strerror(errno));
 		exit(-2);
 	}
 
+	if (sb->root.name[0] == '\0') {
+		if (digest_algo >= 0)
+			sb->digest_algo = digest_algo;
+		sb->chunk_shift = __builtin_ctzl(chunk_size ?: CHUNK_SIZE_DEFAULT);
+	} else if (digest_algo >= 0 && digest_algo != sb->digest_algo) {
+		ERROR("%s uses %s digests.\n", fs_descr,
+				digest_algo_name(sb->digest_algo));
+		exit(-6);
+	} else if (chunk_size && chunk_size != superblock_chunk_size(sb)) {
+		ERROR("%s uses %lu byte chunks.\n", fs_descr,
+				superblock_chunk_size(sb));
+		exit(-6);
+	}
+
+	err = set_digest_algo(sb->digest_algo);
+	if (err) {
+		ERROR("Unknown digest algorithm %u\n", sb->digest_algo);
+		exit(-6);
+	}
+
+	err = set_chunk_size(superblock_chunk_size(sb));
+	if (err) {
+		ERROR("Bad chunk size %lu\n", superblock_chunk_size(sb));
+		exit(-6);
+	}
+
+	return sb;
+}
+
+static void set_root_file(struct superblock *sb)
+{
+	static DECLARE_MUTEX(root_mutex);
+	struct disk_dentry *root_ddent = &sb->root;
+	struct timeval now;
+	int err;
+
 	if (root_ddent->name[0] == '\0') {
 		namcpy(root_ddent->name, "/");
 
@@ -460,6 +504,8 @@ static void set_root_file(const char *fs_descr)
 
 		memcpy(root_ddent->digest, root_ddent->secret_digest,
 				CHUNK_DIGEST_LEN);
+
+		root_ddent->flags |= ddent_default_flags & DDENT_COMPRESS;
 	} else if (root_ddent->name[0] != '/' || root_ddent->name[1]) {
 		ERROR("Bad superblock.\n");
 		exit(-4);
@@ -475,7 +521,19 @@ static void set_root_file(const char *fs_descr)
 enum {
 	OPT_HELP,
 	OPT_LOG,
-	OPT_CHUNK_DB
+	OPT_CHUNK_DB,
+	OPT_COMPRESS,
+	OPT_INLINE,
+	OPT_CDC,
+	OPT_CIPHER,
+	OPT_SHORT_SECRET,
+	OPT_DIGEST,
+	OPT_CHUNK_SIZE,
+	OPT_POOL_MAX,
+	OPT_HUGEPAGES,
+	OPT_DIRTY_MAX,
+	OPT_WRITEBACK,
+	OPT_DCACHE
 };
 
 static struct fuse_opt zunkfs_opts[] = {
@@ -483,10 +541,23 @@ static struct fuse_opt zunkfs_opts[] = {
 	FUSE_OPT_KEY("-h", OPT_HELP),
 	FUSE_OPT_KEY("--log=%s", OPT_LOG),
 	FUSE_OPT_KEY("--chunk-db=%s", OPT_CHUNK_DB),
+	FUSE_OPT_KEY("--compress", OPT_COMPRESS),
+	FUSE_OPT_KEY("--inline", OPT_INLINE),
+	FUSE_OPT_KEY("--cdc", OPT_CDC),
+	FUSE_OPT_KEY("--cipher=%s", OPT_CIPHER),
+	FUSE_OPT_KEY("--short-secret", OPT_SHORT_SECRET),
+	FUSE_OPT_KEY("--digest=%s", OPT_DIGEST),
+	FUSE_OPT_KEY("--chunk-size=%s", OPT_CHUNK_SIZE),
+	FUSE_OPT_KEY("--pool-max=%s", OPT_POOL_MAX),
+	FUSE_OPT_KEY("--hugepages", OPT_HUGEPAGES),
+	FUSE_OPT_KEY("--dirty-max=%s", OPT_DIRTY_MAX),
+	FUSE_OPT_KEY("--writeback=%s", OPT_WRITEBACK),
+	FUSE_OPT_KEY("--dcache=%s", OPT_DCACHE),
 	FUSE_OPT_END
 };
 
 static const char *prog = NULL;
+static const char *root_file = NULL;
 
 static void usage(void)
 {
@@ -503,9 +574,39 @@ static void usage(void)
 "                            the db is marked as write-through (wt). A read\n"
 "                            satisfied by chunkdb N will be cached by chunkdbs\n"
 "                            1...N-1 that are not marked as non-cachable (nc).\n"
+"                            Neighbouring dbs marked race[=<msecs>] are read\n"
+"                            in parallel, each starting <msecs> after the\n"
+"                            first.\n"
+"                            bloom[=<n>] keeps a filter of the chunks in the\n"
+"                            db, and neg=<secs> remembers misses for <secs>.\n"
 "                            Examples: \n"
 "                               --chunk-db=ro,dir:/foo\n"
 "                               --chunk-db=rw,wt,nc,mem=1000\n"
+"   --compress               Compress new files and directories before\n"
+"                            encrypting them.\n"
+"   --inline                 Keep new small files in their directory entry,\n"
+"                            instead of in chunks of their own.\n"
+"   --cdc                    Cut new files into chunks where their content\n"
+"                            says, so inserts don't change later chunks.\n"
+"   --cipher=<blowfish|aes>  Cipher for new files and directories. Defaults\n"
+"                            to blowfish. aes is AES-XTS, which is much\n"
+"                            faster, but older zunkfs can't read it.\n"
+"   --short-secret           Keep the keys of new files and directories in\n"
+"                            their directory entry, rather than in a secret\n"
+"                            chunk, so creating and opening them takes no\n"
+"                            extra chunk I/O. Older zunkfs can't read them.\n"
+"   --digest=<sha1|blake3>   Chunk digest for a new filesystem. Defaults\n"
+"                            to sha1. Existing filesystems keep theirs.\n"
+"   --chunk-size=<bytes>     Chunk size for a new filesystem. A power of two\n"
+"                            from 4096 to 1048576. Defaults to 65536.\n"
+"   --pool-max=<MB>          Limit memory used for chunk nodes.\n"
+"   --hugepages              Back chunk nodes with huge pages.\n"
+"   --dirty-max=<MB>         Throttle writers once this much data is waiting\n"
+"                            to be written. Defaults to 256, 0 for no limit.\n"
+"   --writeback=<msecs>      Write out files that have been dirty this long\n"
+"                            in the background. Defaults to 5000.\n"
+"   --dcache=<entries>       Remember this many path lookups, including\n"
+"                            failed ones. Defaults to 8192, 0 for none.\n"
 "\n"
 "Available chunk databases:\n", prog);
 	help_chunkdb();
@@ -515,9 +616,8 @@ static void usage(void)
 static int opt_proc(void *data, const char *arg, int key,
 		struct fuse_args *args)
 {
-	static unsigned root_set = 0;
 	char *errstr;
-	int err;
+	int cipher, err;
 
 	switch(key) {
 	case OPT_HELP:
@@ -534,19 +634,88 @@ static int opt_proc(void *data, const char *arg, int key,
 		}
 		return 0;
 	case OPT_CHUNK_DB:
-		arg += 11;
-		errstr = add_chunkdb(arg);
-		if (errstr) {
-			fprintf(stderr, "Failed to add chunkdb \"%s\": %s\n",
-					arg, STR_OR_ERROR(errstr));
+		/* added once the chunk size is known */
+		chunkdb_specs = realloc(chunkdb_specs,
+				(nr_chunkdb_specs + 1) * sizeof(char *));
+		if (!chunkdb_specs) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		chunkdb_specs[nr_chunkdb_specs ++] = arg + 11;
+		return 0;
+	case OPT_COMPRESS:
+		ddent_default_flags |= DDENT_COMPRESS;
+		return 0;
+	case OPT_INLINE:
+		ddent_default_flags |= DDENT_INLINE;
+		return 0;
+	case OPT_CDC:
+		ddent_default_flags |= DDENT_CDC;
+		return 0;
+	case OPT_CIPHER:
+		cipher = find_chunk_cipher(arg + 9);
+		if (cipher < 0 || cipher == CHUNK_CIPHER_XOR) {
+			fprintf(stderr, "Unknown cipher: %s\n", arg + 9);
+			return -1;
+		}
+		ddent_default_flags &= ~DDENT_CRYPTO_MASK;
+		ddent_default_flags |= cipher;
+		return 0;
+	case OPT_SHORT_SECRET:
+		ddent_default_flags |= DDENT_SHORT_SECRET;
+		return 0;
+	case OPT_DIGEST:
+		digest_algo = find_digest_algo(arg + 9);
+		if (digest_algo < 0) {
+			fprintf(stderr, "Unknown digest: %s\n", arg + 9);
+			return -1;
+		}
+		return 0;
+	case OPT_CHUNK_SIZE:
+		chunk_size = strtoul(arg + 13, &errstr, 0);
+		if (*errstr || set_chunk_size(chunk_size)) {
+			fprintf(stderr, "Invalid chunk size: %s\n", arg + 13);
+			return -1;
+		}
+		return 0;
+	case OPT_POOL_MAX:
+		pool_mem_limit = strtoul(arg + 11, &errstr, 0);
+		if (*errstr || !pool_mem_limit) {
+			fprintf(stderr, "Invalid pool size: %s\n", arg + 11);
+			return -1;
+		}
+		pool_mem_limit <<= 20;
+		return 0;
+	case OPT_HUGEPAGES:
+		pool_huge_pages = true;
+		return 0;
+	case OPT_DIRTY_MAX:
+		dirty_max = strtoul(arg + 12, &errstr, 0);
+		if (*errstr) {
+			fprintf(stderr, "Invalid dirty limit: %s\n", arg + 12);
+			return -1;
+		}
+		dirty_max <<= 20;
+		return 0;
+	case OPT_WRITEBACK:
+		writeback_interval = strtoul(arg + 12, &errstr, 0);
+		if (*errstr || !writeback_interval) {
+			fprintf(stderr, "Invalid writeback interval: %s\n",
+					arg + 12);
+			return -1;
+		}
+		return 0;
+	case OPT_DCACHE:
+		dcache_max = strtoul(arg + 9, &errstr, 0);
+		if (*errstr) {
+			fprintf(stderr, "Invalid dcache size: %s\n", arg + 9);
 			return -1;
 		}
 		return 0;
 	default:
-		if (arg[0] == '-' || root_set)
+		if (arg[0] == '-' || root_file)
 			return 1;
-		set_root_file(arg);
-		root_set = 1;
+		root_file = arg;
 		return 0;
 	}
 }
@@ -554,6 +723,9 @@ static int opt_proc(void *data, const char *arg, int key,
 int main(int argc, char **argv)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct superblock *sb = NULL;
+	char *errstr;
+	unsigned i;
 	int err;
 
 	prog = basename(argv[0]);
@@ -562,9 +734,33 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	/*
+	 * Set up the root after all options are in, so a new
+	 * root gets the right flags.
+	 */
+	if (root_file)
+		sb = open_superblock(root_file);
+
+	for (i = 0; i < nr_chunkdb_specs; i ++) {
+		errstr = add_chunkdb(chunkdb_specs[i]);
+		if (errstr) {
+			fprintf(stderr, "Failed to add chunkdb \"%s\": %s\n",
+					chunkdb_specs[i], STR_OR_ERROR(errstr));
+			return -1;
+		}
+	}
+
+	if (sb)
+		set_root_file(sb);
+
 	err = fuse_main(args.argc, args.argv, &zunkfs_operations, NULL);
 	if (!err)
 		flush_root();
+	flush_chunkdb();
+	log_chunkdb_stats();
+	log_readahead_stats();
+	log_dcache_stats();
+	log_pool_stats();
 
 	return err;
 }
@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "lz.h"
+
+#define VALUE_SIZE 65536
+
+static unsigned char value[VALUE_SIZE];
+static unsigned char compressed[VALUE_SIZE + VALUE_SIZE / 255 + 16];
+static unsigned char decompressed[VALUE_SIZE];
+
+static void test(const char *name)
+{
+	struct timeval start, end;
+	int clen, dlen;
+
+	gettimeofday(&start, NULL);
+	clen = lz_compress(value, VALUE_SIZE, compressed, sizeof(compressed));
+	assert(clen > 0);
+	dlen = lz_decompress(compressed, clen, decompressed, VALUE_SIZE);
+	gettimeofday(&end, NULL);
+
+	printf("%-8s %6d -> %6d %s (%ldus)\n", name, VALUE_SIZE, clen,
+			dlen == VALUE_SIZE &&
+			!memcmp(value, decompressed, VALUE_SIZE) ?
+			"ok" : "FAILED",
+			(end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec);
+
+	if (dlen != VALUE_SIZE || memcmp(value, decompressed, VALUE_SIZE))
+		exit(-1);
+
+	/* truncated input must be rejected, not overrun */
+	if (clen > 1)
+		lz_decompress(compressed, clen - 1, decompressed, VALUE_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	for (i = 0; i < VALUE_SIZE; i ++)
+		value[i] = random();
+	test("random");
+
+	memset(value, 0, VALUE_SIZE);
+	test("zero");
+
+	for (i = 0; i < VALUE_SIZE; i ++)
+		value[i] = "the quick brown fox jumps over the lazy dog\n"
+			[(i * 7 + i / 100) % 44];
+	test("text");
+
+	for (i = 0; i < VALUE_SIZE; i ++)
+		value[i] = (random() & 3) ? 0 : random();
+	test("sparse");
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH	4
+#define LAST_LITERALS	5  /* last 5 bytes are always literals */
+#define MF_LIMIT	12 /* no match may start in the last 12 bytes */
+#define MAX_OFFSET	65535
+#define HASH_LOG	12
+#define SKIP_TRIGGER	6  /* speed up on incompressible data */
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(uint32_t));
+	return v;
+}
+
+static inline unsigned lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_len(unsigned char *op, unsigned n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+/*
+ * Emit literals [anchor, ip) followed by a match of 'mlen' at 'offset'.
+ * A zero 'mlen' emits the final, literals only, sequence.
+ */
+static unsigned char *put_seq(unsigned char *op, const unsigned char *oend,
+		const unsigned char *anchor, unsigned lit, unsigned offset,
+		unsigned mlen)
+{
+	unsigned char *token;
+
+	if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+		return NULL;
+
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = put_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	if (!mlen)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	mlen -= MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = put_len(op, mlen - 15);
+
+	return op;
+}
+
+int lz_compress(const unsigned char *src, unsigned len, unsigned char *dst,
+		unsigned dst_max)
+{
+	uint32_t table[1 << HASH_LOG];
+	const unsigned char *oend = dst + dst_max;
+	unsigned char *op = dst;
+	unsigned ip, ref, anchor, mlen, misses;
+	unsigned h;
+
+	memset(table, 0, sizeof(table));
+
+	ip = anchor = 0;
+	misses = 1 << SKIP_TRIGGER;
+
+	while (len >= MF_LIMIT && ip + MF_LIMIT <= len) {
+		h = lz_hash(read32(src + ip));
+		ref = table[h];
+		table[h] = ip;
+
+		if (ref >= ip || ip - ref > MAX_OFFSET ||
+				read32(src + ref) != read32(src + ip)) {
+			ip += misses++ >> SKIP_TRIGGER;
+			continue;
+		}
+
+		mlen = MIN_MATCH;
+		while (ip + mlen < len - LAST_LITERALS &&
+				src[ref + mlen] == src[ip + mlen])
+			mlen ++;
+
+		/* extend backwards over pending literals */
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+			ip --;
+			ref --;
+			mlen ++;
+		}
+
+		op = put_seq(op, oend, src + anchor, ip - anchor, ip - ref,
+				mlen);
+		if (!op)
+			return -ENOSPC;
+
+		ip += mlen;
+		anchor = ip;
+		misses = 1 << SKIP_TRIGGER;
+	}
+
+	op = put_seq(op, oend, src + anchor, len - anchor, 0, 0);
+	if (!op)
+		return -ENOSPC;
+
+	return op - dst;
+}
+
+static int get_len(const unsigned char **ip, const unsigned char *iend,
+		unsigned *n)
+{
+	unsigned char b;
+
+	do {
+		if (*ip >= iend)
+			return -EINVAL;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int lz_decompress(const unsigned char *src, unsigned len, unsigned char *dst,
+		unsigned dst_max)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + len;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + dst_max;
+	unsigned token, lit, mlen, offset;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit = token >> 4;
+		if (lit == 15 && get_len(&ip, iend, &lit))
+			return -EINVAL;
+		if (lit > iend - ip || lit > oend - op)
+			return -EINVAL;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EINVAL;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > op - dst)
+			return -EINVAL;
+
+		mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, iend, &mlen))
+			return -EINVAL;
+		mlen += MIN_MATCH;
+		if (mlen > oend - op)
+			return -EINVAL;
+
+		/* matches may overlap their own output */
+		if (offset >= mlen) {
+			memcpy(op, op - offset, mlen);
+			op += mlen;
+		} else {
+			while (mlen --) {
+				*op = *(op - offset);
+				op ++;
+			}
+		}
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,30 @@
+#ifndef __ZUNKFS_LZ_H__
+#define __ZUNKFS_LZ_H__
+
+/*
+ * Fast LZ77 codec, using the LZ4 block format.
+ */
+
+/*
+ * Worst case compressed size for 'len' bytes of input.
+ */
+static inline unsigned lz_bound(unsigned len)
+{
+	return len + len / 255 + 16;
+}
+
+/*
+ * Returns compressed length, or -ENOSPC if the result
+ * doesn't fit in 'dst_max' bytes.
+ */
+int lz_compress(const unsigned char *src, unsigned len, unsigned char *dst,
+		unsigned dst_max);
+
+/*
+ * Returns decompressed length, or -EINVAL if 'src' is corrupt
+ * or doesn't decompress into 'dst_max' bytes.
+ */
+int lz_decompress(const unsigned char *src, unsigned len, unsigned char *dst,
+		unsigned dst_max);
+
+#endif
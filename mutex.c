@@ -37,3 +37,39 @@ int trylock(struct mutex *m)
 	return !err;
 }
 
+
+void init_rwlock(struct rwlock *l)
+{
+	*l = (struct rwlock)INIT_RWLOCK;
+}
+
+void read_lock(struct rwlock *l)
+{
+	int err = pthread_rwlock_rdlock(&l->rwlock);
+	if (err)
+		panic("pthread_rwlock_rdlock: %s\n", strerror(err));
+}
+
+void read_unlock(struct rwlock *l)
+{
+	int err = pthread_rwlock_unlock(&l->rwlock);
+	if (err)
+		panic("pthread_rwlock_unlock: %s\n", strerror(err));
+}
+
+void write_lock(struct rwlock *l)
+{
+	int err = pthread_rwlock_wrlock(&l->rwlock);
+	if (err)
+		panic("pthread_rwlock_wrlock: %s\n", strerror(err));
+	l->writer = pthread_self();
+}
+
+void write_unlock(struct rwlock *l)
+{
+	int err;
+	l->writer = (pthread_t)-1;
+	err = pthread_rwlock_unlock(&l->rwlock);
+	if (err)
+		panic("pthread_rwlock_unlock: %s\n", strerror(err));
+}
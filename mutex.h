@@ -31,6 +31,27 @@ static inline int have_mutex(const struct mutex *m)
 	return m->owner == pthread_self();
 }
 
+/*
+ * Reader-writer lock wrappers. Only the writer is tracked.
+ */
+struct rwlock {
+	pthread_rwlock_t rwlock;
+	pthread_t writer;
+};
+
+#define INIT_RWLOCK { PTHREAD_RWLOCK_INITIALIZER, (pthread_t)-1 }
+
+void init_rwlock(struct rwlock *l);
+void read_lock(struct rwlock *l);
+void read_unlock(struct rwlock *l);
+void write_lock(struct rwlock *l);
+void write_unlock(struct rwlock *l);
+
+static inline int have_write_lock(const struct rwlock *l)
+{
+	return l->writer == pthread_self();
+}
+
 #define locked_inc(value, mutex) do { \
 	lock(mutex); \
 	++ *(value); \
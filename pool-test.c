@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "pool.h"
+#include "utils.h"
+
+#define OBJ_SIZE	65600
+#define NR_THREADS	4
+#define NR_OBJS		64
+#define NR_ROUNDS	2000
+
+static DECLARE_POOL(test_pool, OBJ_SIZE);
+static DECLARE_POOL(small_pool, 100);
+
+static void *churn(void *arg)
+{
+	unsigned long id = (unsigned long)arg;
+	unsigned char *objs[NR_OBJS] = { NULL };
+	int round, i;
+
+	for (round = 0; round < NR_ROUNDS; round ++) {
+		i = random() % NR_OBJS;
+		if (objs[i]) {
+			/* nobody else scribbled on it */
+			assert(objs[i][0] == id && objs[i][OBJ_SIZE - 1] == i);
+			pool_free(&test_pool, objs[i]);
+			objs[i] = NULL;
+		} else {
+			objs[i] = pool_alloc(&test_pool);
+			assert(objs[i] != NULL);
+			objs[i][0] = id;
+			objs[i][OBJ_SIZE - 1] = i;
+		}
+	}
+
+	for (i = 0; i < NR_OBJS; i ++)
+		pool_free(&test_pool, objs[i]);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[NR_THREADS];
+	struct timeval start, end;
+	unsigned char *obj;
+	void **objs;
+	unsigned long i, n;
+
+	set_logging("T,stdout");
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < NR_THREADS; i ++)
+		assert(!pthread_create(threads + i, NULL, churn, (void *)i));
+	for (i = 0; i < NR_THREADS; i ++)
+		pthread_join(threads[i], NULL);
+	gettimeofday(&end, NULL);
+
+	printf("churn: %ldus\n", (end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec);
+
+	assert(test_pool.live == 0);
+	assert(test_pool.peak > 0 && test_pool.peak <= NR_THREADS * NR_OBJS);
+
+	obj = pool_zalloc(&small_pool);
+	assert(obj != NULL);
+	for (i = 0; i < 100; i ++)
+		assert(obj[i] == 0);
+	pool_free(&small_pool, obj);
+
+	/*
+	 * Limit is checked per slab, so allocate until it kicks in,
+	 * and make sure it does.
+	 */
+	pool_mem_limit = 32 << 20;
+	objs = calloc(pool_mem_limit / OBJ_SIZE + 1, sizeof(void *));
+	assert(objs != NULL);
+	for (n = 0; n <= pool_mem_limit / OBJ_SIZE; n ++) {
+		objs[n] = pool_alloc(&test_pool);
+		if (!objs[n])
+			break;
+	}
+	printf("limit: %lu objects\n", n);
+	assert(n > 0 && n <= pool_mem_limit / OBJ_SIZE);
+	for (i = 0; i < n; i ++)
+		pool_free(&test_pool, objs[i]);
+	free(objs);
+
+	log_pool_stats();
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "utils.h"
+
+#define SLAB_SIZE	(2UL << 20) /* a huge page on x86 */
+#define POOL_ALIGN	64
+
+/*
+ * Per-thread caches hold up to TCACHE_BYTES worth of objects
+ * of each pool, and move half of that at a time to or from the pool.
+ * Pools past the first POOL_MAX go without.
+ */
+#define POOL_MAX	8
+#define TCACHE_BYTES	(256UL << 10)
+#define TCACHE_OBJS_MAX	32
+
+size_t pool_mem_limit = 0;
+bool pool_huge_pages = false;
+
+static unsigned long pool_mem;
+static unsigned nr_pools;
+static LIST_HEAD(pool_list);
+static pthread_mutex_t pool_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct tcache {
+	void *head;
+	unsigned count;
+};
+
+static __thread struct tcache tcaches[POOL_MAX];
+static __thread bool tcache_registered;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+#define next_obj(obj)	(*(void **)(obj))
+
+static inline size_t slab_size(const struct pool *pool)
+{
+	size_t size = SLAB_SIZE;
+
+	while (size < 4 * pool->size)
+		size += SLAB_SIZE;
+
+	return size;
+}
+
+static inline unsigned tcache_max(const struct pool *pool)
+{
+	unsigned long max = TCACHE_BYTES / pool->size;
+
+	if (max < 2)
+		return 2;
+	if (max > TCACHE_OBJS_MAX)
+		return TCACHE_OBJS_MAX;
+	return max;
+}
+
+static void *map_slab(size_t size)
+{
+	void *slab;
+
+#ifdef MAP_HUGETLB
+	if (pool_huge_pages) {
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				-1, 0);
+		if (slab != MAP_FAILED)
+			return slab;
+	}
+#endif
+	slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slab == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	/* no reserved huge pages, so try transparent ones */
+	if (pool_huge_pages)
+		madvise(slab, size, MADV_HUGEPAGE);
+#endif
+	return slab;
+}
+
+static void add_slab(struct pool *pool)
+{
+	size_t size = slab_size(pool);
+	unsigned char *slab;
+	unsigned long mem;
+	size_t off;
+
+	mem = __sync_add_and_fetch(&pool_mem, size);
+	if (pool_mem_limit && mem > pool_mem_limit) {
+		__sync_sub_and_fetch(&pool_mem, size);
+		warn_once("%s: pool memory limit reached\n", pool->name);
+		return;
+	}
+
+	slab = map_slab(size);
+	if (!slab) {
+		__sync_sub_and_fetch(&pool_mem, size);
+		WARNING("%s: mmap: %s\n", pool->name, strerror(errno));
+		return;
+	}
+
+	for (off = 0; off + pool->size <= size; off += pool->size) {
+		next_obj(slab + off) = pool->free_list;
+		pool->free_list = slab + off;
+	}
+	pool->slabs ++;
+}
+
+static void refill_tcache(struct pool *pool, struct tcache *tc, unsigned count)
+{
+	void *obj;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->free_list)
+		add_slab(pool);
+	while (count-- && pool->free_list) {
+		obj = pool->free_list;
+		pool->free_list = next_obj(obj);
+		next_obj(obj) = tc->head;
+		tc->head = obj;
+		tc->count ++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void drain_tcache(struct pool *pool, struct tcache *tc, unsigned count)
+{
+	void *obj;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (count-- && tc->head) {
+		obj = tc->head;
+		tc->head = next_obj(obj);
+		tc->count --;
+		next_obj(obj) = pool->free_list;
+		pool->free_list = obj;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Give a dying thread's cached objects back to their pools.
+ */
+static void drain_tcaches(void *unused)
+{
+	struct pool *pool;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	list_for_each_entry(pool, &pool_list, pool_entry) {
+		if (pool->index <= POOL_MAX)
+			drain_tcache(pool, &tcaches[pool->index - 1],
+					TCACHE_OBJS_MAX);
+	}
+	pthread_mutex_unlock(&pool_list_mutex);
+}
+
+static void create_tcache_key(void)
+{
+	if (pthread_key_create(&tcache_key, drain_tcaches))
+		WARNING("pthread_key_create failed\n");
+}
+
+static void register_pool(struct pool *pool)
+{
+	pthread_mutex_lock(&pool_list_mutex);
+	if (!pool->index) {
+		if (pool->size_fn)
+			pool->size = pool->size_fn();
+		pool->size = (pool->size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+		list_add_tail(&pool->pool_entry, &pool_list);
+		pool->index = ++ nr_pools;
+	}
+	pthread_mutex_unlock(&pool_list_mutex);
+}
+
+static struct tcache *get_tcache(struct pool *pool)
+{
+	if (!pool->index)
+		register_pool(pool);
+	if (pool->index > POOL_MAX)
+		return NULL;
+
+	if (!tcache_registered) {
+		pthread_once(&tcache_once, create_tcache_key);
+		pthread_setspecific(tcache_key, tcaches);
+		tcache_registered = true;
+	}
+
+	return &tcaches[pool->index - 1];
+}
+
+void *pool_alloc(struct pool *pool)
+{
+	struct tcache *tc = get_tcache(pool);
+	struct tcache local = { NULL, 0 };
+	unsigned long live;
+	void *obj;
+
+	if (!tc) {
+		refill_tcache(pool, &local, 1);
+		obj = local.head;
+	} else {
+		if (!tc->head)
+			refill_tcache(pool, tc, tcache_max(pool) / 2);
+		obj = tc->head;
+		if (obj) {
+			tc->head = next_obj(obj);
+			tc->count --;
+		}
+	}
+
+	if (!obj)
+		return NULL;
+
+	live = __sync_add_and_fetch(&pool->live, 1);
+	if (live > pool->peak)
+		pool->peak = live;
+
+	return obj;
+}
+
+void *pool_zalloc(struct pool *pool)
+{
+	void *obj = pool_alloc(pool);
+
+	if (obj)
+		memset(obj, 0, pool->size);
+
+	return obj;
+}
+
+void pool_free(struct pool *pool, void *obj)
+{
+	struct tcache *tc;
+	struct tcache local = { obj, 1 };
+
+	if (!obj)
+		return;
+
+	__sync_sub_and_fetch(&pool->live, 1);
+
+	tc = get_tcache(pool);
+	if (!tc) {
+		next_obj(obj) = NULL;
+		drain_tcache(pool, &local, 1);
+		return;
+	}
+
+	next_obj(obj) = tc->head;
+	tc->head = obj;
+	if (++ tc->count > tcache_max(pool))
+		drain_tcache(pool, tc, tcache_max(pool) / 2);
+}
+
+void log_pool_stats(void)
+{
+	struct pool *pool;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	list_for_each_entry(pool, &pool_list, pool_entry) {
+		TRACE("%s: live=%lu peak=%lu slabs=%lu\n", pool->name,
+				pool->live, pool->peak, pool->slabs);
+	}
+	TRACE("total=%luKB limit=%luKB\n", pool_mem >> 10,
+			(unsigned long)pool_mem_limit >> 10);
+	pthread_mutex_unlock(&pool_list_mutex);
+}
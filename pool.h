@@ -0,0 +1,65 @@
+#ifndef __ZUNKFS_POOL_H__
+#define __ZUNKFS_POOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "list.h"
+
+/*
+ * Pools of fixed size objects, for things allocated and freed at a
+ * high rate, like chunk nodes. Objects are carved out of large mmap()ed
+ * slabs, which are never given back, and each thread keeps a few freed
+ * objects of every pool around, so most allocations take no lock.
+ */
+struct pool {
+	const char *name;
+	size_t size;
+	size_t (*size_fn)(void);	/* sets size at first use, if given */
+	unsigned index;		/* into the per-thread caches */
+	pthread_mutex_t mutex;
+	void *free_list;
+	unsigned long slabs;
+	unsigned long live;	/* objects handed out */
+	unsigned long peak;
+	struct list_head pool_entry;
+};
+
+#define DECLARE_POOL(p, obj_size) \
+	struct pool p = { \
+		.name = #p, \
+		.size = (obj_size), \
+		.mutex = PTHREAD_MUTEX_INITIALIZER, \
+		.pool_entry = LIST_HEAD_INIT(p.pool_entry), \
+	}
+
+/*
+ * For objects whose size isn't known until runtime,
+ * like those that depend on the chunk size.
+ */
+#define DECLARE_RUNTIME_POOL(p, obj_size_fn) \
+	struct pool p = { \
+		.name = #p, \
+		.size_fn = (obj_size_fn), \
+		.mutex = PTHREAD_MUTEX_INITIALIZER, \
+		.pool_entry = LIST_HEAD_INIT(p.pool_entry), \
+	}
+
+/*
+ * Return NULL once pool_mem_limit would be exceeded.
+ */
+void *pool_alloc(struct pool *pool);
+void *pool_zalloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+
+/*
+ * Set these before the first allocation. pool_mem_limit caps the
+ * memory used by all slabs together, in bytes. 0 means no limit.
+ */
+extern size_t pool_mem_limit;
+extern bool pool_huge_pages;
+
+void log_pool_stats(void);
+
+#endif
+
@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <openssl/sha.h>
+
+#include "sha1-mb.h"
+
+#define VALUE_SIZE 65536
+
+static unsigned char value[SHA1_MB_MAX_LANES][VALUE_SIZE];
+
+/*
+ * Lengths around the padding boundaries, and a full chunk.
+ */
+static const size_t lengths[] = {
+	0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, VALUE_SIZE
+};
+
+#define NR_LENGTHS	(sizeof(lengths) / sizeof(lengths[0]))
+
+int main(int argc, char **argv)
+{
+	const unsigned char *data[SHA1_MB_MAX_LANES];
+	unsigned char digests[SHA1_MB_MAX_LANES][SHA_DIGEST_LENGTH];
+	unsigned char *pdigests[SHA1_MB_MAX_LANES];
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned lanes = sha1_mb_lanes();
+	struct timeval start, end;
+	int i, j, failed = 0;
+
+	printf("lanes: %u\n", lanes);
+	if (!lanes)
+		return 0;
+
+	for (i = 0; i < lanes; i ++) {
+		for (j = 0; j < VALUE_SIZE; j ++)
+			value[i][j] = random();
+		data[i] = value[i];
+		pdigests[i] = digests[i];
+	}
+
+	for (i = 0; i < NR_LENGTHS; i ++) {
+		sha1_mb(data, lengths[i], pdigests);
+		for (j = 0; j < lanes; j ++) {
+			SHA1(data[j], lengths[i], digest);
+			if (memcmp(digest, digests[j], SHA_DIGEST_LENGTH)) {
+				printf("%zu bytes, lane %d: FAILED\n",
+						lengths[i], j);
+				failed = 1;
+			}
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; i ++)
+		sha1_mb(data, VALUE_SIZE, pdigests);
+	gettimeofday(&end, NULL);
+
+	printf("1000 x %u x %d bytes in %ldus\n", lanes, VALUE_SIZE,
+			(end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec);
+
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,301 @@
+
+/*
+ * SHA1 of several buffers at a time, one per 32bit lane of a SIMD
+ * register: 8 with AVX2, 16 with AVX-512. A single SHA1 can't be
+ * split up like that, as each block depends on the previous one,
+ * but chunks being flushed are independent of each other.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha1-mb.h"
+
+#define BLOCK_LEN	64
+
+/*
+ * Hashes 'nr_blocks' full blocks of each lane's buffer into 'h',
+ * which is laid out as h[word][lane].
+ */
+typedef void (*sha1_blocks_fn)(uint32_t *h, const unsigned char **p,
+		size_t nr_blocks);
+
+static unsigned mb_lanes;
+static sha1_blocks_fn mb_blocks;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define VROTL(x, c)	OR(SHL(x, c), SHR(x, 32 - (c)))
+
+#define F0(b, c, d)	XOR(d, AND(b, XOR(c, d)))
+#define F1(b, c, d)	XOR(b, XOR(c, d))
+#define F2(b, c, d)	OR(AND(b, c), AND(d, OR(b, c)))
+#define F3(b, c, d)	F1(b, c, d)
+
+/*
+ * w[] is a ring of the last 16 message words.
+ */
+#define W(t) ({ \
+	if ((t) >= 16) \
+		w[(t) & 15] = VROTL(XOR(XOR(w[((t) - 3) & 15], \
+				w[((t) - 8) & 15]), XOR(w[((t) - 14) & 15], \
+				w[(t) & 15])), 1); \
+	w[(t) & 15]; \
+})
+
+#define ROUND(f, k, t) do { \
+	vec_t tmp = ADD(ADD(VROTL(a, 5), f(b, c, d)), \
+			ADD(ADD(e, k), W(t))); \
+	e = d; \
+	d = c; \
+	c = VROTL(b, 30); \
+	b = a; \
+	a = tmp; \
+} while(0)
+
+#define SHA1_BLOCKS(load_block) do { \
+	vec_t k0 = SET1(0x5a827999); \
+	vec_t k1 = SET1(0x6ed9eba1); \
+	vec_t k2 = SET1(0x8f1bbcdc); \
+	vec_t k3 = SET1(0xca62c1d6); \
+	vec_t a, b, c, d, e, w[16], s[5]; \
+	size_t off; \
+	int t; \
+	\
+	for (t = 0; t < 5; t ++) \
+		s[t] = LOAD(h + t * LANES); \
+	\
+	for (off = 0; off < nr_blocks * BLOCK_LEN; off += BLOCK_LEN) { \
+		load_block(w, p, off); \
+		\
+		a = s[0]; \
+		b = s[1]; \
+		c = s[2]; \
+		d = s[3]; \
+		e = s[4]; \
+		\
+		_Pragma("GCC unroll 20") \
+		for (t = 0; t < 20; t ++) \
+			ROUND(F0, k0, t); \
+		_Pragma("GCC unroll 20") \
+		for (; t < 40; t ++) \
+			ROUND(F1, k1, t); \
+		_Pragma("GCC unroll 20") \
+		for (; t < 60; t ++) \
+			ROUND(F2, k2, t); \
+		_Pragma("GCC unroll 20") \
+		for (; t < 80; t ++) \
+			ROUND(F3, k3, t); \
+		\
+		s[0] = ADD(s[0], a); \
+		s[1] = ADD(s[1], b); \
+		s[2] = ADD(s[2], c); \
+		s[3] = ADD(s[3], d); \
+		s[4] = ADD(s[4], e); \
+	} \
+	\
+	for (t = 0; t < 5; t ++) \
+		STORE(h + t * LANES, s[t]); \
+} while(0)
+
+/*
+ * AVX2, 8 lanes.
+ */
+#define LANES		8
+#define vec_t		__m256i
+#define SET1(x)		_mm256_set1_epi32(x)
+#define LOAD(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define STORE(p, x)	_mm256_storeu_si256((__m256i *)(p), x)
+#define ADD(a, b)	_mm256_add_epi32(a, b)
+#define XOR(a, b)	_mm256_xor_si256(a, b)
+#define AND(a, b)	_mm256_and_si256(a, b)
+#define OR(a, b)	_mm256_or_si256(a, b)
+#define SHL(a, c)	_mm256_slli_epi32(a, c)
+#define SHR(a, c)	_mm256_srli_epi32(a, c)
+
+/*
+ * Loads a block of each lane's buffer, and transposes it so w[i]
+ * holds big endian word i of every lane. Done as two 8x8 transposes.
+ */
+static inline void __attribute__((target("avx2")))
+load_block_avx2(__m256i w[16], const unsigned char **p, size_t off)
+{
+	const __m256i bswap = _mm256_setr_epi8(
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+			3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i r[8], t[8], u[8];
+	int half, i;
+
+	for (half = 0; half < 2; half ++, off += 32, w += 8) {
+		for (i = 0; i < 8; i ++)
+			r[i] = LOAD(p[i] + off);
+
+		for (i = 0; i < 8; i += 2) {
+			t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+			t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+		}
+		for (i = 0; i < 8; i += 4) {
+			u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+			u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+			u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+			u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+		}
+		for (i = 0; i < 4; i ++) {
+			w[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(
+					u[i], u[i + 4], 0x20), bswap);
+			w[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(
+					u[i], u[i + 4], 0x31), bswap);
+		}
+	}
+}
+
+static void __attribute__((target("avx2")))
+sha1_blocks_avx2(uint32_t *h, const unsigned char **p, size_t nr_blocks)
+{
+	SHA1_BLOCKS(load_block_avx2);
+}
+
+#undef LANES
+#undef vec_t
+#undef SET1
+#undef LOAD
+#undef STORE
+#undef ADD
+#undef XOR
+#undef AND
+#undef OR
+#undef SHL
+#undef SHR
+
+/*
+ * AVX-512, 16 lanes.
+ */
+#define LANES		16
+#define vec_t		__m512i
+#define SET1(x)		_mm512_set1_epi32(x)
+#define LOAD(p)		_mm512_loadu_si512(p)
+#define STORE(p, x)	_mm512_storeu_si512(p, x)
+#define ADD(a, b)	_mm512_add_epi32(a, b)
+#define XOR(a, b)	_mm512_xor_si512(a, b)
+#define AND(a, b)	_mm512_and_si512(a, b)
+#define OR(a, b)	_mm512_or_si512(a, b)
+
+#undef VROTL
+#define VROTL(x, c)	_mm512_rol_epi32(x, c)
+
+/*
+ * 16x16 transpose of a block from each lane. Byte swapping is done
+ * with rotates, as AVX-512F has no byte shuffle.
+ */
+static inline void __attribute__((target("avx512f")))
+load_block_avx512(__m512i w[16], const unsigned char **p, size_t off)
+{
+	const __m512i lo = _mm512_set1_epi32(0x00ff00ff);
+	const __m512i hi = _mm512_set1_epi32(0xff00ff00);
+	__m512i t[16], u[16], v[16];
+	int i, k;
+
+	for (i = 0; i < 16; i ++)
+		v[i] = LOAD(p[i] + off);
+
+	for (i = 0; i < 16; i += 2) {
+		t[i] = _mm512_unpacklo_epi32(v[i], v[i + 1]);
+		t[i + 1] = _mm512_unpackhi_epi32(v[i], v[i + 1]);
+	}
+	for (i = 0; i < 16; i += 4) {
+		u[i] = _mm512_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm512_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm512_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm512_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	/* u[4 * g + k] has words k, k+4, k+8, k+12 of lanes 4g...4g+3 */
+	for (k = 0; k < 4; k ++) {
+		__m512i s0 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0x44);
+		__m512i s1 = _mm512_shuffle_i32x4(u[k], u[4 + k], 0xee);
+		__m512i s2 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0x44);
+		__m512i s3 = _mm512_shuffle_i32x4(u[8 + k], u[12 + k], 0xee);
+
+		w[k] = _mm512_shuffle_i32x4(s0, s2, 0x88);
+		w[k + 4] = _mm512_shuffle_i32x4(s0, s2, 0xdd);
+		w[k + 8] = _mm512_shuffle_i32x4(s1, s3, 0x88);
+		w[k + 12] = _mm512_shuffle_i32x4(s1, s3, 0xdd);
+	}
+
+	for (i = 0; i < 16; i ++)
+		w[i] = OR(_mm512_rol_epi32(AND(w[i], lo), 24),
+				_mm512_rol_epi32(AND(w[i], hi), 8));
+}
+
+static void __attribute__((target("avx512f")))
+sha1_blocks_avx512(uint32_t *h, const unsigned char **p, size_t nr_blocks)
+{
+	SHA1_BLOCKS(load_block_avx512);
+}
+
+static void __attribute__((constructor)) pick_sha1_mb(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		mb_lanes = 16;
+		mb_blocks = sha1_blocks_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		mb_lanes = 8;
+		mb_blocks = sha1_blocks_avx2;
+	}
+}
+#endif
+
+unsigned sha1_mb_lanes(void)
+{
+	return mb_lanes;
+}
+
+void sha1_mb(const unsigned char **data, size_t len, unsigned char **digests)
+{
+	static const uint32_t iv[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	unsigned char tail[SHA1_MB_MAX_LANES][2 * BLOCK_LEN];
+	const unsigned char *p[SHA1_MB_MAX_LANES];
+	uint32_t h[5 * SHA1_MB_MAX_LANES];
+	size_t full = len / BLOCK_LEN, rest = len % BLOCK_LEN;
+	uint64_t bits = (uint64_t)len * 8;
+	unsigned tail_len;
+	int i, j;
+
+	if (!mb_lanes)
+		abort();
+
+	for (i = 0; i < 5; i ++) {
+		for (j = 0; j < mb_lanes; j ++)
+			h[i * mb_lanes + j] = iv[i];
+	}
+
+	mb_blocks(h, data, full);
+
+	/* padding: 0x80, zeros, and the length in bits */
+	tail_len = rest + 9 > BLOCK_LEN ? 2 * BLOCK_LEN : BLOCK_LEN;
+	for (i = 0; i < mb_lanes; i ++) {
+		memset(tail[i], 0, tail_len);
+		memcpy(tail[i], data[i] + full * BLOCK_LEN, rest);
+		tail[i][rest] = 0x80;
+		for (j = 0; j < 8; j ++)
+			tail[i][tail_len - 1 - j] = bits >> (j * 8);
+		p[i] = tail[i];
+	}
+	mb_blocks(h, p, tail_len / BLOCK_LEN);
+
+	for (i = 0; i < mb_lanes; i ++) {
+		for (j = 0; j < 5; j ++) {
+			uint32_t x = h[j * mb_lanes + i];
+
+			digests[i][j * 4] = x >> 24;
+			digests[i][j * 4 + 1] = x >> 16;
+			digests[i][j * 4 + 2] = x >> 8;
+			digests[i][j * 4 + 3] = x;
+		}
+	}
+}
+
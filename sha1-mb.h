@@ -0,0 +1,17 @@
+#ifndef __ZUNKFS_SHA1_MB_H__
+#define __ZUNKFS_SHA1_MB_H__
+
+#include <stddef.h>
+
+#define SHA1_MB_MAX_LANES	16
+
+/*
+ * Multi-buffer SHA1: hashes several equally sized buffers at once,
+ * one per SIMD lane. sha1_mb_lanes() is the number of buffers
+ * sha1_mb() takes, or 0 if the CPU can't do it.
+ */
+unsigned sha1_mb_lanes(void);
+void sha1_mb(const unsigned char **data, size_t len, unsigned char **digests);
+
+#endif
+
@@ -0,0 +1,89 @@
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workqueue.h"
+#include "utils.h"
+
+static void *worker_thread(void *arg)
+{
+	struct workqueue *wq = arg;
+	struct work *work;
+
+	pthread_mutex_lock(&wq->mutex);
+	for (;;) {
+		while (list_empty(&wq->pending))
+			pthread_cond_wait(&wq->work_cond, &wq->mutex);
+
+		work = list_pop_entry(&wq->pending, struct work, work_entry);
+		wq->nr_pending --;
+		wq->nr_running ++;
+		pthread_mutex_unlock(&wq->mutex);
+
+		work->func(work);
+
+		pthread_mutex_lock(&wq->mutex);
+		wq->nr_running --;
+		if (!wq->nr_pending && !wq->nr_running)
+			pthread_cond_broadcast(&wq->idle_cond);
+	}
+
+	return NULL;
+}
+
+static int start_worker(struct workqueue *wq)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	err = pthread_create(&thread, &attr, worker_thread, wq);
+	if (err)
+		WARNING("%s: pthread_create: %s\n", wq->name, strerror(err));
+	else
+		wq->nr_threads ++;
+
+	pthread_attr_destroy(&attr);
+	return -err;
+}
+
+bool queue_work(struct workqueue *wq, struct work *work)
+{
+	bool queued = false;
+
+	assert(work->func != NULL);
+
+	pthread_mutex_lock(&wq->mutex);
+
+	while (wq->nr_threads < wq->max_threads)
+		if (start_worker(wq))
+			break;
+
+	if (wq->nr_threads && wq->nr_pending < wq->max_pending) {
+		list_add_tail(&work->work_entry, &wq->pending);
+		wq->nr_pending ++;
+		pthread_cond_signal(&wq->work_cond);
+		queued = true;
+	}
+
+	pthread_mutex_unlock(&wq->mutex);
+
+	return queued;
+}
+
+void flush_workqueue(struct workqueue *wq)
+{
+	pthread_mutex_lock(&wq->mutex);
+	while (wq->nr_pending || wq->nr_running)
+		pthread_cond_wait(&wq->idle_cond, &wq->mutex);
+	pthread_mutex_unlock(&wq->mutex);
+}
@@ -0,0 +1,60 @@
+#ifndef __ZUNKFS_WORKQUEUE_H__
+#define __ZUNKFS_WORKQUEUE_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "list.h"
+
+/*
+ * Simple bounded work queue, serviced by a fixed number of
+ * detached worker threads. Threads are started on first use,
+ * so queues can be declared statically and survive a fork()
+ * done before anything is queued (fuse_main() daemonizes.)
+ */
+struct work {
+	void (*func)(struct work *work);
+	struct list_head work_entry;
+};
+
+struct workqueue {
+	const char *name;
+	unsigned max_threads;
+	unsigned max_pending;
+	unsigned nr_threads;
+	unsigned nr_pending;
+	unsigned nr_running;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct list_head pending;
+};
+
+#define DECLARE_WORKQUEUE(wq, threads, max) \
+	struct workqueue wq = { \
+		.name = #wq, \
+		.max_threads = (threads), \
+		.max_pending = (max), \
+		.mutex = PTHREAD_MUTEX_INITIALIZER, \
+		.work_cond = PTHREAD_COND_INITIALIZER, \
+		.idle_cond = PTHREAD_COND_INITIALIZER, \
+		.pending = LIST_HEAD_INIT(wq.pending), \
+	}
+
+static inline void init_work(struct work *work, void (*func)(struct work *))
+{
+	work->func = func;
+	list_head_init(&work->work_entry);
+}
+
+/*
+ * Returns false if the queue is full, or no worker could be started.
+ * The work is not queued in that case.
+ */
+bool queue_work(struct workqueue *wq, struct work *work);
+
+/*
+ * Wait for all queued work to complete.
+ */
+void flush_workqueue(struct workqueue *wq);
+
+#endif
@@ -74,6 +74,9 @@ struct push_request {
 #define FORWARD_CHUNK_LEN	(sizeof(FORWARD_CHUNK) - 1)
 #define PUSH_CHUNK		"push_chunk"
 #define PUSH_CHUNK_LEN		(sizeof(PUSH_CHUNK) - 1)
+#define HAS_CHUNK		"has_chunk"
+#define HAS_CHUNK_LEN		(sizeof(HAS_CHUNK) - 1)
+#define HAVE_CHUNK		"have_chunk"
 
 #define NODE_VEC_MAX	5
 
@@ -442,31 +445,42 @@ static void nearest_nodes(const unsigned char *key, struct evbuffer *output,
 
 static int find_value(const unsigned char *key, struct evbuffer *output)
 {
-	unsigned char value[CHUNK_SIZE];
-	int len;
+	unsigned char *value;
+	bool found;
 
-	len = read_chunk(value, key);
+	value = malloc(CHUNK_SIZE);
+	if (!value)
+		return 0;
+
+	found = read_chunk(value, key);
 
-	TRACE("read_chunk %s len=%d\n", digest_string(key), len);
+	TRACE("read_chunk %s found=%d\n", digest_string(key), found);
 
-	if (len == CHUNK_SIZE) {
+	if (found) {
 		evbuffer_add_printf(output, "%s ", STORE_CHUNK);
 		base64_encode_evbuf(output, value, CHUNK_SIZE);
 		evbuffer_add(output, "\r\n", 2);
-		return 1;
 	}
 
-	return 0;
+	free(value);
+	return found;
 }
 
 static int store_value(const char *value, unsigned char *digest)
 {
-	unsigned char chunk[CHUNK_SIZE];
+	unsigned char *chunk;
+	int err;
 
-	if (base64_decode(value, chunk, CHUNK_SIZE) != CHUNK_SIZE)
-		return -EINVAL;
+	chunk = malloc(CHUNK_SIZE);
+	if (!chunk)
+		return -ENOMEM;
 
-	return write_chunk(chunk, digest);
+	err = -EINVAL;
+	if (base64_decode(value, chunk, CHUNK_SIZE) == CHUNK_SIZE)
+		err = write_chunk(chunk, digest) ? CHUNK_SIZE : -EIO;
+
+	free(chunk);
+	return err;
 }
 
 static void request_timeoutcb(int fd, short event, void *arg)
@@ -706,6 +720,20 @@ static void proc_msg(const char *buf, size_t len, struct node *node)
 
 		request_done(msg, output);
 		
+	} else if (!strncmp(msg, HAS_CHUNK, HAS_CHUNK_LEN)) {
+		msg += HAS_CHUNK_LEN + 1;
+		len -= HAS_CHUNK_LEN + 1;
+
+		__string_digest(msg, digest);
+
+		if (has_chunk(digest))
+			evbuffer_add_printf(output, "%s %s\r\n", HAVE_CHUNK,
+					msg);
+		else
+			nearest_nodes(digest, output, NODE_VEC_MAX, node);
+
+		request_done(msg, output);
+
 	} else if (!strncmp(msg, STORE_CHUNK, STORE_CHUNK_LEN)) {
 		msg += STORE_CHUNK_LEN + 1;
 		len -= STORE_CHUNK_LEN + 1;
@@ -853,6 +881,7 @@ enum {
 	OPT_FORWARD_TIMEOUT = 't',
 	OPT_MAX_FORWARD = 'x',
 	OPT_SLOW_UPLINK = 's',
+	OPT_CHUNK_SIZE = 'C',
 };
 
 static const char short_opts[] = {
@@ -866,6 +895,7 @@ static const char short_opts[] = {
 	OPT_FORWARD_TIMEOUT, OPT_REQUIRED_ARG,
 	OPT_MAX_FORWARD, OPT_REQUIRED_ARG,
 	OPT_SLOW_UPLINK,
+	OPT_CHUNK_SIZE, OPT_REQUIRED_ARG,
 	0
 };
 
@@ -880,6 +910,7 @@ static const struct option long_opts[] = {
 	{ "max-forwards", required_argument, NULL, OPT_MAX_FORWARD },
 	{ "log", required_argument, NULL, OPT_LOG },
 	{ "slow-uplink", no_argument, NULL, OPT_SLOW_UPLINK },
+	{ "chunk-size", required_argument, NULL, OPT_CHUNK_SIZE },
 	{ NULL }
 };
 
@@ -900,6 +931,10 @@ static const struct option long_opts[] = {
 "                                  Use to limit memory usage. Default = 1000\n"\
 "-s|--slow-uplink                  Uplink is slow, use push method to store\n"\
 "                                  chunks on other nodes.\n"\
+"-C|--chunk-size <bytes>           Size of the chunks served, which must\n"\
+"                                  match the filesystems using them.\n"\
+"                                  Must come before any --chunk-db.\n"\
+"                                  Default = 65536.\n"\
 "\nChunk-db specs:\n"
 
 static void usage(int exit_code)
@@ -976,6 +1011,19 @@ static int proc_opt(int opt, char *arg)
 		slow_uplink = 1;
 		return 0;
 
+	case OPT_CHUNK_SIZE:
+		if (nr_chunkdbs) {
+			fprintf(stderr, "Chunk size must be set before "
+					"adding chunk-dbs.\n");
+			return -EINVAL;
+		}
+		err = set_chunk_size(strtoul(arg, &errstr, 0));
+		if (err || *errstr) {
+			fprintf(stderr, "Invalid chunk size: %s\n", arg);
+			return -EINVAL;
+		}
+		return 0;
+
 	default:
 		return -1;
 	}
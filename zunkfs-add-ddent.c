@@ -19,6 +19,7 @@
 #include "chunk-db.h"
 #include "dir.h"
 #include "digest.h"
+#include "chunk-crypt.h"
 #include "utils.h"
 
 static const char *prog;
@@ -75,7 +76,11 @@ static const struct option long_opts[] = {
 
 #define USAGE \
 "<file|dir> <digest> <secret digest> <size> <crypto> <name>\n"\
-"Supported crypto methods: xor, blowfish\n"\
+"Supported crypto methods: xor, blowfish, aes\n"\
+"Append \",short\" to the crypto method if the secret digest is\n"\
+"the file's key, then \",lz\" for compressed chunks, then \",cdc\"\n"\
+"for content-defined chunks, or \",index\" for directories with\n"\
+"a name index.\n"\
 "-h|--help\n"\
 "-d|--chunk-db <spec>\n"\
 "-l|--log [<E|W|T>,]<file|stderr|stdout>\n"
@@ -118,9 +123,9 @@ static void proc_opt(int opt, char *arg)
 int main(int argc, char **argv)
 {
 	char cwd[1024];
-	int i, fd, err, opt;
+	int i, fd, err, opt, cipher;
 	struct disk_dentry new_ddent;
-	char *crypto;
+	char *crypto, *shrt, *lz, *cdc, *idx;
 
 	prog = basename(argv[0]);
 
@@ -165,14 +170,28 @@ int main(int argc, char **argv)
 	}
 
 	crypto = argv[++i];
-	if (!strcmp(crypto, "xor"))
-		new_ddent.flags |= 0;
-	else if (!strcmp(crypto, "blowfish"))
-		new_ddent.flags |= DDENT_USE_BLOWFISH;
-	else {
+	if ((idx = strstr(crypto, ",index")) && !idx[6]) {
+		new_ddent.flags |= DDENT_DIR_INDEX;
+		*idx = '\0';
+	}
+	if ((cdc = strstr(crypto, ",cdc")) && !cdc[4]) {
+		new_ddent.flags |= DDENT_CDC;
+		*cdc = '\0';
+	}
+	if ((lz = strstr(crypto, ",lz")) && !lz[3]) {
+		new_ddent.flags |= DDENT_COMPRESS;
+		*lz = '\0';
+	}
+	if ((shrt = strstr(crypto, ",short")) && !shrt[6]) {
+		new_ddent.flags |= DDENT_SHORT_SECRET;
+		*shrt = '\0';
+	}
+	cipher = find_chunk_cipher(crypto);
+	if (cipher < 0) {
 		fprintf(stderr, "Unknown crypto method: %s\n", crypto);
 		usage(-1);
 	}
+	new_ddent.flags |= cipher;
 
 	if (snprintf((char*)new_ddent.name, DDENT_NAME_MAX, "%s", argv[++i]) >=
 			DDENT_NAME_MAX) {
@@ -14,6 +14,7 @@
 #include "zunkfs.h"
 #include "chunk-db.h"
 #include "dir.h"
+#include "chunk-crypt.h"
 
 static unsigned full_output = 0;
 
@@ -110,7 +111,7 @@ static int read_dentry(int fd, struct disk_dentry *de)
 
 int main(int argc, char **argv)
 {
-	const char *crypto;
+	char crypto[32];
 	char cwd[1024];
 	int fd, opt;
 
@@ -142,10 +143,16 @@ int main(int argc, char **argv)
 		if (!err)
 			break;
 
-		if ((dentry.flags & DDENT_USE_BLOWFISH))
-			crypto = "blowfish";
-		else
-			crypto = "xor";
+		snprintf(crypto, sizeof(crypto), "%s%s%s%s%s",
+				chunk_cipher_name(dentry.flags &
+					DDENT_CRYPTO_MASK) ?: "unknown",
+				(dentry.flags & DDENT_SHORT_SECRET) ?
+				",short" : "",
+				(dentry.flags & DDENT_COMPRESS) ? ",lz" : "",
+				(dentry.flags & DDENT_CDC) ? ",cdc" : "",
+				(dentry.flags & DDENT_DIR_INDEX) ? ",index" : "");
+		if ((dentry.flags & DDENT_INLINE))
+			strcpy(crypto, "inline");
 
 		if (full_output) {
 			printf("%s %s 0%0o %"PRIu64" %u %u %s %s\n", 
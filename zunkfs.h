@@ -1,26 +1,90 @@
 #ifndef __ZUNKFS_H__
 #define __ZUNKFS_H__
 
-#ifndef CHUNK_SIZE
-#define CHUNK_SIZE		(1UL << 16)
-#endif
-
 #include <string.h>
 #include <stdbool.h>
 
 #include "digest.h"
 
+/*
+ * Chunk size is a property of the filesystem, so it's only known at
+ * runtime. It's always a power of two, between 4K and CHUNK_SIZE_MAX,
+ * and must be set before any chunks are read or written.
+ * CHUNK_SIZE_DEFAULT is used by new filesystems, and by old ones that
+ * don't record their chunk size.
+ */
+#define CHUNK_SHIFT_MIN		12
+#define CHUNK_SHIFT_MAX		20
+#define CHUNK_SIZE_MAX		(1UL << CHUNK_SHIFT_MAX)
+
+#ifndef CHUNK_SIZE_DEFAULT
+#define CHUNK_SIZE_DEFAULT	(1UL << 16)
+#endif
+
+extern unsigned chunk_shift;
+extern unsigned long digests_per_chunk;
+
+#define CHUNK_SIZE		(1UL << chunk_shift)
+
+/*
+ * Returns -EINVAL for sizes that aren't a power of two in range.
+ */
+int set_chunk_size(unsigned long size);
+
 #define CHUNK_DIGEST_LEN	SHA_DIGEST_LENGTH
 #define CHUNK_DIGEST_STRLEN	SHA_DIGEST_STRLEN
-#define DIGESTS_PER_CHUNK	(CHUNK_SIZE / CHUNK_DIGEST_LEN)
+#define DIGESTS_PER_CHUNK	digests_per_chunk
+
+/*
+ * Upper bound on the number of chunks callers should batch
+ * into a single read_chunks()/write_chunks() call.
+ */
+#define CHUNK_BATCH_MAX		16
 
 /*
  * write_chunk() updates 'digest' field.
  */
 bool write_chunk(const unsigned char *chunk, unsigned char *digest);
 bool read_chunk(unsigned char *chunk, const unsigned char *digest);
-void zero_chunk_digest(unsigned char *digest);
+/*
+ * Vectored versions. read_chunks() sets found[i] for every chunk
+ * it finds, and returns the number of chunks found. write_chunks()
+ * updates all of 'digests', and returns true only if all chunks
+ * were written.
+ */
+bool write_chunks(const unsigned char **chunks, unsigned char **digests,
+		unsigned count);
+unsigned read_chunks(unsigned char **chunks, const unsigned char **digests,
+		bool *found, unsigned count);
+bool has_chunk(const unsigned char *digest);
 int random_chunk_digest(unsigned char *digest);
+/*
+ * Fills 'chunk' with random data, and stores it.
+ */
+bool random_chunk(unsigned char *chunk, unsigned char *digest);
+
+/*
+ * Chunks of all zeros (holes) are never stored. They are named by
+ * an all-zero digest, which no stored chunk will have, and are
+ * zero-filled when read.
+ */
+void zero_chunk_digest(unsigned char *digest);
+
+static inline bool is_zero_digest(const unsigned char *digest)
+{
+	int i;
+
+	for (i = 0; i < CHUNK_DIGEST_LEN; i ++)
+		if (digest[i])
+			return false;
+
+	return true;
+}
+
+static inline bool is_zero_chunk(const unsigned char *chunk)
+{
+	return !chunk[0] && !memcmp(chunk, chunk + 1, CHUNK_SIZE - 1);
+}
 
 static inline int verify_chunk(const unsigned char *chunk,
 		const unsigned char *digest)
@@ -28,5 +92,19 @@ static inline int verify_chunk(const unsigned char *chunk,
 	return verify_digest(digest, chunk, CHUNK_SIZE);
 }
 
+/*
+ * Length of a chunk without its trailing zeros. Chunk-dbs may
+ * store just that much, and zero-fill the rest on read.
+ */
+static inline unsigned chunk_data_len(const unsigned char *chunk)
+{
+	unsigned len = CHUNK_SIZE;
+
+	while (len && !chunk[len - 1])
+		len --;
+
+	return len;
+}
+
 #endif
 